@@ -111,6 +111,11 @@ public:
     // whitespace ignore fnv1a (any sequence whitespace is replaced by one space)
     unsigned int fnv1a_ws(unsigned int seed = 2166136261) const;
 
+	// get a fast hash for lookups, 8 characters at a time. Not fnv1a compatible
+	// and may differ between platforms so use fnv1a for hashes that are saved.
+	unsigned int hash(unsigned int seed = 0) const;
+	unsigned int hash_lower(unsigned int seed = 0) const;	// hash of english latin lowercase string
+
 	// convert string to basic integer
 	int64_t atoi() const;
 	uint64_t atoui() const;
@@ -696,6 +701,7 @@ public:
 
 	// get fnv1a hash for string
 	unsigned int fnv1a(unsigned int seed = 2166136261) const { return get_strref().fnv1a(seed);  }
+	unsigned int hash(unsigned int seed = 0) const { return get_strref().hash(seed); }
 	unsigned int fnv1a_append(unsigned int base_fnv1a_hash) const { return get_strref().fnv1a(base_fnv1a_hash); }
 
 	// whole string compare
@@ -1452,6 +1458,86 @@ unsigned int strref::fnv1a_lower(unsigned int seed) const
 	return hash;
 }
 
+#if !defined(__SIZEOF_INT128__) && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h> // _umul128
+#endif
+
+// multiply two 64 bit values and fold the 128 bit result
+static inline uint64_t int_hash_mix(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)a * b;
+	return uint64_t(r) ^ uint64_t(r >> 64);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+	uint64_t hi, lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	// schoolbook multiply of 32 bit limbs, each partial sum fits in 64 bits with its carries
+	uint64_t a0 = a & 0xffffffff, a1 = a >> 32, b0 = b & 0xffffffff, b1 = b >> 32;
+	uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	uint64_t mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+	uint64_t lo = (mid << 32) | (p00 & 0xffffffff);
+	uint64_t hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+	return lo ^ hi;
+#endif
+}
+
+// english latin lowercase of 8 characters without branches
+static inline uint64_t int_tolower_ascii7_64(uint64_t v)
+{
+	const uint64_t high = 0x8080808080808080ULL, low7 = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t heptets = v & low7;
+	uint64_t above_z = heptets + 0x2525252525252525ULL;	// high bit set if > 'Z'
+	uint64_t from_a = heptets + 0x3f3f3f3f3f3f3f3fULL;	// high bit set if >= 'A'
+	uint64_t upper = ~v & (from_a ^ above_z) & high;
+	return v | (upper >> 2);
+}
+
+// read 4 unaligned bytes
+static inline uint64_t int_hash_read4(const uint8_t *scan)
+{
+	uint32_t v;
+	memcpy(&v, scan, 4);
+	return v;
+}
+
+// hash 8 characters at a time with a multiply mix, the last 1-8 characters are read
+// as an overlapping 8 byte word or built from overlapping 4 byte or single byte reads
+static inline unsigned int int_hash(const uint8_t *scan, strl_t length, unsigned int seed, bool lower)
+{
+	const uint64_t k0 = 0xa0761d6478bd642fULL, k1 = 0xe7037ed1a0b428dbULL, k2 = 0x8ebc6af09c88c6e3ULL;
+	uint64_t hash = (uint64_t(seed) ^ k0) + uint64_t(length) * k2;
+	uint64_t v = 0;
+	if (length > 8) {
+		strl_t left = length;
+		while (left > 8) {
+			memcpy(&v, scan, 8);
+			hash = int_hash_mix((lower ? int_tolower_ascii7_64(v) : v) ^ k1, hash ^ k2);
+			scan += 8;
+			left -= 8;
+		}
+		memcpy(&v, scan + left - 8, 8);
+	} else if (length >= 4) {
+		v = (int_hash_read4(scan) << 32) | int_hash_read4(scan + length - 4);
+	} else if (length) {
+		v = (uint64_t(scan[0]) << 16) | (uint64_t(scan[length >> 1]) << 8) | scan[length - 1];
+	}
+	hash = int_hash_mix((lower ? int_tolower_ascii7_64(v) : v) ^ k1, hash ^ k0);
+	return (unsigned int)(hash ^ (hash >> 32));
+}
+
+// get fast lookup hash of a string
+unsigned int strref::hash(unsigned int seed) const
+{
+	return int_hash(get_u(), string ? length : 0, seed, false);
+}
+
+// get fast lookup hash of a string as english latin lowercase
+unsigned int strref::hash_lower(unsigned int seed) const
+{
+	return int_hash(get_u(), string ? length : 0, seed, true);
+}
+
 // get fnv1a hash of a string and treat any number whitespace as a single space
 unsigned int strref::fnv1a_ws(unsigned int seed) const
 {
@@ -1740,10 +1826,31 @@ strref strref::skip_bom()
 	return *this;
 }
 
+// SSE2 is always available on x64, define STRUSE_NO_SIMD to use the plain loops instead
+#if !defined(STRUSE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2))
+#define STRUSE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int int_first_bit(unsigned int mask) { unsigned long index; _BitScanForward(&index, mask); return (int)index; }
+#else
+static inline int int_first_bit(unsigned int mask) { return __builtin_ctz(mask); }
+#endif
+#endif
+
 // find a character in a string
 static int int_find_char(char c, const char *scan, strl_t length)
 {
 	strl_t left = length;
+#ifdef STRUSE_SSE2
+	const __m128i match = _mm_set1_epi8(c);
+	while (left >= 16) {
+		if (unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)scan), match)))
+			return int(length - left) + int_first_bit(mask);
+		scan += 16;
+		left -= 16;
+	}
+#endif
 	while (left) {
 		if (*scan++ == c)
 			return int(length - left);
@@ -1752,6 +1859,29 @@ static int int_find_char(char c, const char *scan, strl_t length)
 	return -1;
 }
 
+// find either of two characters in a string
+static int int_find_char2(char c, char d, const char *scan, strl_t length)
+{
+	strl_t left = length;
+#ifdef STRUSE_SSE2
+	const __m128i match_c = _mm_set1_epi8(c), match_d = _mm_set1_epi8(d);
+	while (left >= 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)scan);
+		if (unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chars, match_c), _mm_cmpeq_epi8(chars, match_d))))
+			return int(length - left) + int_first_bit(mask);
+		scan += 16;
+		left -= 16;
+	}
+#endif
+	while (left) {
+		char n = *scan++;
+		if (n == c || n == d)
+			return int(length - left);
+		left--;
+	}
+	return -1;
+}
+
 // find a character in a string after pos
 int strref::find(char c) const
 {
@@ -1835,16 +1965,9 @@ int strref::find_last(char c) const
 // find first position of either c or d
 int strref::find(char c, char d) const
 {
-	strl_t left = length;
-	if (const char *scan = string) {
-		while (left) {
-			char n = *scan++;
-			if (n == c || n == d)
-				return int(length - left);
-			left--;
-		}
-	}
-	return -1;
+	if (!string)
+		return -1;
+	return int_find_char2(c, d, string, length);
 }
 
 // find last instance of either character c or d
@@ -1971,12 +2094,8 @@ strl_t strref::len_eol() const
 	const char *str = string;
 	if (!left || !str)
 		return 0;
-	while (left && *str!=0x0d && *str!=0x0a) {
-		str++;
-		left--;
-	}
-
-	return length-left;
+	int eol = int_find_char2(0x0d, 0x0a, str, left);
+	return eol<0 ? length : strl_t(eol);
 }
 
 // length of string with escape characters counting as one
@@ -2406,12 +2525,17 @@ int strref::find(const strref str) const
 	strl_t find_len = str.length;
 
 	uint8_t c = int_tolower_ascii7(*compare++);
+	uint8_t u = int_toupper_ascii7(c);
 
 	while (left>=find_len) {
-		if (int_tolower_ascii7(*scan++)==c) {
-			if (int_compare_substr(scan, left - 1, compare, find_len - 1))
-				return int(length-left);
-		}
+		// skip ahead to the next possible first character
+		int o = int_find_char2((char)c, (char)u, (const char*)scan, left - find_len + 1);
+		if (o<0)
+			break;
+		scan += o + 1;
+		left -= strl_t(o);
+		if (int_compare_substr(scan, left - 1, compare, find_len - 1))
+			return int(length-left);
 		left--;
 	}
 	return -1;
@@ -3101,8 +3225,9 @@ int strref::substr_case_count(const strref str) const
 	char c = str.get_first();
 	
 	while (left>=substrlen) {
-		while (left && *scan++!=c)
-			left--;
+		int o = int_find_char(c, scan, left);
+		scan += o<0 ? left : strl_t(o+1);
+		left = o<0 ? 0 : left-strl_t(o);
 		if (left && left>=substrlen) {
 			// first character matches and enough characters remain for a potential match
 			const char *compare = str.string+1;
@@ -4246,9 +4371,10 @@ strref strref::next_line()
 	const char *scan = start;
 	strl_t left = length; // if not valid left=0 and no characters will be interpreted
 	strref ret;
-	while (left && *scan!=0x0a && *scan!=0x0d) {
-		scan++;
-		left--;
+	if (left) {
+		int eol = int_find_char2(0x0a, 0x0d, scan, left);
+		scan += eol<0 ? left : strl_t(eol);
+		left -= eol<0 ? left : strl_t(eol);
 	}
 	// this is the line to return
 	ret = strref(start, strl_t(scan-start));
@@ -4277,9 +4403,10 @@ strref strref::get_line() const
 	const char *scan = start;
 	strl_t left = length; // if not valid left=0 and no characters will be interpreted
 	strref ret;
-	while (left && *scan!=0x0a && *scan!=0x0d) {
-		scan++;
-		left--;
+	if (left) {
+		int eol = int_find_char2(0x0a, 0x0d, scan, left);
+		scan += eol<0 ? left : strl_t(eol);
+		left -= eol<0 ? left : strl_t(eol);
 	}
 	// this is the line to return
 	return strref(start, strl_t(scan-start));
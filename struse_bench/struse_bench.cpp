@@ -0,0 +1,714 @@
+//
+//  struse_bench.cpp
+//  struse_bench
+//
+//	Micro benchmarks of the struse.h primitives that x65 uses for every
+//	source line. Each primitive runs on generated assembler source (short
+//	labels, long lines, a large file) or on a source file given on the
+//	command line and reports ns/op and MB/s.
+//
+//	To compare two builds (for example with and without STRUSE_NO_SIMD, or
+//	before and after a change to struse.h) save the results of one build
+//	and compare the other build against it:
+//		struse_bench -save=before.txt
+//		struse_bench -compare=before.txt
+//
+//	The SSE2 paths of struse.h are checked against the plain loops the same
+//	way, the results of every checked primitive at each alignment are saved
+//	by a STRUSE_NO_SIMD build and compared by an SSE2 build:
+//		struse_bench -verify=scalar.txt		(built with STRUSE_NO_SIMD)
+//		struse_bench -verify=scalar.txt		(built with SSE2)
+//
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Carl-Henrik Skårstedt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+// is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+// FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// Details, source and documentation at https://github.com/Sakrac/x65.
+//
+// "struse.h" can be found at https://github.com/Sakrac/struse, only the header file is required.
+//
+
+#define _CRT_SECURE_NO_WARNINGS		// Windows shenanigans
+#define STRUSE_IMPLEMENTATION		// include implementation of struse in this file
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <chrono>
+#include <vector>
+#include "struse.h"
+
+#define BENCH_RUNS 5				// best of this many timed runs is reported
+#define DEFAULT_RUN_MS 50			// minimum time of one timed run
+#define LARGE_FILE_SIZE (4<<20)		// size of the generated large file
+#define MAX_BENCH_RESULTS 64
+#define VERIFY_TEXT_SIZE (64<<10)	// bytes of text each primitive is checked on
+#define VERIFY_ALIGNMENTS 16		// results are kept apart by start address modulo this
+
+//
+//
+// CORPORA
+//
+//
+
+// deterministic random numbers so every build measures the same text
+static uint32_t bench_seed = 0x6502;
+static uint32_t Rand(uint32_t range) {
+	bench_seed = bench_seed * 1664525 + 1013904223;
+	return (bench_seed >> 8) % range;
+}
+
+static const char *aMnemonics[] = {
+	"lda", "sta", "ldx", "stx", "ldy", "sty", "adc", "sbc", "cmp", "bne", "beq", "bcc",
+	"jsr", "jmp", "inx", "dey", "LDA", "STA", "and", "ora", "eor", "asl", "lsr", "rts"
+};
+static const char *aLabelParts[] = {
+	"Screen", "Row", "Ptr", "zp", "Tmp", "Sprite", "Color", "_tab", "Lo", "Hi", "Count",
+	"Irq", "Music", "Frame", "Char", "Set", "Src", "Dst", "Len", "Idx", "Scroll", "X", "Y"
+};
+static const char *aComments[] = {
+	"set up the pointer to the next row of the screen", "wait for the raster to pass",
+	"copy a page", "TODO: this could be unrolled", "carry is clear here",
+	"self modified", "keep the low byte for later"
+};
+#define ARRAY_COUNT(a) (sizeof(a)/sizeof(a[0]))
+
+static void AddLabel(strown<64> &label) {
+	if (Rand(6)==0) { label.append('.'); }
+	for (int p = 1 + Rand(3); p; --p) { label.append(aLabelParts[Rand(ARRAY_COUNT(aLabelParts))]); }
+	if (Rand(3)==0) { label.sprintf_append("%d", Rand(16)); }
+}
+
+// one line of source, may be a label, an instruction with a comment or data
+static void AddSourceLine(strown<256> &line) {
+	strown<64> label;
+	switch (Rand(8)) {
+		case 0:
+			AddLabel(label);
+			line.append(label.get_strref()).append(':');
+			break;
+		case 1:
+			line.append("\tdc.b ");
+			for (int n = 4 + Rand(12); n; --n) {
+				line.sprintf_append(Rand(2) ? "$%02x" : "%d", Rand(256));
+				if (n > 1) { line.append(", "); }
+			}
+			break;
+		default:
+			AddLabel(label);
+			line.append('\t').append(aMnemonics[Rand(ARRAY_COUNT(aMnemonics))]).append(' ');
+			switch (Rand(4)) {
+				case 0: line.sprintf_append("#$%02x", Rand(256)); break;
+				case 1: line.append(label.get_strref()).append(",x"); break;
+				case 2: line.append('(').append(label.get_strref()).append("),y"); break;
+				default: line.append(label.get_strref()).sprintf_append("+%d", Rand(40)); break;
+			}
+			if (Rand(2)) { line.append("\t\t; ").append(aComments[Rand(ARRAY_COUNT(aComments))]); }
+			break;
+	}
+}
+
+struct Corpora {
+	std::vector<char> labelText;	// storage for the labels
+	std::vector<strref> labels;		// short labels
+	std::vector<char> lineText;		// storage for the long lines
+	std::vector<strref> lines;		// long source lines with operands and comments
+	std::vector<char> numberText;	// storage for the numbers
+	std::vector<strref> decimals;	// decimal numbers as in expressions
+	std::vector<strref> hexes;		// hexadecimal numbers without the '$'
+	std::vector<char> file;			// a large source file
+	strref macro;					// a macro body with parameters
+	size_t labelBytes, lineBytes, decimalBytes, hexBytes;
+
+	static size_t Bytes(const std::vector<strref> &strs) {
+		size_t bytes = 0;
+		for (size_t i = 0; i < strs.size(); ++i) { bytes += strs[i].get_len(); }
+		return bytes;
+	}
+
+	void Build(strref source) {
+		// labels
+		strown<64> label;
+		for (int l = 0; l < 4096; ++l) {
+			label.clear();
+			AddLabel(label);
+			labelText.insert(labelText.end(), label.get(), label.get() + label.get_len());
+			labelText.push_back(0);
+		}
+		for (const char *s = &labelText[0], *e = s + labelText.size(); s < e; s += strlen(s) + 1) {
+			labels.push_back(strref(s));
+		}
+
+		// large file, generated or from the command line
+		if (source) {
+			file.assign(source.get(), source.get() + source.get_len());
+		} else {
+			strown<256> line;
+			file.reserve(LARGE_FILE_SIZE + 256);
+			while (file.size() < LARGE_FILE_SIZE) {
+				line.clear();
+				AddSourceLine(line);
+				line.append('\n');
+				file.insert(file.end(), line.get(), line.get() + line.get_len());
+			}
+		}
+
+		// long lines are the longest lines of the large file
+		strref scan(&file[0], (strl_t)file.size());
+		while (scan && lineText.size() < (256<<10)) {
+			strref line = scan.next_line();
+			if (line.get_len() >= 24) {
+				lineText.insert(lineText.end(), line.get(), line.get() + line.get_len());
+				lineText.push_back(0);
+			}
+		}
+		if (lineText.empty()) { lineText.push_back(0); }
+		for (const char *s = &lineText[0], *e = s + lineText.size(); s < e; s += strlen(s) + 1) {
+			lines.push_back(strref(s));
+		}
+
+		// numbers
+		strown<32> num;
+		for (int n = 0; n < 8192; ++n) {
+			num.clear();
+			if (n & 1) { num.sprintf("%x", Rand(n & 2 ? 0x100 : 0x10000)); }
+			else { num.sprintf("%d", Rand(n & 2 ? 10 : 65536)); }
+			numberText.insert(numberText.end(), num.get(), num.get() + num.get_len());
+			numberText.push_back(0);
+		}
+		int index = 0;
+		for (const char *s = &numberText[0], *e = s + numberText.size(); s < e; s += strlen(s) + 1) {
+			(index++ & 1 ? hexes : decimals).push_back(strref(s));
+		}
+
+		macro = strref("\tlda src,x\n\tsta dst,y\t; copy src to dst\n\tlda src+1,x\n\tsta dst+1,y\n"
+			"\tinx\n\tcpx #len\n\tbne .loop\t; keep srcdst apart\n\tlda src_end\n\tsta dst.hi\n");
+
+		labelBytes = Bytes(labels);
+		lineBytes = Bytes(lines);
+		decimalBytes = Bytes(decimals);
+		hexBytes = Bytes(hexes);
+	}
+};
+
+//
+//
+// VERIFY
+//
+//
+
+// Each primitive is called on every start address of the text with a range of
+// lengths so that the SSE2 loops start at every alignment and end with every
+// remainder. The results are folded into one digest per primitive and alignment.
+struct VerifyResult {
+	strown<32> name;
+	uint64_t count;
+	uint64_t digest;
+};
+
+struct VerifyDigest {
+	const char *base;				// positions are folded relative to the text
+	uint64_t count[VERIFY_ALIGNMENTS];
+	uint64_t digest[VERIFY_ALIGNMENTS];
+
+	void Add(int align, int64_t value) {
+		digest[align] = (digest[align] ^ (uint64_t)value) * 0x100000001b3ULL;
+		++count[align];
+	}
+	void Add(int align, strref str) {
+		Add(align, str.get() ? int64_t(str.get() - base) : -1);
+		Add(align, str.get_len());
+	}
+};
+
+typedef void (*VerifyFunc)(strref str, int align, VerifyDigest &d);
+
+static void VerifyFindChar(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.find(';'));
+	d.Add(align, str.find('\n'));
+	d.Add(align, str.find((char)0xe9));
+	d.Add(align, str.find_at('$', str.get_len() / 3));
+}
+
+static void VerifyFindChar2(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.find('\r', '\n'));
+	d.Add(align, str.find(',', ')'));
+}
+
+static void VerifyFindStr(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.find("Row"));
+	d.Add(align, str.find("lda"));
+	d.Add(align, str.find("\r\n"));
+	d.Add(align, str.find("Screen"));
+	d.Add(align, str.find("\xe9t"));
+}
+
+static void VerifySubstrCaseCount(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.substr_case_count("row"));
+	d.Add(align, str.substr_case_count("LDA"));
+	d.Add(align, str.substr_case_count("$"));
+}
+
+static void VerifyLenEol(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.len_eol());
+}
+
+static void VerifyLine(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.get_line());
+	strref next = str;
+	d.Add(align, next.next_line());
+	d.Add(align, next);
+}
+
+static void VerifyBeforeOrFull(strref str, int align, VerifyDigest &d) {
+	d.Add(align, str.before_or_full(';'));
+	d.Add(align, str.before_or_full(strref("\t;")));
+}
+
+struct Verify {
+	const char *name;
+	VerifyFunc func;
+};
+
+static const Verify aVerify[] = {
+	{ "find_char", VerifyFindChar },
+	{ "find_char2", VerifyFindChar2 },
+	{ "find_str", VerifyFindStr },
+	{ "substr_case_count", VerifySubstrCaseCount },
+	{ "len_eol", VerifyLenEol },
+	{ "line", VerifyLine },
+	{ "before_or_full", VerifyBeforeOrFull },
+};
+static const int nVerify = sizeof(aVerify) / sizeof(aVerify[0]);
+#define MAX_VERIFY_RESULTS (sizeof(aVerify) / sizeof(aVerify[0]) * VERIFY_ALIGNMENTS)
+
+// lengths around the 16 byte steps of the SSE2 loops
+static const strl_t aVerifyLengths[] = { 0, 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 100, 255, 1000 };
+
+// run each primitive on text from the large file with some line feeds, carriage returns
+// and characters above 127 mixed in, at every alignment of a 16 byte aligned copy
+static int RunVerify(const Corpora &c, VerifyResult *results) {
+	size_t size = c.file.size() < VERIFY_TEXT_SIZE ? c.file.size() : VERIFY_TEXT_SIZE;
+	std::vector<char> store(size + VERIFY_ALIGNMENTS);
+	char *text = &store[0] + ((VERIFY_ALIGNMENTS - ((uintptr_t)&store[0] & (VERIFY_ALIGNMENTS-1))) & (VERIFY_ALIGNMENTS-1));
+	memcpy(text, &c.file[0], size);
+	for (size_t i = 0; i < size; i += 1 + Rand(97)) {
+		static const char aMix[] = { '\r', '\n', (char)0xe9, (char)0x80, ';', 0 };
+		text[i] = aMix[Rand(sizeof(aMix))];
+	}
+
+	int num_results = 0;
+	for (int v = 0; v < nVerify; ++v) {
+		VerifyDigest d;
+		memset(&d, 0, sizeof(d));
+		d.base = text;
+		for (size_t pos = 0; pos < size; ++pos) {
+			int align = int(pos & (VERIFY_ALIGNMENTS-1));
+			for (size_t l = 0; l < sizeof(aVerifyLengths) / sizeof(aVerifyLengths[0]); ++l) {
+				strl_t len = aVerifyLengths[l];
+				if ((pos + len) <= size) { aVerify[v].func(strref(text + pos, len), align, d); }
+			}
+		}
+		for (int a = 0; a < VERIFY_ALIGNMENTS; ++a) {
+			VerifyResult &r = results[num_results++];
+			r.name.sprintf("%s/+%d", aVerify[v].name, a);
+			r.count = d.count[a];
+			r.digest = d.digest[a];
+		}
+	}
+	return num_results;
+}
+
+#ifdef STRUSE_SSE2
+// verify results saved as one "name count digest" line per primitive and alignment
+static int LoadVerify(const char *filename, VerifyResult *results, int max_results) {
+	FILE *f = fopen(filename, "r");
+	if (!f) { return -1; }
+	int count = 0;
+	char name[64];
+	uint64_t num, digest;
+	while (count < max_results && fscanf(f, "%63s %" SCNu64 " %" SCNx64, name, &num, &digest) == 3) {
+		results[count].name.copy(name);
+		results[count].count = num;
+		results[count].digest = digest;
+		++count;
+	}
+	fclose(f);
+	return count;
+}
+#endif
+
+// a scalar build saves the reference results, an SSE2 build compares its results to them
+static int VerifySimd(const Corpora &c, const char *verify_file) {
+	VerifyResult results[MAX_VERIFY_RESULTS];
+	int num_results = RunVerify(c, results);
+#ifndef STRUSE_SSE2
+	if (FILE *f = fopen(verify_file, "w")) {
+		for (int r = 0; r < num_results; ++r) {
+			fprintf(f, "%s %" PRIu64 " %016" PRIx64 "\n", results[r].name.c_str(), results[r].count, results[r].digest);
+		}
+		fclose(f);
+		printf("struse_bench (scalar) saved %d verify results to \"%s\"\n", num_results, verify_file);
+		return 0;
+	}
+	fprintf(stderr, "Could not write verify results \"%s\"\n", verify_file);
+	return 1;
+#else
+	VerifyResult scalar[MAX_VERIFY_RESULTS];
+	int num_scalar = LoadVerify(verify_file, scalar, MAX_VERIFY_RESULTS);
+	if (num_scalar < 0) {
+		fprintf(stderr, "Could not read verify results \"%s\", save them with a STRUSE_NO_SIMD build first\n", verify_file);
+		return 1;
+	}
+	int failed = 0;
+	for (int r = 0; r < num_results; ++r) {
+		const VerifyResult *ref = nullptr;
+		for (int s = 0; s < num_scalar && !ref; ++s) {
+			if (scalar[s].name.same_str(results[r].name)) { ref = scalar + s; }
+		}
+		if (!ref) {
+			printf("%-24s missing from \"%s\"\n", results[r].name.c_str(), verify_file);
+			++failed;
+		} else if (ref->count != results[r].count || ref->digest != results[r].digest) {
+			printf("%-24s SSE2 differs from scalar\n", results[r].name.c_str());
+			++failed;
+		}
+	}
+	printf("struse_bench (SSE2) %d of %d verify results match scalar\n", num_results - failed, num_results);
+	return failed ? 1 : 0;
+#endif
+}
+
+//
+//
+// BENCHMARKS
+//
+//
+
+// each benchmark processes its corpus once and returns the number of operations,
+// the result is added to a checksum so the work can not be optimized out
+typedef size_t (*BenchFunc)(const Corpora &c, size_t &sum);
+volatile size_t bench_sink;
+
+static size_t BenchFnv1a(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.labels.size(); i < n; ++i) { sum += c.labels[i].fnv1a(); }
+	return c.labels.size();
+}
+
+static size_t BenchHash(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.labels.size(); i < n; ++i) { sum += c.labels[i].hash(); }
+	return c.labels.size();
+}
+
+static size_t BenchHashLower(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.labels.size(); i < n; ++i) { sum += c.labels[i].hash_lower(); }
+	return c.labels.size();
+}
+
+static size_t BenchFnv1aLines(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) { sum += c.lines[i].fnv1a(); }
+	return c.lines.size();
+}
+
+static size_t BenchFindChar(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) { sum += c.lines[i].find(';'); }
+	return c.lines.size();
+}
+
+static size_t BenchFindStr(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) { sum += c.lines[i].find("Row"); }
+	return c.lines.size();
+}
+
+static size_t BenchFindCase(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) { sum += c.lines[i].find_case("row"); }
+	return c.lines.size();
+}
+
+static size_t BenchFindWildcard(const Corpora &c, size_t &sum) {
+	strref wild("$*{0-9a-f}");
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) {
+		strref f = c.lines[i].find_wildcard(wild);
+		sum += f.get_len();
+	}
+	return c.lines.size();
+}
+
+static size_t BenchReplaceBookend(const Corpora &c, size_t &sum) {
+	static const strref label_end_char_range("!0-9a-zA-Z_@$!.");
+	strown<1024> exp;
+	for (int i = 0; i < 256; ++i) {
+		exp.copy(c.macro);
+		exp.replace_bookend("src", "ScreenRow", label_end_char_range);
+		exp.replace_bookend("dst", "ColorRow", label_end_char_range);
+		exp.replace_bookend("len", "40", label_end_char_range);
+		sum += exp.get_len();
+	}
+	return 256;
+}
+
+static size_t BenchSplitTokenTrim(const Corpora &c, size_t &sum) {
+	size_t ops = 0;
+	for (size_t i = 0, n = c.lines.size(); i < n; ++i) {
+		strref line = c.lines[i];
+		while (strref token = line.split_token_trim(',')) {
+			sum += token.get_len();
+			++ops;
+		}
+	}
+	return ops;
+}
+
+static size_t BenchCountLines(const Corpora &c, size_t &sum) {
+	sum += strref(&c.file[0], (strl_t)c.file.size()).count_lines();
+	return 1;
+}
+
+static size_t BenchNextLine(const Corpora &c, size_t &sum) {
+	size_t ops = 0;
+	strref scan(&c.file[0], (strl_t)c.file.size());
+	while (scan) {
+		sum += scan.next_line().get_len();
+		++ops;
+	}
+	return ops;
+}
+
+static size_t BenchAtoiSkip(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.decimals.size(); i < n; ++i) {
+		strref num = c.decimals[i];
+		sum += num.atoi_skip();
+	}
+	return c.decimals.size();
+}
+
+static size_t BenchAhextouiSkip(const Corpora &c, size_t &sum) {
+	for (size_t i = 0, n = c.hexes.size(); i < n; ++i) {
+		strref num = c.hexes[i];
+		sum += (size_t)num.ahextoui_skip();
+	}
+	return c.hexes.size();
+}
+
+enum BenchCorpus {
+	BC_LABELS,
+	BC_LINES,
+	BC_MACRO,
+	BC_FILE,
+	BC_DECIMALS,
+	BC_HEXES,
+};
+
+struct Bench {
+	const char *name;
+	BenchFunc func;
+	BenchCorpus corpus;
+};
+
+static const Bench aBenchmarks[] = {
+	{ "fnv1a/labels", BenchFnv1a, BC_LABELS },
+	{ "hash/labels", BenchHash, BC_LABELS },
+	{ "hash_lower/labels", BenchHashLower, BC_LABELS },
+	{ "fnv1a/lines", BenchFnv1aLines, BC_LINES },
+	{ "find_char/lines", BenchFindChar, BC_LINES },
+	{ "find/lines", BenchFindStr, BC_LINES },
+	{ "find_case/lines", BenchFindCase, BC_LINES },
+	{ "find_wildcard/lines", BenchFindWildcard, BC_LINES },
+	{ "replace_bookend/macro", BenchReplaceBookend, BC_MACRO },
+	{ "split_token_trim/lines", BenchSplitTokenTrim, BC_LINES },
+	{ "count_lines/file", BenchCountLines, BC_FILE },
+	{ "next_line/file", BenchNextLine, BC_FILE },
+	{ "atoi_skip/numbers", BenchAtoiSkip, BC_DECIMALS },
+	{ "ahextoui_skip/numbers", BenchAhextouiSkip, BC_HEXES },
+};
+static const int nBenchmarks = sizeof(aBenchmarks) / sizeof(aBenchmarks[0]);
+
+static size_t CorpusBytes(const Corpora &c, BenchCorpus corpus) {
+	switch (corpus) {
+		case BC_LABELS: return c.labelBytes;
+		case BC_LINES: return c.lineBytes;
+		case BC_MACRO: return 256 * c.macro.get_len();
+		case BC_FILE: return c.file.size();
+		case BC_DECIMALS: return c.decimalBytes;
+		case BC_HEXES: return c.hexBytes;
+	}
+	return 0;
+}
+
+struct BenchResult {
+	strown<32> name;
+	double ns_per_op;
+	double mb_per_s;
+};
+
+// time a benchmark, repeat the corpus until a run is long enough and keep the best run
+static void RunBench(const Bench &b, const Corpora &c, int run_ms, BenchResult &result, size_t &sum) {
+	typedef std::chrono::high_resolution_clock Clock;
+	size_t ops = b.func(c, sum);	// warm up
+	size_t reps = 1;
+	for (;;) {
+		Clock::time_point t0 = Clock::now();
+		for (size_t r = 0; r < reps; ++r) { b.func(c, sum); }
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+		if (ms >= run_ms || reps >= (size_t(1)<<30)) { break; }
+		reps = ms < 1.0 ? reps * 16 : size_t(reps * (run_ms * 1.1 / ms)) + 1;
+	}
+	double best = 0.0;
+	for (int run = 0; run < BENCH_RUNS; ++run) {
+		Clock::time_point t0 = Clock::now();
+		for (size_t r = 0; r < reps; ++r) { b.func(c, sum); }
+		double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+		if (!run || ns < best) { best = ns; }
+	}
+	result.name.copy(b.name);
+	result.ns_per_op = ops ? best / (double(reps) * ops) : 0.0;
+	result.mb_per_s = best > 0.0 ? double(CorpusBytes(c, b.corpus)) * reps * 1000.0 / best : 0.0;
+}
+
+// results saved as one "name ns/op MB/s" line per benchmark
+static int LoadResults(const char *filename, BenchResult *results, int max_results) {
+	FILE *f = fopen(filename, "r");
+	if (!f) { return -1; }
+	int count = 0;
+	char name[64];
+	double ns, mb;
+	while (count < max_results && fscanf(f, "%63s %lf %lf", name, &ns, &mb) == 3) {
+		results[count].name.copy(name);
+		results[count].ns_per_op = ns;
+		results[count].mb_per_s = mb;
+		++count;
+	}
+	fclose(f);
+	return count;
+}
+
+int main(int argc, char **argv) {
+	const strref file_arg("file");
+	const strref save_arg("save");
+	const strref compare_arg("compare");
+	const strref filter_arg("filter");
+	const strref time_arg("time");
+	const strref verify_arg("verify");
+
+	const char *source_file = nullptr, *save_file = nullptr, *compare_file = nullptr, *verify_file = nullptr;
+	strref filter;
+	int run_ms = DEFAULT_RUN_MS;
+	for (int a = 1; a < argc; ++a) {
+		strref arg(argv[a]);
+		if (arg.get_first() == '-') {
+			++arg;
+			if (arg.get_first() == '-') { ++arg; }
+			strref value = arg.after('=');
+			arg = arg.before_or_full('=');
+			if (arg.same_str(file_arg) && value) { source_file = value.get(); }
+			else if (arg.same_str(save_arg) && value) { save_file = value.get(); }
+			else if (arg.same_str(compare_arg) && value) { compare_file = value.get(); }
+			else if (arg.same_str(filter_arg) && value) { filter = value; }
+			else if (arg.same_str(time_arg) && value) { run_ms = value.atoi() > 0 ? value.atoi() : run_ms; }
+			else if (arg.same_str(verify_arg) && value) { verify_file = value.get(); }
+			else { source_file = "?"; break; }
+		} else { source_file = "?"; break; }
+	}
+	if (source_file && source_file[0] == '?') {
+		puts("Usage:\n"
+			"struse_bench [-file=source.s] [-filter=name] [-time=ms] [-save=results.txt] [-compare=results.txt] [-verify=scalar.txt]\n"
+			" -file=(source): use an assembler source file as the large file and long lines\n"
+			" -filter=(name): only run benchmarks with a name that contains this text\n"
+			" -time=(ms): minimum time of each timed run, default 50\n"
+			" -save=(file): save the results to compare another build against\n"
+			" -compare=(file): show the change against results saved by another build\n"
+			" -verify=(file): save the results of the SSE2 primitives with a STRUSE_NO_SIMD build,\n"
+			"   an SSE2 build checks that its results match");
+		return 1;
+	}
+
+	Corpora c;
+	strref source;
+	char *source_data = nullptr;
+	if (source_file) {
+		if (FILE *f = fopen(source_file, "rb")) {
+			fseek(f, 0, SEEK_END);
+			size_t size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			if ((source_data = (char*)malloc(size + 1))) {
+				size = fread(source_data, 1, size, f);
+				source = strref(source_data, (strl_t)size);
+			}
+			fclose(f);
+		}
+		if (!source) {
+			fprintf(stderr, "Could not read source file \"%s\"\n", source_file);
+			return 1;
+		}
+	}
+	c.Build(source);
+	if (verify_file) {
+		int result = VerifySimd(c, verify_file);
+		if (source_data) { free(source_data); }
+		return result;
+	}
+
+	BenchResult base[MAX_BENCH_RESULTS];
+	int num_base = 0;
+	if (compare_file && (num_base = LoadResults(compare_file, base, MAX_BENCH_RESULTS)) < 0) {
+		fprintf(stderr, "Could not read results \"%s\"\n", compare_file);
+		return 1;
+	}
+
+#ifdef STRUSE_SSE2
+	const char *simd = "SSE2";
+#else
+	const char *simd = "scalar";
+#endif
+	printf("struse_bench (%s) labels: %d, lines: %d, file: %d bytes\n", simd,
+		(int)c.labels.size(), (int)c.lines.size(), (int)c.file.size());
+	if (num_base) { printf("%-24s %10s %10s %10s %8s\n", "benchmark", "ns/op", "MB/s", "base ns/op", "speedup"); }
+	else { printf("%-24s %10s %10s\n", "benchmark", "ns/op", "MB/s"); }
+
+	BenchResult results[MAX_BENCH_RESULTS];
+	int num_results = 0;
+	size_t sum = 0;
+	for (int b = 0; b < nBenchmarks; ++b) {
+		if (filter && strref(aBenchmarks[b].name).find(filter) < 0) { continue; }
+		BenchResult &r = results[num_results++];
+		RunBench(aBenchmarks[b], c, run_ms, r, sum);
+		const BenchResult *prev = nullptr;
+		for (int p = 0; p < num_base && !prev; ++p) {
+			if (base[p].name.same_str_case(r.name)) { prev = base + p; }
+		}
+		if (prev && r.ns_per_op > 0.0) {
+			printf("%-24s %10.2f %10.1f %10.2f %7.2fx\n", r.name.c_str(), r.ns_per_op, r.mb_per_s,
+				prev->ns_per_op, prev->ns_per_op / r.ns_per_op);
+		} else { printf("%-24s %10.2f %10.1f\n", r.name.c_str(), r.ns_per_op, r.mb_per_s); }
+	}
+	bench_sink = sum;
+
+	if (save_file) {
+		if (FILE *f = fopen(save_file, "w")) {
+			for (int r = 0; r < num_results; ++r) {
+				fprintf(f, "%s %.4f %.2f\n", results[r].name.c_str(), results[r].ns_per_op, results[r].mb_per_s);
+			}
+			fclose(f);
+		} else {
+			fprintf(stderr, "Could not write results \"%s\"\n", save_file);
+			return 1;
+		}
+	}
+	if (source_data) { free(source_data); }
+	return 0;
+}
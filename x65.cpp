@@ -35,10 +35,30 @@
 #define _CRT_SECURE_NO_WARNINGS		// Windows shenanigans
 #define STRUSE_IMPLEMENTATION		// include implementation of struse in this file
 #include "struse.h"					// https://github.com/Sakrac/struse/blob/master/struse.h
+#include "x65.h"
 #include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
 
 // if the number of resolved labels exceed this in one late eval then skip
 //	checking for relevance and just eval all unresolved expressions.
@@ -60,6 +80,9 @@
 // Max number of exported binary files from a single source
 #define MAX_EXPORT_FILES 64
 
+// Max number of times the source is assembled to settle zero page optimized operands
+#define MAX_OPTIMIZE_PASSES 16
+
 // Maximum number of opcodes, aliases and directives
 #define MAX_OPCODES_DIRECTIVES 320
 
@@ -259,6 +282,7 @@ enum AssemblerDirective {
 	AD_A8,			// A8: Set 8 bit accumulator mode
 	AD_XY16,		// A16: Set 16 bit index register mode
 	AD_XY8,			// A8: Set 8 bit index register mode
+	AD_PAGECHECK,	// PAGECHECK: Report branches and labeled data crossing pages until OFF or end of scope
 	AD_HEX,			// HEX: LISA assembler data block
 	AD_ABORT,		// ABORT: stop assembler and error
 	AD_EJECT,		// EJECT: Page break for printing assembler code, ignore
@@ -456,7 +480,7 @@ struct mnem {
 	uint8_t aCodes[AMB_COUNT];
 };
 
-struct mnem opcodes_6502[] = {
+const struct mnem opcodes_6502[] = {
 //	   nam   modes     (zp,x)   zp     # $0000 (zp),y zp,x  abs,y abs,x (xx)     A  empty
 	{ "brk", AMM_NON, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
 	{ "jsr", AMM_ABS, { 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
@@ -548,7 +572,7 @@ const char* aliases_6502[] = {
 	nullptr, nullptr
 };
 
-uint8_t timing_6502[] = {
+const uint8_t timing_6502[] = {
 	0x0e, 0x0c, 0xff, 0xff, 0xff, 0x06, 0x0a, 0xff, 0x06, 0x04, 0x04, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x05, 0x0b, 0xff, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0xff, 0xff, 0xff, 0x09, 0x0e, 0xff,
 	0x0c, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x0a, 0xff, 0x08, 0x04, 0x04, 0xff, 0x08, 0x08, 0x0c, 0xff, 0x05, 0x0b, 0xff, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0xff, 0xff, 0xff, 0x09, 0x0e, 0xff,
 	0x0c, 0x0c, 0xff, 0xff, 0xff, 0x06, 0x0a, 0xff, 0x06, 0x04, 0x04, 0xff, 0x06, 0x08, 0x0c, 0xff, 0x05, 0x0b, 0xff, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0xff, 0xff, 0xff, 0x09, 0x0e, 0xff,
@@ -561,7 +585,7 @@ uint8_t timing_6502[] = {
 
 static const int num_opcodes_6502 = sizeof(opcodes_6502) / sizeof(opcodes_6502[0]);
 
-struct mnem opcodes_65C02[] = {
+const struct mnem opcodes_65C02[] = {
 //	   nam   modes     (zp,x)   zp     # $0000 (zp),y zp,x  abs,y abs,x (xx)     A  empty (zp)(abs,x)zp,abs
 	{ "brk", AMM_NON, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
 	{ "jsr", AMM_ABS, { 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
@@ -662,7 +686,7 @@ const char* aliases_65C02[] = {
 
 static const int num_opcodes_65C02 = sizeof(opcodes_65C02) / sizeof(opcodes_65C02[0]);
 
-struct mnem opcodes_65816[] = {
+const struct mnem opcodes_65816[] = {
 //	   nam   modes     (zp,x)   zp     # $0000 (zp),y zp,x  abs,y abs,x (xx)     A  empty (zp)(abs,x)zp,abs [zp] [zp],y absl absl,x b,s (b,s),y[$000] b,b
 	{ "brk", AMM_NON, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
 	{ "jsr", AM8_JSR, { 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x00, 0x00, 0x00, 0x22, 0x00, 0x00, 0x00, 0x00, 0x00 } },
@@ -783,7 +807,7 @@ const char* aliases_65816[] = {
 
 static const int num_opcodes_65816 = sizeof(opcodes_65816) / sizeof(opcodes_65816[0]);
 
-uint8_t timing_65816[] = {
+const uint8_t timing_65816[] = {
 	0x4e, 0x1c, 0x4e, 0x28, 0x3a, 0x26, 0x3a, 0x1c, 0x46, 0x24, 0x44, 0x48, 0x4c, 0x28, 0x5c, 0x2a,
 	0x44, 0x1a, 0x1a, 0x2e, 0x3a, 0x18, 0x6c, 0x1c, 0x44, 0x28, 0x44, 0x44, 0x4c, 0x28, 0x5e, 0x2a,
 	0x4c, 0x1c, 0x50, 0x28, 0x16, 0x26, 0x3a, 0x1c, 0x48, 0x24, 0x44, 0x4a, 0x28, 0x28, 0x4c, 0x2a,
@@ -803,7 +827,7 @@ uint8_t timing_65816[] = {
 };
 
 // m=0, i=0, dp!=0
-uint8_t timing_65816_plus[9][3] = {
+const uint8_t timing_65816_plus[9][3] = {
 	{ 0, 0, 0 },	// 6502 plus timing check bit 0
 	{ 1, 0, 1 },	// acc 16 bit + dp!=0
 	{ 1, 0, 0 },	// acc 16 bit
@@ -846,12 +870,12 @@ enum CPUIndex {
 
 // CPU by index
 struct CPUDetails {
-	mnem *opcodes;
+	const mnem *opcodes;
 	int num_opcodes;
 	const char* name;
 	const char** aliases;
 	const uint8_t *timing;
-} aCPUs[] = {
+} const aCPUs[] = {
 	{ opcodes_6502, num_opcodes_6502 - NUM_ILLEGAL_6502_OPS, "6502", aliases_6502, timing_6502 },
 	{ opcodes_6502, num_opcodes_6502, "6502ill", aliases_6502, timing_6502 },
 	{ opcodes_65C02, num_opcodes_65C02 - NUM_WDC_65C02_SPECIFIC_OPS, "65C02", aliases_65C02, nullptr },
@@ -972,6 +996,7 @@ DirectiveName aDirectiveNames[] {
 	{ "XY8", AD_XY8 },			// XY8: Set 8 bit index register mode
 	{ "I16", AD_XY16 },			// I16: Set 16 bit index register mode
 	{ "I8", AD_XY8 },			// I8: Set 8 bit index register mode
+	{ "PAGECHECK", AD_PAGECHECK },	// PAGECHECK: Report page crossings until OFF or end of scope
 	{ "DUMMY", AD_DUMMY },
 	{ "DUMMY_END", AD_DUMMY_END },
 	{ "DS", AD_DS },			// Define space
@@ -1111,6 +1136,7 @@ public:
 	V& getValue(uint32_t pos) { return values[pos]; }
 	uint32_t count() const { return _count; }
 	uint32_t capacity() const { return _capacity; }
+	void reset() { _count = 0; }	// remove all pairs but keep the memory
 	void clear() {
 		if (keys!=nullptr)
 			free(keys);
@@ -1147,6 +1173,10 @@ struct ListLine {
 		KEYWORD = 0x02,
 		CYCLES_START = 0x04,
 		CYCLES_STOP = 0x08,
+		ACC_16 = 0x10,		// 65816 accumulator assembled as 16 bits
+		IDX_16 = 0x20,		// 65816 index registers assembled as 16 bits
+		PAGE_CHECK = 0x40,	// check this line for page crossings
+		LABELED = 0x80,		// first line with data after an address label within PAGECHECK
 	};
 	strref source_name;		// source file index name
 	strref code;			// line of code this represents
@@ -1154,13 +1184,65 @@ struct ListLine {
 	int size;				// number of bytes generated for this line
 	int line_offs;			// offset into code
 	int flags;				// only output code if generated by code
+	int macro_site;			// macro expansion this line was generated by or -1
 
 	bool wasMnemonic() const { return !!(flags & MNEMONIC);  }
 	bool startClock() const { return !!(flags & CYCLES_START); }
 	bool stopClock() const { return !!(flags & CYCLES_STOP); }
+	bool acc16() const { return !!(flags & ACC_16); }
+	bool idx16() const { return !!(flags & IDX_16); }
+	bool pageCheck() const { return !!(flags & PAGE_CHECK); }
+	bool labeled() const { return !!(flags & LABELED); }
 };
 typedef std::vector<struct ListLine> Listing;
 
+// Forward referenced operand that may fit in zero page, identified by
+// the order it is assembled in for each optimizing pass
+struct ZPSite {
+	enum State : int8_t {
+		ZPS_ABS,			// assembled as absolute
+		ZPS_ZP,				// assembled as zero page
+		ZPS_KEEP_ABS,		// did not fit when assembled as zero page, stays absolute
+	};
+	uint32_t hash;			// hash of the operand expression
+	State state;
+	bool fits;				// resolved to a zero page address in this pass
+};
+
+// Branch that may be out of range, identified by the order it is assembled
+// in for each optimizing pass
+struct BranchSite {
+	uint32_t hash;			// hash of the branch target expression
+	bool relax;				// assembled as an inverted branch over a jmp or brl
+	bool out_of_range;		// target was out of range in this pass
+};
+
+// Branch assembled as a long branch, reported after the last pass
+struct RelaxedBranch {
+	strref source_name;
+	strref expression;
+	int line;
+};
+
+// Console output held while the pass that printed it may be repeated
+struct HeldOutput {
+	FILE *stream;			// stdout or stderr
+	size_t end;				// end of this output in the held text
+};
+
+// Where a macro was expanded, recorded for debug info
+struct MacroSite {
+	strref macro;			// name of macro
+	strref source_name;		// file the macro was defined in
+	strref source_file;		// text the macro was defined in
+	strref expansion;		// text of the macro with arguments replaced or empty
+	int source_offs;		// offset of macro code in source_file
+	strref site_file;		// text that expanded the macro
+	strref site_name;		// name of file that expanded the macro
+	int site_offs;			// offset of expanding line in site_file
+	int parent;				// macro expansion the site is within or -1
+};
+
 enum SectionType : int8_t {	// enum order indicates fixed address linking priority
 	ST_UNDEFINED,			// not set
 	ST_CODE,				// default type
@@ -1331,6 +1413,7 @@ typedef struct sLateEval {
 	int16_t section;			// which section to apply to.
 	int16_t rept;				// value of rept
 	int file_ref;			// -1 if current or xdef'd otherwise index of file for label
+	int opt_site;			// zero page or branch site of the operand for optimizing passes or -1
 	strref label;			// valid if this is not a target but another label
 	strref expression;
 	strref source_file;
@@ -1404,6 +1487,14 @@ struct EvalContext {
 		relative_section(_sect), file_ref(-1), rept_cnt(_rept_cnt) {}
 };
 
+// Address layout of one export binary, resolved before the image is built
+struct ExportLayout {
+	strref append;				// export name appended to binary file name
+	int start_address;			// first address of the binary
+	int end_address;			// end of the last non-BSS section
+	std::vector<int> sections;	// sections with data to copy into the binary
+};
+
 // Source context is current file (include file, etc.) or current macro.
 typedef struct sSourceContext {
 	strref source_name;		// source file name (error output)
@@ -1414,10 +1505,37 @@ typedef struct sSourceContext {
 	int16_t repeat;			// how many times to repeat this code segment
 	int16_t repeat_total;	// initial number of repeats for this code segment
 	int16_t conditional_ctx;	// conditional depth at root of this context
+	int macro_site;			// macro expansion this context is within or -1
+	int token_stream;		// lexed lines of code_segment or -1
+	uint32_t token_line;	// lexed line expected to be read next
 	void restart() { read_source = code_segment; }
 	bool complete() { repeat--; return repeat <= 0; }
 } SourceContext;
 
+// A line of a repeat or macro body is lexed the first time it is read, repeats
+// and macro calls that read the same text again use the lexed line. Offsets are
+// from the start of the code segment, NO_TOKEN_OFFS for a null string.
+#define NO_TOKEN_OFFS (~strl_t(0))
+struct LineToken {
+	strl_t read;			// read position the line was lexed from
+	strl_t next;			// read position after the line (blank lines skipped)
+	strl_t line, line_len;	// line as returned by strref::line()
+	strl_t code, code_len;	// first statement without comments and surrounding whitespace
+	strl_t op, op_len;		// first word of the statement
+	strl_t args, args_len;	// rest of the statement after the first word
+	uint32_t op_hash;		// hash of the first word as an instruction or directive
+	uint32_t label_hash;	// hash of the first word as a label or macro
+	bool merlin;			// lexed with Merlin syntax
+};
+
+// Lexed lines of a code segment in the order of the text
+struct TokenStream {
+	const char *buffer;
+	strl_t size;
+	strl_t lexed;			// read position of the first line not yet lexed
+	std::vector<LineToken> lines;
+};
+
 // Context stack is a stack of currently processing text
 class ContextStack {
 private:
@@ -1438,14 +1556,87 @@ public:
 		context.next_source = code_seg;
 		context.repeat = (int16_t)rept;
 		context.repeat_total = (int16_t)rept;
+		context.macro_site = currContext ? currContext->macro_site : -1;
+		context.token_stream = -1;
+		context.token_line = 0;
 		stack.push_back(context);
 		currContext = &stack[stack.size()-1];
 	}
 	void pop() { stack.pop_back(); currContext = stack.size() ? &stack[stack.size()-1] : nullptr; }
-	bool has_work() { return currContext!=nullptr; }
+	void reset() { stack.clear(); currContext = nullptr; }
+	bool has_work() const { return currContext!=nullptr; }
+};
+
+// Run job.Run(index) for each index in [0, count) on up to num_threads threads,
+// num_threads <= 0 uses one thread per core.
+template<class JOB> void ParallelFor(JOB &job, int count, int num_threads) {
+	if (num_threads <= 0) { num_threads = (int)std::thread::hardware_concurrency(); }
+	if (num_threads > count) { num_threads = count; }
+	if (num_threads <= 1) {
+		for (int index = 0; index < count; index++)
+			job.Run(index);
+		return;
+	}
+	struct Worker {
+		JOB *job;
+		int count;
+		std::atomic<int> next;
+		void Run() { for (int index = next++; index < count; index = next++) job->Run(index); }
+	} worker;
+	worker.job = &job;
+	worker.count = count;
+	worker.next = 0;
+	std::vector<std::thread> threads;
+	for (int t = 1; t < num_threads; t++)
+		threads.push_back(std::thread(&Worker::Run, &worker));
+	worker.Run();
+	for (std::vector<std::thread>::iterator t = threads.begin(); t != threads.end(); ++t)
+		t->join();
+}
+
+// Contents of files loaded by any number of assemblers, a file is read
+// from disk once and each load returns a copy. Files that changed size or
+// modification time since they were cached are read again. Files modified
+// within the last second are not cached since an edit in the same tick of
+// the file system clock could keep both the size and the time.
+class FileCache {
+	struct CachedFile {
+		char *name;
+		char *data;
+		size_t size;
+		int64_t mtime;		// -1 for files added from memory
+	};
+	std::mutex lock;
+	pairArray<uint32_t, CachedFile> files;	// keyed by hash of file name
+	strown<512> directory;					// relative file names are cached relative to this
+	int Find(strref name, uint32_t hash);
+public:
+	void SetDirectory(strref dir) { directory.copy(dir); }
+	void AddFile(const char *filename, const void *data, size_t size);
+	char* Load(const char *filename, size_t &size);
+	~FileCache();
+};
+
+// A file read by the assembler
+struct FileRead {
+	strown<512> name;		// file name as opened
+	uint64_t hash;			// fnv1a 64 of the contents if requested
+};
+
+// Object file loaded and validated but not yet linked
+struct ObjFileStage {
+	strref filename;		// name as referenced
+	char *data;				// file contents
+	char *str_pool;			// copy of the string data, owned by the assembler once linked
+	size_t size;			// size of file contents
+	StatusCode status;		// result of loading the object file
 };
 
 // The state of the assembler
+struct ListContext;
+struct ListState;
+struct TextBuffer;
+
 class Asm {
 public:
 	pairArray<uint32_t, Label> labels;
@@ -1457,7 +1648,22 @@ public:
 
 	std::vector<LateEval> lateEval;
 	std::vector<LocalLabelRecord> localLabels;
+	std::vector<MacroSite> macroSites;		// macro expansions for debug info
+	std::vector<ZPSite> zpSites;			// operands for zero page optimization, kept between passes
+	int zp_site_count;						// zero page optimization sites in this pass
+	std::vector<BranchSite> branchSites;	// branches for relaxation, kept between passes
+	std::vector<RelaxedBranch> relaxedBranches;	// branches relaxed in this pass
+	int branch_site_count;					// branch relaxation sites in this pass
+	int relaxed_branch_pc;					// address of the jump after a relaxed branch in this line or -1
+	std::vector<char> heldText;				// console output of this pass while held
+	std::vector<HeldOutput> heldOutput;		// stream of each run of held text
 	std::vector<char*> loadedData;			// free when assembler is completed
+	std::vector<TokenStream> tokenStreams;	// lexed lines of repeated code, cleared with loadedData
+	pairArray<uint32_t, int> tokenBuffers;	// code segment address to token stream
+	FileCache *file_cache;					// optional file contents shared between assemblers
+	std::vector<FileRead> filesRead;		// every file loaded by LoadText and LoadBinary
+	std::vector<FileRead> filesMissing;		// paths probed and not found while hashing files read
+	std::mutex filesReadLock;				// object files are loaded in parallel
 	std::vector<MemberOffset> structMembers; // labelStructs refer to sets of structMembers
 	std::vector<strref> includePaths;
 	std::vector<Section> allSections;
@@ -1465,7 +1671,7 @@ public:
 	MapSymbolArray map;
 
 	// CPU target
-	struct mnem *opcode_table;
+	const struct mnem *opcode_table;
 	int opcode_count;
 	CPUIndex cpu, list_cpu;
 	OPLookup aInstructions[MAX_OPCODES_DIRECTIVES];
@@ -1503,19 +1709,49 @@ public:
 	bool accumulator_16bit;		// 65816 specific software dependent immediate mode
 	bool index_reg_16bit;		// -"-
 	int8_t cycle_counter_level;	// merlin toggles the cycle counter rather than hierarchically evals
+	int page_check_scope;		// scope depth PAGECHECK was enabled in or -1
+	bool page_check_label;		// an address label was defined since the last line with data
 	bool error_encountered;		// if any error encountered, don't export binary
 	bool list_assembly;			// generate assembler listing
+	bool debug_info;			// collect listing lines and macro sites for debug info and profiles
 	bool end_macro_directive;	// whether to use { } or macro / endmacro for macro scope
+	bool hash_files_read;		// record a hash of the contents of each file read
+	bool zp_optimize;			// assemble forward references that fit in zero page as zero page
+	bool relax_branches;		// assemble out of range branches as a branch over a jump
+	bool final_pass;			// no pass follows to relax branches, out of range is an error
+	bool hold_output;			// keep console output until it is known if another pass follows
 
 	// Convert source to binary
 	void Assemble(strref source, strref filename, bool obj_target);
+	void CompleteAssembly(bool obj_target);
+
+	// Zero page optimization of forward referenced operands and branch relaxation over multiple passes
+	int AddZPSite(strref expression);
+	int AddBranchSite(strref expression);
+	StatusCode AddRelaxedBranch(uint8_t opcode, strref expression, strref source_file);
+	bool UpdatePassSites();
+	void ListRelaxedBranches();
 
 	// Push a new context and handle enter / exit of context
 	StatusCode PushContext(strref src_name, strref src_file, strref code_seg, int rept = 1);
 	StatusCode PopContext();
 
 	// Generate assembler listing if requested
-	bool List(strref filename);
+	bool List(strref filename, int num_threads = 0);
+	void ListSection(int index, const ListContext &context, ListState &state, TextBuffer &listing);
+
+	// Generate debug info with source lines, symbols and macro expansions
+	bool WriteDebugInfo(strref filename);
+
+	// Run the assembled code in a cycle counting simulator and write a profile by source line
+	bool SimAddress(strref name, uint32_t &address);
+	bool Simulate(strref entry, strref stop, uint64_t max_cycles, strref profile_file);
+
+	// Report the fewest and most cycles through each cycle counted region
+	bool CycleReport(strref filename);
+
+	// Report branches and labeled data within PAGECHECK that cross a page, returns number found
+	int PageCheck(bool as_error);
 
 	// Generate source for all valid instructions and addressing modes for current CPU
 	bool AllOpcodes(strref filename);
@@ -1523,6 +1759,10 @@ public:
 	// Clean up memory allocations, reset assembler state
 	void Cleanup();
 
+	// Reset assembler state but keep allocated memory for the next build
+	void Reset();
+	void ClearState(bool keep_capacity);
+
 	// Make sure there is room to write more code
 	StatusCode CheckOutputCapacity(uint32_t addSize);
 
@@ -1541,9 +1781,13 @@ public:
 	void EndSection();							// pop current section
 	Section& CurrSection() { return *current_section; }
 	void AssignAddressToGroup();				// Merlin LNK support
+	void PrepareExports();						// link state shared by all exports
+	bool LayoutExport(strref append, ExportLayout &layout);
+	uint8_t* BuildExportImage(const ExportLayout &layout) const;
 	uint8_t* BuildExport(strref append, int &file_size, int &addr);
 	int GetExportNames(strref *aNames, int maxNames);
 	StatusCode LinkZP();
+	void ZeroPageUsed(uint64_t *used);
 	int SectionId() { return int(current_section - &allSections[0]); }
 	int SectionId(Section &s) { return (int)(&s - &allSections[0]); }
 	void AddByte(int b) { CurrSection().AddByte(b); }
@@ -1554,10 +1798,18 @@ public:
 	// Object file handling
 	StatusCode WriteObjectFile(strref filename);	// write x65 object file
 	StatusCode ReadObjectFile(strref filename, int link_to_section = -1);		// read x65 object file
+	StatusCode LoadObjectFile(strref filename, ObjFileStage &stage);	// load and validate, thread safe
+	StatusCode LinkObjectFile(ObjFileStage &stage, int link_to_section = -1);
+	void LinkObjectFiles(const strref *files, int count, int num_threads);	// link only, no source
 
 	// Apple II GS OMF
 	StatusCode WriteA2GS_OMF(strref filename, bool full_collapse);
 
+	// Precompiled prefix include
+	void AssemblePrefix(strref prefix, strref snapshot, uint64_t state_hash);
+	StatusCode WriteSnapshot(strref filename, uint64_t state_hash, size_t first_file, size_t first_missing);
+	bool ReadSnapshot(strref filename, uint64_t state_hash);
+
 	// Scope management
 	StatusCode EnterScope();
 	StatusCode ExitScope();
@@ -1565,6 +1817,8 @@ public:
 	// Macro management
 	StatusCode AddMacro(strref macro, strref source_name, strref source_file, strref &left);
 	StatusCode BuildMacro(Macro &m, strref arg_list);
+	int AddMacroSite(const Macro &m, strref macro_src);
+	void EnterMacroSite(int site, bool expanded);
 
 	// Structs
 	StatusCode BuildStruct(strref name, strref declaration);
@@ -1638,12 +1892,19 @@ public:
 	StatusCode GetAddressMode(strref line, bool flipXY, uint32_t validModes,
 							  AddrMode &addrMode, int &len, strref &expression);
 	StatusCode AddOpcode(strref line, int index, strref source_file);
-	StatusCode BuildLine(strref line);
+	StatusCode BuildLine(strref line, const LineToken *lexed = nullptr);
 	StatusCode BuildSegment();
+	int TokenStreamIndex(strref buffer);
+	void LexLine(TokenStream &stream);
+	const LineToken* ReadLineToken(SourceContext &ctx);
 
 	// Display error in stderr
 	void PrintError(strref line, StatusCode error, strref file = strref());
 
+	// Console output during assembly, held while another pass may follow
+	void Print(FILE *stream, const char *format, ...);
+	void ReleaseOutput();
+
 	// Conditional Status
 	bool ConditionalAsm();			// Assembly is currently enabled
 	bool NewConditional();			// Start a new conditional block
@@ -1661,6 +1922,7 @@ public:
 
 	// Add include folder
 	void AddIncludeFolder(strref path);
+	char* LoadFile(const char *filename, size_t &size);
 	char* LoadText(strref filename, size_t &size);
 	char* LoadBinary(strref filename, size_t &size);
 
@@ -1671,32 +1933,71 @@ public:
 	bool Merlin() const { return syntax == SYNTAX_MERLIN; }
 
 	// constructor
-	Asm() : opcode_table(opcodes_6502), opcode_count(num_opcodes_6502), num_instructions(0),
+	Asm() : file_cache(nullptr), opcode_table(opcodes_6502), opcode_count(num_opcodes_6502), num_instructions(0),
 		cpu(CPU_6502), list_cpu(CPU_6502) {
 		Cleanup(); localLabels.reserve(256); loadedData.reserve(16); lateEval.reserve(64); }
 };
 
 // Clean up work allocations
 void Asm::Cleanup() {
+	ClearState(false);
+}
+
+// Reset for another build, label and section arrays keep their capacity
+void Asm::Reset() {
+	ClearState(true);
+	if (cpu != CPU_6502) { SetCPU(CPU_6502); }
+	list_cpu = CPU_6502;
+	includePaths.clear();
+}
+
+void Asm::ClearState(bool keep_capacity) {
 	for (std::vector<char*>::iterator i = loadedData.begin(); i != loadedData.end(); ++i) {
 		if (char *data = *i)
 			free(data);
 	}
-	map.clear();
-	labelPools.clear();
-	loadedData.clear();
-	labels.clear();
-	macros.clear();
-	allSections.clear();
+	for (std::vector<Section>::iterator i = allSections.begin(); i != allSections.end(); ++i)
+		i->Cleanup();
 	for (uint32_t i = 0; i < strings.count(); ++i) {
 		StringSymbol &str = strings.getValue(i);
 		if (str.string_value.cap())
 			free(str.string_value.charstr());
 	}
-	strings.clear();
 	for (std::vector<ExtLabels>::iterator exti = externals.begin(); exti !=externals.end(); ++exti)
 		exti->labels.clear();
+	if (keep_capacity) {
+		labelPools.reset();
+		labels.reset();
+		macros.reset();
+		strings.reset();
+		labelStructs.reset();
+		xdefs.reset();
+	} else {
+		labelPools.clear();
+		labels.clear();
+		macros.clear();
+		strings.clear();
+	}
+	map.clear();
+	loadedData.clear();
+	tokenStreams.clear();
+	tokenBuffers.clear();
+	allSections.clear();
 	externals.clear();
+	filesRead.clear();
+	filesMissing.clear();
+	lateEval.clear();
+	localLabels.clear();
+	macroSites.clear();
+	zpSites.clear();
+	branchSites.clear();
+	relaxedBranches.clear();
+	heldText.clear();
+	heldOutput.clear();
+	structMembers.clear();
+	contextStack.reset();
+	export_base_name.clear();
+	last_label.clear();
 	// this section is relocatable but is assigned address $1000 if exporting without directives
 	SetSection(strref("default,code"));
 	current_section = &allSections[0];
@@ -1709,10 +2010,21 @@ void Asm::Cleanup() {
 	conditional_consumed[0] = false;
 	error_encountered = false;
 	list_assembly = false;
+	debug_info = false;
 	end_macro_directive = false;
+	hash_files_read = false;
+	zp_optimize = false;
+	zp_site_count = 0;
+	relax_branches = false;
+	final_pass = true;
+	hold_output = false;
+	branch_site_count = 0;
+	relaxed_branch_pc = -1;
 	accumulator_16bit = false;	// default 65816 8 bit immediate mode
 	index_reg_16bit = false;	// other CPUs won't be affected.
 	cycle_counter_level = 0;
+	page_check_scope = -1;
+	page_check_label = false;
 }
 
 int sortHashLookup(const void *A, const void *B) {
@@ -1721,14 +2033,14 @@ int sortHashLookup(const void *A, const void *B) {
 	return _A->op_hash > _B->op_hash ? 1 : -1;
 }
 
-int BuildInstructionTable(OPLookup *pInstr, struct mnem *opcodes,
+int BuildInstructionTable(OPLookup *pInstr, const struct mnem *opcodes,
 						  int count, const char **aliases, bool merlin)
 {
 	// create an instruction table (mnemonic hash lookup)
 	int numInstructions = 0;
 	for (int i = 0; i < count; i++) {
 		OPLookup &op = pInstr[numInstructions++];
-		op.op_hash = strref(opcodes[i].instr).fnv1a_lower();
+		op.op_hash = strref(opcodes[i].instr).hash_lower();
 		op.index = (uint8_t)i;
 		op.type = OT_MNEMONIC;
 	}
@@ -1741,7 +2053,7 @@ int BuildInstructionTable(OPLookup *pInstr, struct mnem *opcodes,
 			for (int o=0; o<count; o++) {
 				if (orig.same_str_case(opcodes[o].instr)) {
 					OPLookup &op = pInstr[numInstructions++];
-					op.op_hash = alias.fnv1a_lower();
+					op.op_hash = alias.hash_lower();
 					op.index = (uint8_t)o;
 					op.type = OT_MNEMONIC;
 					break;
@@ -1753,7 +2065,7 @@ int BuildInstructionTable(OPLookup *pInstr, struct mnem *opcodes,
 	// add assembler directives
 	for (int d = 0; d<nDirectiveNames; d++) {
 		OPLookup &op_hash = pInstr[numInstructions++];
-		op_hash.op_hash = strref(aDirectiveNames[d].name).fnv1a_lower();
+		op_hash.op_hash = strref(aDirectiveNames[d].name).hash_lower();
 		op_hash.index = (uint8_t)aDirectiveNames[d].directive;
 		op_hash.type = OT_DIRECTIVE;
 	}
@@ -1761,7 +2073,7 @@ int BuildInstructionTable(OPLookup *pInstr, struct mnem *opcodes,
 	if (merlin) {
 		for (int d = 0; d<nDirectiveNamesMerlin; d++) {
 			OPLookup &op_hash = pInstr[numInstructions++];
-			op_hash.op_hash = strref(aDirectiveNamesMerlin[d].name).fnv1a_lower();
+			op_hash.op_hash = strref(aDirectiveNamesMerlin[d].name).hash_lower();
 			op_hash.index = (uint8_t)aDirectiveNamesMerlin[d].directive;
 			op_hash.type = OT_DIRECTIVE;
 		}
@@ -1784,22 +2096,157 @@ void Asm::SetCPU(CPUIndex CPU) {
 }
 
 // Read in text data (main source, include, etc.)
+// Read a whole file into an allocated buffer
+static char* ReadFileData(const char *filename, size_t &size) {
+	if (FILE *f = fopen(filename, "rb")) {	// rb is intended here since OS
+		fseek(f, 0, SEEK_END);				// eol conversion can do ugly things
+		size_t _size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (char *buf = (char*)malloc(_size ? _size : 1)) {
+			fread(buf, _size, 1, f);
+			fclose(f);
+			size = _size;
+			return buf;
+		}
+		fclose(f);
+	}
+	return nullptr;
+}
+
+// Get the size and modification time of a file in nanoseconds where the platform has it
+static bool GetFileStat(const char *filename, size_t &size, int64_t &mtime) {
+	struct stat st;
+	if (stat(filename, &st) != 0) { return false; }
+	size = (size_t)st.st_size;
+#if defined(__APPLE__)
+	mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	mtime = (int64_t)st.st_mtime * 1000000000;
+#else
+	mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+// index of the cached file or -1 if not cached
+int FileCache::Find(strref name, uint32_t hash) {
+	uint32_t index = FindLabelIndex(hash, files.getKeys(), files.count());
+	while (index < files.count() && files.getKey(index) == hash) {
+		if (name.same_str_case(files.getValue(index).name)) { return (int)index; }
+		++index;
+	}
+	return -1;
+}
+
+// Add a file that is not on disk, replaces a file with the same name
+void FileCache::AddFile(const char *filename, const void *data, size_t size) {
+	uint32_t hash = strref(filename).hash();
+	std::lock_guard<std::mutex> guard(lock);
+	int index = Find(strref(filename), hash);
+	if (index >= 0) {
+		free(files.getValue(index).name);
+		free(files.getValue(index).data);
+		files.remove(index);
+	}
+	index = (int)FindLabelIndex(hash, files.getKeys(), files.count());
+	files.insert(index, hash);
+	CachedFile &file = files.getValue(index);
+	size_t name_len = strlen(filename);
+	file.name = (char*)malloc(name_len + 1);
+	memcpy(file.name, filename, name_len + 1);
+	file.data = (char*)malloc(size ? size : 1);
+	memcpy(file.data, data, size);
+	file.size = size;
+	file.mtime = -1;
+}
+
+char* FileCache::Load(const char *filename, size_t &size) {
+	size_t file_size = 0;
+	int64_t mtime = 0;
+	bool on_disk = GetFileStat(filename, file_size, mtime);
+
+	strown<512> name;
+	if (filename[0] != '/' && filename[0] != '\\' && filename[1] != ':' && directory) {
+		name.copy(directory);
+		name.append('/');
+	}
+	name.append(filename);
+	uint32_t hash = name.get_strref().hash();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		int index = Find(name.get_strref(), hash);
+		if (index >= 0) {
+			CachedFile &file = files.getValue(index);
+			if (file.mtime < 0 || (on_disk && file.size == file_size && file.mtime == mtime)) {
+				char *data = (char*)malloc(file.size ? file.size : 1);
+				if (data) { memcpy(data, file.data, file.size); }
+				size = file.size;
+				return data;
+			}
+			free(file.name);	// file changed since it was cached
+			free(file.data);
+			files.remove(index);
+		}
+	}
+	if (!on_disk) { return nullptr; }	// missing files are not cached
+	char *file_data = ReadFileData(filename, file_size);
+	if (!file_data) { return nullptr; }
+	char *data = (char*)malloc(file_size ? file_size : 1);
+	if (!data) { free(file_data); return nullptr; }
+	memcpy(data, file_data, file_size);
+	size = file_size;
+
+	int64_t now = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	if ((now - mtime) < 1000000000) { free(file_data); return data; }	// too recent to trust the time
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (Find(name.get_strref(), hash) < 0) {	// another thread may have loaded the file first
+		uint32_t index = FindLabelIndex(hash, files.getKeys(), files.count());
+		files.insert(index, hash);
+		CachedFile &file = files.getValue(index);
+		file.name = (char*)malloc(name.get_len() + 1);
+		memcpy(file.name, name.c_str(), name.get_len() + 1);
+		file.data = file_data;
+		file.size = file_size;
+		file.mtime = mtime;
+	} else { free(file_data); }
+	return data;
+}
+
+FileCache::~FileCache() {
+	for (uint32_t i = 0; i < files.count(); ++i) {
+		free(files.getValue(i).name);
+		free(files.getValue(i).data);
+	}
+	files.clear();
+}
+
+// Load a file from the file cache if available, otherwise from disk
+char* Asm::LoadFile(const char *filename, size_t &size) {
+	char *data = file_cache ? file_cache->Load(filename, size) : ReadFileData(filename, size);
+	if (data) {
+		FileRead file;
+		file.name.copy(filename);
+		file.hash = hash_files_read ? strref(data, (strl_t)size).fnv1a_64() : 0;
+		std::lock_guard<std::mutex> lock(filesReadLock);
+		filesRead.push_back(file);
+	} else if (hash_files_read) {	// a file created here later could change the build
+		FileRead file;
+		file.name.copy(filename);
+		file.hash = 0;
+		std::lock_guard<std::mutex> lock(filesReadLock);
+		filesMissing.push_back(file);
+	}
+	return data;
+}
+
 char* Asm::LoadText(strref filename, size_t &size) {
 	strown<512> file(filename);
 	std::vector<strref>::iterator i = includePaths.begin();
 	for (;;) {
-		if (FILE *f = fopen(file.c_str(), "rb")) {	// rb is intended here since OS
-			fseek(f, 0, SEEK_END);					// eol conversion can do ugly things
-			size_t _size = ftell(f);
-			fseek(f, 0, SEEK_SET);
-			if (char *buf = (char*)calloc(_size, 1)) {
-				fread(buf, _size, 1, f);
-				fclose(f);
-				size = _size;
-				return buf;
-			}
-			fclose(f);
-		}
+		if (char *buf = LoadFile(file.c_str(), size))
+			return buf;
 		if (i==includePaths.end())
 			break;
 		file.copy(*i);
@@ -1811,24 +2258,12 @@ char* Asm::LoadText(strref filename, size_t &size) {
 	size = 0;
 	return nullptr;
 }
-
-// Read in binary data (incbin)
 char* Asm::LoadBinary(strref filename, size_t &size) {
 	strown<512> file(filename);
 	std::vector<strref>::iterator i = includePaths.begin();
 	for (;;) {
-		if (FILE *f = fopen(file.c_str(), "rb")) {
-			fseek(f, 0, SEEK_END);
-			size_t _size = ftell(f);
-			fseek(f, 0, SEEK_SET);
-			if (char *buf = (char*)malloc(_size)) {
-				fread(buf, _size, 1, f);
-				fclose(f);
-				size = _size;
-				return buf;
-			}
-			fclose(f);
-		}
+		if (char *buf = LoadFile(file.c_str(), size))
+			return buf;
 		if (i==includePaths.end())
 			break;
 		file.copy(*i);
@@ -1991,14 +2426,9 @@ void Asm::AssignAddressToGroup() {
 //	- alloc & 0 memory
 //	- any matching relative sections gets linked in after
 //	- go through all section that matches export_append in order and copy over memory
-uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
-	int start_address = 0x7fffffff;
-	int end_address = 0;
-	bool has_relative_section = false;
-	bool has_fixed_section = false;
-	int first_link_section = -1;
-	std::vector<Section*> FixedExport;
 
+// resolve the link state shared by all exports, call once before laying out exports
+void Asm::PrepareExports() {
 	// automatically merge sections with the same name and type if one is relative and other is fixed
 	for (size_t section_id = 0; section_id!=allSections.size(); ++section_id) {
 		const Section &section = allSections[section_id];
@@ -2020,6 +2450,17 @@ uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
 			LinkRelocs((int)section_id, -1, section.start_address);
 		}
 	}
+}
+
+// assign addresses to the relative sections of one export and find the address range
+//	not thread safe, call for each export name in order after PrepareExports
+bool Asm::LayoutExport(strref append, ExportLayout &layout) {
+	int start_address = 0x7fffffff;
+	int end_address = 0;
+	bool has_relative_section = false;
+	bool has_fixed_section = false;
+	int first_link_section = -1;
+	std::vector<Section*> FixedExport;
 
 	// find address range
 	while (!has_relative_section && !has_fixed_section) {
@@ -2058,13 +2499,13 @@ uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
 			section_id++;
 		}
 		if (!has_relative_section && !has_fixed_section)
-			return nullptr;
+			return false;
 		if (has_relative_section) {
 			if (!has_fixed_section) {
 				// there is not a fixed section so go through and assign addresses to all sections
 				// starting with the first reasonable section
 				start_address = default_org;
-				if (first_link_section<0) { return nullptr; }
+				if (first_link_section<0) { return false; }
 				while (first_link_section >= 0) {
 					FixedExport.push_back(&allSections[first_link_section]);
 					AssignAddressToSection(first_link_section, start_address);
@@ -2121,19 +2562,22 @@ uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
 		}
 	}
 
-	// get memory for output buffer
+	// find the extent of the output buffer
 	start_address = FixedExport[0]->start_address;
 	int last_data_export = (int)(FixedExport.size() - 1);
 	while (last_data_export>0&&FixedExport[last_data_export]->type==ST_BSS) { last_data_export--; }
 	end_address = FixedExport[last_data_export]->address;
-	uint8_t *output = (uint8_t*)calloc(1, end_address - start_address);
 
-	// copy over in order
+	// sections to copy over in order
+	layout.append = append;
+	layout.start_address = start_address;
+	layout.end_address = end_address;
+	layout.sections.clear();
 	for (std::vector<Section>::iterator i = allSections.begin(); i != allSections.end(); ++i) {
 		if (i->type == ST_REMOVED) { continue; }
 		if (((!append && !i->export_append) || append.same_str_case(i->export_append)) && i->type != ST_ZEROPAGE) {
 			if (i->start_address>=0x200&&i->size()>0) {
-				memcpy(output+i->start_address-start_address, i->output, i->size());
+				layout.sections.push_back(SectionId(*i));
 			}
 		}
 	}
@@ -2150,21 +2594,43 @@ uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
 		}
 	}
 
-	// return the result
-	file_size = end_address - start_address;
-	addr = start_address;
+	return true;
+}
+
+// copy the sections of a laid out export into a new buffer
+//	only reads the assembler state so exports can be built concurrently
+uint8_t* Asm::BuildExportImage(const ExportLayout &layout) const {
+	uint8_t *output = (uint8_t*)calloc(1, layout.end_address - layout.start_address);
+	if (output) {
+		for (std::vector<int>::const_iterator i = layout.sections.begin(); i != layout.sections.end(); ++i) {
+			const Section &s = allSections[*i];
+			memcpy(output+s.start_address-layout.start_address, s.output, s.size());
+		}
+	}
 	return output;
 }
 
+// build a single export binary
+uint8_t* Asm::BuildExport(strref append, int &file_size, int &addr) {
+	ExportLayout layout;
+	PrepareExports();
+	if (!LayoutExport(append, layout)) { return nullptr; }
+
+	// return the result
+	file_size = layout.end_address - layout.start_address;
+	addr = layout.start_address;
+	return BuildExportImage(layout);
+}
+
 // Collect all the export names
 int Asm::GetExportNames(strref *aNames, int maxNames) {
 	int count = 0;
 	for (std::vector<Section>::iterator i = allSections.begin(); i != allSections.end(); ++i) {
 		if (!i->IsMergedSection()) {
 			bool found = false;
-			uint32_t hash = i->export_append.fnv1a_lower();
+			uint32_t hash = i->export_append.hash_lower();
 			for (int n = 0; n < count; n++) {
-				if (aNames[n].fnv1a_lower() == hash) {
+				if (aNames[n].hash_lower() == hash) {
 					found = true;
 					break;
 				}
@@ -2175,75 +2641,87 @@ int Asm::GetExportNames(strref *aNames, int maxNames) {
 	return count;
 }
 
-// Collect all unassigned ZP sections and link them
+// Free bytes of the zero page bitmap, returns the number of free bytes
+static int ZeroPageFree(const uint64_t *used, int &blocks, int &largest) {
+	int free_bytes = 0, run = 0;
+	blocks = largest = 0;
+	for (int a = 0; a <= 0x100; a++) {
+		if (a < 0x100 && !(used[a >> 6] & (1ULL << (a & 63)))) {
+			if (!run++) { blocks++; }
+			free_bytes++;
+		} else {
+			if (run > largest) { largest = run; }
+			run = 0;
+		}
+	}
+	return free_bytes;
+}
+
+// One bit for each zero page byte used by an address assigned zero page section
+void Asm::ZeroPageUsed(uint64_t *used) {
+	used[0] = used[1] = used[2] = used[3] = 0;
+	for (std::vector<Section>::iterator s = allSections.begin(); s!=allSections.end(); ++s) {
+		if (s->type==ST_ZEROPAGE && !s->IsMergedSection() && s->address_assigned) {
+			for (int a = s->start_address < 0 ? 0 : s->start_address; a < s->address && a < 0x100; a++)
+				used[a >> 6] |= 1ULL << (a & 63);
+		}
+	}
+}
+
+// Largest zero page sections are placed first, then by alignment and section order
+struct ZeroPageOrder {
+	const Section *sections;
+	bool operator()(int a, int b) const {
+		int size_a = sections[a].address - sections[a].start_address;
+		int size_b = sections[b].address - sections[b].start_address;
+		if (size_a != size_b) { return size_a > size_b; }
+		if (sections[a].align_address != sections[b].align_address) { return sections[a].align_address > sections[b].align_address; }
+		return a < b;
+	}
+};
+
+// Collect all unassigned ZP sections and place each at the highest free address that fits
 StatusCode Asm::LinkZP() {
-	uint8_t min_addr = 0xff, max_addr = 0x00;
 	int num_addr = 0;
-	bool has_assigned = false, has_unassigned = false;
-	int first_unassigned = -1;
-
-	// determine if any zeropage section has been asseigned
+	std::vector<int> unassigned;
 	for (std::vector<Section>::iterator s = allSections.begin(); s!=allSections.end(); ++s) {
 		if (s->type==ST_ZEROPAGE&&!s->IsMergedSection()) {
-			if (s->address_assigned) {
-				has_assigned = true;
-				if (s->start_address<(int)min_addr) {
-					min_addr = (uint8_t)s->start_address;
-				} else if ((int)s->address>max_addr) {
-					max_addr = (uint8_t)s->address;
-				}
-			} else {
-				has_unassigned = true;
-				first_unassigned = first_unassigned>=0 ? first_unassigned : (int)(&*s-&allSections[0]);
-			}
+			if (!s->address_assigned) { unassigned.push_back(SectionId(*s)); }
 			num_addr += s->address-s->start_address;
 		}
 	}
 	if (num_addr>0x100) { return ERROR_ZEROPAGE_SECTION_OUT_OF_RANGE; }
 	// no unassigned zp section, nothing to fix
-	if (!has_unassigned) { return STATUS_OK; }
+	if (!unassigned.size()) { return STATUS_OK; }
 
-	StatusCode status = STATUS_OK;
-	if (!has_assigned) {	// no section assigned => fit together at end
-		int address = 0x100 - num_addr;
-		for (std::vector<Section>::iterator s = allSections.begin(); status==STATUS_OK && s != allSections.end(); ++s) {
-			if (s->type == ST_ZEROPAGE && !s->IsMergedSection()) {
-				status = AssignAddressToSection((int)(&*s - &allSections[0]), address);
-				address = s->address;
-			}
-		}
-	} else {	// find first fit neighbouring an address assigned zero page section
-		for (std::vector<Section>::iterator s = allSections.begin(); s != allSections.end(); ++s) {
-			if (s->type == ST_ZEROPAGE && !s->IsMergedSection() && !s->address_assigned) {
-				int size = s->address - s->start_address;
-				bool found = false;
-				// find any assigned address section and try to place before or after
-				for (std::vector<Section>::iterator sa = allSections.begin(); sa != allSections.end(); ++sa) {
-					if (sa->type == ST_ZEROPAGE && !sa->IsMergedSection() && sa->address_assigned) {
-						for (int e = 0; e < 2; ++e) {
-							int start = e ? sa->start_address - size : sa->address;
-							int align_size = s->align_address <= 1 ? 0 :
-								(s->align_address - (start % s->align_address)) % s->align_address;
-							start += align_size;
-							int end = start + size;
-							if (start >= 0 && end <= 0x100) {
-								for (std::vector<Section>::iterator sc = allSections.begin(); !found && sc != allSections.end(); ++sc) {
-									found = true;
-									if (&*sa != &*sc && sc->type == ST_ZEROPAGE && !sc->IsMergedSection() && sc->address_assigned) {
-										if (start <= sc->address && sc->start_address <= end)
-											found = false;
-									}
-								}
-							}
-							if (found) { AssignAddressToSection((int)(&*s-&allSections[0]), start); }
-						}
-					}
-				}
-				if (!found) { return ERROR_ZEROPAGE_SECTION_OUT_OF_RANGE; }
+	uint64_t used[4];
+	ZeroPageUsed(used);
+	ZeroPageOrder order = { &allSections[0] };
+	std::sort(unassigned.begin(), unassigned.end(), order);
+	for (std::vector<int>::iterator i = unassigned.begin(); i != unassigned.end(); ++i) {
+		Section &s = allSections[*i];
+		int size = s.address - s.start_address;
+		int align = s.align_address > 1 ? s.align_address : 1;
+		// scan down counting the free bytes from each address
+		int start = -1;
+		for (int a = 0xff, run = 0; a >= 0 && start < 0; a--) {
+			run = (used[a >> 6] & (1ULL << (a & 63))) ? 0 : (run + 1);
+			if (run >= size && !(a % align)) { start = a; }
+		}
+		if (start < 0) {
+			if (!error_encountered) {	// report the fragmentation once
+				int blocks, largest, free_bytes = ZeroPageFree(used, blocks, largest);
+				Print(stderr, "Error: zero page section \"" STRREF_FMT "\" needs %d bytes, %d bytes free in %d blocks, largest %d\n",
+					STRREF_ARG(s.name), size, free_bytes, blocks, largest);
+				error_encountered = true;
 			}
+			return ERROR_ZEROPAGE_SECTION_OUT_OF_RANGE;
 		}
+		StatusCode status = AssignAddressToSection(*i, start);
+		if (status != STATUS_OK) { return status; }
+		for (int a = start; a < (start + size); a++) { used[a >> 6] |= 1ULL << (a & 63); }
 	}
-	return status;
+	return STATUS_OK;
 }
 
 // Apply labels assigned to addresses in a relative section a fixed address or as part of another section
@@ -2296,7 +2774,7 @@ StatusCode Asm::LinkRelocs(int section_id, int section_new, int section_address)
 				}
 			}
 			if (pList->empty()) {
-				free(pList);
+				delete pList;
 				s2.pRelocs = nullptr;
 			}
 		}
@@ -2470,6 +2948,13 @@ StatusCode Asm::MergeSectionsByName(int first_section) {
 		if (i->type != ST_REMOVED) {
 			if (first_code_seg<0 && i->type==ST_CODE)
 				first_code_seg = (int)(&*i-&allSections[0]);
+			// grow the output once for all sections with the same name
+			uint32_t merge_size = 0;
+			for (std::vector<Section>::iterator n = i + 1; n != allSections.end(); ++n) {
+				if (n->name.same_str_case(i->name) && n->type == i->type)
+					merge_size += n->size() + (n->align_address > 1 ? n->align_address : 0);
+			}
+			if (merge_size && i->CheckOutputCapacity(merge_size) != STATUS_OK) { return ERROR_OUT_OF_MEMORY; }
 			std::vector<Section>::iterator n = i;
 			++n;
 			while (n != allSections.end()) {
@@ -2548,7 +3033,7 @@ StatusCode Section::CheckOutputCapacity(uint32_t addSize) {
 	if ((addSize + currSize) >= output_capacity) {
 		size_t newSize = currSize * 2;
 		if (newSize<64*1024) { newSize = 64*1024; }
-		if ((addSize+currSize)>newSize) { newSize += newSize; }
+		while ((addSize+currSize)>=newSize) { newSize += newSize; }
 		if (uint8_t *new_output = (uint8_t*)malloc(newSize)) {
 			memcpy(new_output, output, size());
 			curr = new_output + (curr - output);
@@ -2672,6 +3157,7 @@ StatusCode Asm::ExitScope()
 	if (error>=FIRST_ERROR) { return error; }
 	--scope_depth;
 	if (scope_depth<0) { return ERROR_UNBALANCED_SCOPE_CLOSURE; }
+	if (scope_depth<page_check_scope) { page_check_scope = -1; }
 	return STATUS_OK;
 }
 
@@ -2689,6 +3175,7 @@ StatusCode Asm::PushContext(strref src_name, strref src_file, strref code_seg, i
 	conditional_consumed[conditional_depth] = false;
 	contextStack.push(src_name, src_file, code_seg, rept);
 	contextStack.curr().conditional_ctx = (int16_t)conditional_depth;
+	if (rept > 1) { contextStack.curr().token_stream = TokenStreamIndex(code_seg); }
 	if (scope_depth>=(MAX_SCOPE_DEPTH-1)) {
 		return ERROR_TOO_DEEP_SCOPE;
 	} else {
@@ -2757,7 +3244,7 @@ StatusCode Asm::AddMacro(strref macro, strref source_name, strref source_file, s
 			params_first_line = true;
 		}
 	}
-	uint32_t hash = name.fnv1a();
+	uint32_t hash = name.hash();
 	uint32_t ins = FindLabelIndex(hash, macros.getKeys(), macros.count());
 	Macro *pMacro = nullptr;
 	while (ins < macros.count() && macros.getKey(ins)==hash) {
@@ -2818,6 +3305,31 @@ StatusCode Asm::AddMacro(strref macro, strref source_name, strref source_file, s
 	return STATUS_OK;
 }
 
+// Record where a macro is expanded if debug info is generated
+int Asm::AddMacroSite(const Macro &m, strref macro_src) {
+	if (!debug_info || !contextStack.has_work()) { return -1; }
+	const SourceContext &ctx = contextStack.curr();
+	MacroSite site;
+	site.macro = m.name;
+	site.source_name = m.source_name;
+	site.source_file = m.source_file;
+	site.source_offs = m.source_file.is_substr(macro_src.get()) ? int(macro_src.get() - m.source_file.get()) : 0;
+	site.site_file = ctx.source_file;
+	site.site_name = ctx.source_name;
+	site.site_offs = int(ctx.read_source.get() - ctx.source_file.get());
+	site.parent = ctx.macro_site;
+	macroSites.push_back(site);
+	return (int)macroSites.size() - 1;
+}
+
+// Mark the context of a macro just pushed with the macro site
+void Asm::EnterMacroSite(int site, bool expanded) {
+	if (site >= 0) {
+		contextStack.curr().macro_site = site;
+		if (expanded) { macroSites[site].expansion = contextStack.curr().source_file; }
+	}
+}
+
 // Compile in a macro
 StatusCode Asm::BuildMacro(Macro &m, strref arg_list) {
 	strref macro_src = m.macro, params;
@@ -2832,6 +3344,7 @@ StatusCode Asm::BuildMacro(Macro &m, strref arg_list) {
 	else { params = (macro_src[0]=='(' ? macro_src.scoped_block_skip() : strref()); }
 	params.trim_whitespace();
 	arg_list.trim_whitespace();
+	int site = AddMacroSite(m, macro_src);
 	if (Merlin()) {
 		// need to include comment field because separator is ;
 		if (contextStack.curr().read_source.is_substr(arg_list.get()))
@@ -2881,6 +3394,7 @@ StatusCode Asm::BuildMacro(Macro &m, strref arg_list) {
 				}
 			}
 			PushContext(m.source_name, macexp.get_strref(), macexp.get_strref());
+			EnterMacroSite(site, true);
 			return STATUS_OK;
 		} else { return ERROR_OUT_OF_MEMORY_FOR_MACRO_EXPANSION; }
 	} else if (params) {
@@ -2908,10 +3422,13 @@ StatusCode Asm::BuildMacro(Macro &m, strref arg_list) {
 				macexp.replace_bookend(param, a, label_end_char_range);
 			}
 			PushContext(m.source_name, macexp.get_strref(), macexp.get_strref());
+			EnterMacroSite(site, true);
 			return STATUS_OK;
 		} else { return ERROR_OUT_OF_MEMORY_FOR_MACRO_EXPANSION; }
 	}
 	PushContext(m.source_name, m.source_file, macro_src);
+	contextStack.curr().token_stream = TokenStreamIndex(macro_src);
+	EnterMacroSite(site, false);
 	return STATUS_OK;
 }
 
@@ -2923,7 +3440,7 @@ StatusCode Asm::BuildMacro(Macro &m, strref arg_list) {
 
 // Enums are Structs in disguise
 StatusCode Asm::BuildEnum(strref name, strref declaration) {
-	uint32_t hash = name.fnv1a();
+	uint32_t hash = name.hash();
 	uint32_t ins = FindLabelIndex(hash, labelStructs.getKeys(), labelStructs.count());
 	LabelStruct *pEnum = nullptr;
 	while (ins < labelStructs.count() && labelStructs.getKey(ins)==hash) {
@@ -2958,7 +3475,7 @@ StatusCode Asm::BuildEnum(strref name, strref declaration) {
 		struct MemberOffset member;
 		member.offset = (uint16_t)value;
 		member.name = member_name;
-		member.name_hash = member.name.fnv1a();
+		member.name_hash = member.name.hash();
 		member.sub_struct = strref();
 		structMembers.push_back(member);
 		++value;
@@ -2968,7 +3485,7 @@ StatusCode Asm::BuildEnum(strref name, strref declaration) {
 }
 
 StatusCode Asm::BuildStruct(strref name, strref declaration) {
-	uint32_t hash = name.fnv1a();
+	uint32_t hash = name.hash();
 	uint32_t ins = FindLabelIndex(hash, labelStructs.getKeys(), labelStructs.count());
 	LabelStruct *pStruct = nullptr;
 	while (ins < labelStructs.count() && labelStructs.getKey(ins)==hash) {
@@ -2984,8 +3501,8 @@ StatusCode Asm::BuildStruct(strref name, strref declaration) {
 	pStruct->name = name;
 	pStruct->first_member = (uint16_t)structMembers.size();
 
-	uint32_t byte_hash = struct_byte.fnv1a();
-	uint32_t word_hash = struct_word.fnv1a();
+	uint32_t byte_hash = struct_byte.hash();
+	uint32_t word_hash = struct_word.hash();
 	uint16_t size = 0;
 	uint16_t member_count = 0;
 
@@ -2994,7 +3511,7 @@ StatusCode Asm::BuildStruct(strref name, strref declaration) {
 		strref type = line.split_label();
 		if (!type) { continue; }
 		line.skip_whitespace();
-		uint32_t type_hash = type.fnv1a();
+		uint32_t type_hash = type.hash();
 		uint16_t type_size = 0;
 		LabelStruct *pSubStruct = nullptr;
 		if (type_hash==byte_hash && struct_byte.same_str_case(type)) {
@@ -3024,7 +3541,7 @@ StatusCode Asm::BuildStruct(strref name, strref declaration) {
 		struct MemberOffset member;
 		member.offset = size;
 		member.name = line.get_label();
-		member.name_hash = member.name.fnv1a();
+		member.name_hash = member.name.hash();
 		member.sub_struct = pSubStruct ? pSubStruct->name : strref();
 		structMembers.push_back(member);
 
@@ -3035,7 +3552,7 @@ StatusCode Asm::BuildStruct(strref name, strref declaration) {
 		struct MemberOffset bytes_member;
 		bytes_member.offset = size;
 		bytes_member.name = "bytes";
-		bytes_member.name_hash = bytes_member.name.fnv1a();
+		bytes_member.name_hash = bytes_member.name.hash();
 		bytes_member.sub_struct = strref();
 		structMembers.push_back(bytes_member);
 		member_count++;
@@ -3051,7 +3568,7 @@ StatusCode Asm::EvalStruct(strref name, int &value) {
 	uint16_t offset = 0;
 	while (strref struct_seg = name.split_token('.')) {
 		strref sub_struct = struct_seg;
-		uint32_t seg_hash = struct_seg.fnv1a();
+		uint32_t seg_hash = struct_seg.hash();
 		if (pStruct) {
 			struct MemberOffset *member = &structMembers[pStruct->first_member];
 			bool found = false;
@@ -3067,7 +3584,7 @@ StatusCode Asm::EvalStruct(strref name, int &value) {
 			if (!found) { return ERROR_REFERENCED_STRUCT_NOT_FOUND; }
 		}
 		if (sub_struct) {
-			uint32_t hash = sub_struct.fnv1a();
+			uint32_t hash = sub_struct.hash();
 			uint32_t index = FindLabelIndex(hash, labelStructs.getKeys(), labelStructs.count());
 			while (index < labelStructs.count() && labelStructs.getKey(index)==hash) {
 				if (sub_struct.same_str_case(labelStructs.getValue(index).name)) {
@@ -3090,6 +3607,7 @@ StatusCode Asm::EvalStruct(strref name, int &value) {
 //
 
 int Asm::ReptCnt() const {
+	if (!contextStack.has_work()) { return 0; }	// -D labels are assigned before any source
 	return contextStack.curr().repeat_total - contextStack.curr().repeat;
 }
 
@@ -3523,6 +4041,7 @@ void Asm::AddLateEval(int target, int pc, int scope_pc, strref expression, strre
 	le.section = (int16_t)(&CurrSection() - &allSections[0]);
 	le.rept = contextStack.curr().repeat_total - contextStack.curr().repeat;
 	le.file_ref = -1; // current or xdef'd
+	le.opt_site = -1;
 	le.label.clear();
 	le.expression = expression;
 	le.source_file = source_file;
@@ -3541,6 +4060,7 @@ void Asm::AddLateEval(strref label, int pc, int scope_pc, strref expression, Lat
 	le.section = (int16_t)(&CurrSection() - &allSections[0]);
 	le.rept = contextStack.curr().repeat_total - contextStack.curr().repeat;
 	le.file_ref = -1; // current or xdef'd
+	le.opt_site = -1;
 	le.expression = expression;
 	le.source_file.clear();
 	le.type = type;
@@ -3590,6 +4110,10 @@ StatusCode Asm::CheckLateEval(strref added_label, int scope_end, bool print_miss
 					if (i->type != LateEval::LET_LABEL) {
 					}
 					bool resolved = true;
+					if (i->opt_site >= 0 && i->type != LateEval::LET_BRANCH) {
+						zpSites[i->opt_site].fits = value>=0 && value<0x100 && (ret==STATUS_OK ||
+							(lastEvalSection>=0 && allSections[lastEvalSection].type==ST_ZEROPAGE));
+					}
 					switch (i->type) {
 						case LateEval::LET_BYTE:
 							if (ret==STATUS_RELATIVE_SECTION) {
@@ -3653,7 +4177,9 @@ StatusCode Asm::CheckLateEval(strref added_label, int scope_end, bool print_miss
 
 						case LateEval::LET_BRANCH:
 							value -= i->address+1;
-							if (value<-128 || value>127) {
+							if ((value<-128 || value>127) && i->opt_site >= 0 && !final_pass) {
+								branchSites[i->opt_site].out_of_range = true;	// long branch in the next pass
+							} else if (value<-128 || value>127) {
 								i = lateEval.erase(i);
 								return ERROR_BRANCH_OUT_OF_RANGE;
 							} if (trg>=allSections[sec].size()) {
@@ -3711,7 +4237,7 @@ StatusCode Asm::CheckLateEval(strref added_label, int scope_end, bool print_miss
 
 // Get a label record if it exists
 Label *Asm::GetLabel(strref label) {
-	uint32_t label_hash = label.fnv1a();
+	uint32_t label_hash = label.hash();
 	uint32_t index = FindLabelIndex(label_hash, labels.getKeys(), labels.count());
 	while (index < labels.count() && label_hash == labels.getKey(index)) {
 		if (label.same_str(labels.getValue(index).label_name)) {
@@ -3726,7 +4252,7 @@ Label *Asm::GetLabel(strref label) {
 Label *Asm::GetLabel(strref label, int file_ref) {
 	if (file_ref>=0 && file_ref<(int)externals.size()) {
 		ExtLabels &labs = externals[file_ref];
-		uint32_t label_hash = label.fnv1a();
+		uint32_t label_hash = label.hash();
 		uint32_t index = FindLabelIndex(label_hash, labs.labels.getKeys(), labs.labels.count());
 		while (index < labs.labels.count() && label_hash == labs.labels.getKey(index)) {
 			if (label.same_str(labs.labels.getValue(index).label_name)) {
@@ -3782,7 +4308,7 @@ StatusCode Asm::FlushLocalLabels(int scope_exit) {
 		StatusCode this_status = CheckLateEval(label);
 		if (this_status>FIRST_ERROR) { status = this_status; }
 		if (!i->scope_reserve || i->scope_depth<=scope_exit) {
-			uint32_t index = FindLabelIndex(label.fnv1a(), labels.getKeys(), labels.count());
+			uint32_t index = FindLabelIndex(label.hash(), labels.getKeys(), labels.count());
 			while (index<labels.count()) {
 				if (label.same_str_case(labels.getValue(index).label_name)) {
 					labels.remove(index);
@@ -3798,7 +4324,7 @@ StatusCode Asm::FlushLocalLabels(int scope_exit) {
 
 // Get a label pool by name
 LabelPool* Asm::GetLabelPool(strref pool_name) {
-	uint32_t pool_hash = pool_name.fnv1a();
+	uint32_t pool_hash = pool_name.hash();
 	uint32_t ins = FindLabelIndex(pool_hash, labelPools.getKeys(), labelPools.count());
 	while (ins < labelPools.count() && pool_hash == labelPools.getKey(ins)) {
 		if (pool_name.same_str(labelPools.getValue(ins).pool_name)) {
@@ -3811,7 +4337,7 @@ LabelPool* Asm::GetLabelPool(strref pool_name) {
 
 // Add a label pool
 StatusCode Asm::AddLabelPool(strref name, strref args) {
-	uint32_t pool_hash = name.fnv1a();
+	uint32_t pool_hash = name.hash();
 	uint32_t ins = FindLabelIndex(pool_hash, labelPools.getKeys(), labelPools.count());
 	uint32_t index = ins;
 	while (index < labelPools.count() && pool_hash == labelPools.getKey(index)) {
@@ -3878,7 +4404,7 @@ StatusCode Asm::AssignPoolLabel(LabelPool &pool, strref label) {
 					// permanently remove this chunk from the parent pool
 					pool.end = addr;
 					pool.depth = 0;
-					uint32_t pool_hash = label.fnv1a();
+					uint32_t pool_hash = label.hash();
 					uint32_t ins = FindLabelIndex(pool_hash, labelPools.getKeys(), labelPools.count());
 					labelPools.insert(ins, pool_hash);
 					LabelPool &subPool = labelPools.getValue(ins);
@@ -3914,7 +4440,7 @@ StatusCode Asm::AssignPoolLabel(LabelPool &pool, strref label) {
 	uint16_t addr;
 	StatusCode error = pool.Reserve(bytes, addr, (uint16_t)brace_depth);
 	if (error!=STATUS_OK) { return error; }
-	Label *pLabel = AddLabel(label.fnv1a());
+	Label *pLabel = AddLabel(label.hash());
 	pLabel->label_name = label;
 	pLabel->pool_name = pool.pool_name;
 	pLabel->evaluated = true;
@@ -3956,7 +4482,7 @@ void LabelPool::ExitScope(uint16_t scope) {
 
 // Check if a label is marked as an xdef
 bool Asm::MatchXDEF(strref label) {
-	uint32_t hash = label.fnv1a();
+	uint32_t hash = label.hash();
 	uint32_t pos = FindLabelIndex(hash, xdefs.getKeys(), xdefs.count());
 	while (pos < xdefs.count() && xdefs.getKey(pos) == hash) {
 		if (label.same_str_case(xdefs.getValue(pos))) { return true; }
@@ -3980,7 +4506,7 @@ StatusCode Asm::AssignLabel(strref label, strref line, bool make_constant) {
 		if (pLabel->constant && pLabel->evaluated && val!=pLabel->value) {
 			return (status==STATUS_NOT_READY) ? STATUS_OK : ERROR_MODIFYING_CONST_LABEL;
 		}
-	} else { pLabel = AddLabel(label.fnv1a()); }
+	} else { pLabel = AddLabel(label.hash()); }
 
 	pLabel->label_name = label;
 	pLabel->pool_name.clear();
@@ -4011,7 +4537,7 @@ StatusCode Asm::AddressLabel(strref label)
 	Label *pLabel = GetLabel(label);
 	bool constLabel = false;
 	if (!pLabel) {
-		pLabel = AddLabel(label.fnv1a());
+		pLabel = AddLabel(label.hash());
 	} else if (pLabel->constant && pLabel->value!=CurrSection().GetPC()) {
 		return ERROR_MODIFYING_CONST_LABEL;
 	} else { constLabel = pLabel->constant; }
@@ -4026,6 +4552,7 @@ StatusCode Asm::AddressLabel(strref label)
 	pLabel->reference = false;
 	pLabel->constant = constLabel;
 	last_label = label;
+	if (page_check_scope>=0) { page_check_label = true; }
 	bool local = label[0]=='.' || label[0]=='@' || label[0]=='!' || label[0]==':' || label.get_last()=='$';
 	LabelAdded(pLabel, local);
 	if (local) { MarkLabelLocal(label); }
@@ -4083,7 +4610,7 @@ StatusCode Asm::IncludeSymbols(strref line) {
 // Get a string record if it exists
 StringSymbol *Asm::GetString(strref string_name)
 {
-	uint32_t string_hash = string_name.fnv1a();
+	uint32_t string_hash = string_name.hash();
 	uint32_t index = FindLabelIndex(string_hash, strings.getKeys(), strings.count());
 	while (index < strings.count() && string_hash == strings.getKey(index)) {
 		if (string_name.same_str(strings.getValue(index).string_name))
@@ -4098,7 +4625,7 @@ StringSymbol *Asm::AddString(strref string_name, strref string_value)
 {
 	StringSymbol *pStr = GetString(string_name);
 	if (pStr==nullptr) {
-		uint32_t string_hash = string_name.fnv1a();
+		uint32_t string_hash = string_name.hash();
 		uint32_t index = FindLabelIndex(string_hash, strings.getKeys(), strings.count());
 		strings.insert(index, string_hash);
 		pStr = strings.getValues() + index;
@@ -4418,7 +4945,7 @@ StatusCode Asm::Directive_String(strref line)
 StatusCode Asm::Directive_Undef(strref line)
 {
 	strref name = line.split_range_trim(Merlin() ? label_end_char_range_merlin : label_end_char_range);
-	uint32_t name_hash = name.fnv1a();
+	uint32_t name_hash = name.hash();
 	uint32_t index = FindLabelIndex(name_hash, labels.getKeys(), labels.count());
 	while (index < labels.count() && name_hash == labels.getKey(index)) {
 		if (name.same_str(labels.getValue(index).label_name)) {
@@ -4677,7 +5204,7 @@ StatusCode Asm::Directive_XDEF(strref line)
 		char f = xdef.get_first();
 		char e = xdef.get_last();
 		if (f != '.' && f != '!' && f != '@' && e != '$') {
-			uint32_t hash = xdef.fnv1a();
+			uint32_t hash = xdef.hash();
 			uint32_t pos = FindLabelIndex(hash, xdefs.getKeys(), xdefs.count());
 			while (pos < xdefs.count() && xdefs.getKey(pos) == hash) {
 				if (xdefs.getValue(pos).same_str_case(xdef))
@@ -4695,7 +5222,7 @@ StatusCode Asm::Directive_XREF(strref label)
 {
 	// XREF already defined label => no action
 	if (!GetLabel(label)) {
-		Label *pLabelXREF = AddLabel(label.fnv1a());
+		Label *pLabelXREF = AddLabel(label.hash());
 		pLabelXREF->label_name = label;
 		pLabelXREF->pool_name.clear();
 		pLabelXREF->section = -1;	// address labels are based on section
@@ -4811,35 +5338,35 @@ StatusCode Asm::Directive_EVAL(strref line)
 	if (line && EvalExpression(line, etx, value) == STATUS_OK) {
 		if (description) {
 			if (pStr != nullptr) {
-				printf("EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = \"" STRREF_FMT "\" = $%x\n",
+				Print(stdout, "EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = \"" STRREF_FMT "\" = $%x\n",
 					contextStack.curr().source_file.count_lines(description) + 1, STRREF_ARG(description), STRREF_ARG(line), STRREF_ARG(pStr->get()), value);
 			} else {
-				printf("EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = $%x\n",
+				Print(stdout, "EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = $%x\n",
 					contextStack.curr().source_file.count_lines(description) + 1, STRREF_ARG(description), STRREF_ARG(line), value);
 			}
 		} else {
 			if (pStr != nullptr) {
-				printf("EVAL(%d): \"" STRREF_FMT "\" = \"" STRREF_FMT "\" = $%x\n",
+				Print(stdout, "EVAL(%d): \"" STRREF_FMT "\" = \"" STRREF_FMT "\" = $%x\n",
 					contextStack.curr().source_file.count_lines(line) + 1, STRREF_ARG(line), STRREF_ARG(pStr->get()), value);
 			} else {
-				printf("EVAL(%d): \"" STRREF_FMT "\" = $%x\n",
+				Print(stdout, "EVAL(%d): \"" STRREF_FMT "\" = $%x\n",
 					contextStack.curr().source_file.count_lines(line) + 1, STRREF_ARG(line), value);
 			}
 		}
 	} else if (description) {
 		if (pStr != nullptr) {
-			printf("EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = \"" STRREF_FMT "\"\n",
+			Print(stdout, "EVAL(%d): " STRREF_FMT ": \"" STRREF_FMT "\" = \"" STRREF_FMT "\"\n",
 				contextStack.curr().source_file.count_lines(description) + 1, STRREF_ARG(description), STRREF_ARG(line), STRREF_ARG(pStr->get()));
 		} else {
-			printf("EVAL(%d): \"" STRREF_FMT ": " STRREF_FMT"\"\n",
+			Print(stdout, "EVAL(%d): \"" STRREF_FMT ": " STRREF_FMT"\"\n",
 				contextStack.curr().source_file.count_lines(description) + 1, STRREF_ARG(description), STRREF_ARG(line));
 		}
 	} else {
 		if (pStr != nullptr) {
-			printf("EVAL(%d): \"" STRREF_FMT "\" = \"" STRREF_FMT "\"\n",
+			Print(stdout, "EVAL(%d): \"" STRREF_FMT "\" = \"" STRREF_FMT "\"\n",
 				contextStack.curr().source_file.count_lines(line) + 1, STRREF_ARG(line), STRREF_ARG(pStr->get()));
 		} else {
-			printf("EVAL(%d): \"" STRREF_FMT "\"\n",
+			Print(stdout, "EVAL(%d): \"" STRREF_FMT "\"\n",
 				contextStack.curr().source_file.count_lines(line) + 1, STRREF_ARG(line));
 		}
 	}
@@ -5189,6 +5716,12 @@ StatusCode Asm::ApplyDirective(AssemblerDirective dir, strref line, strref sourc
 		case AD_XY8:			// A8: Set 8 bit accumulator mode
 			index_reg_16bit = false;
 			break;
+
+		case AD_PAGECHECK:		// PAGECHECK [OFF]: check page crossings until OFF or the scope ends
+			line.trim_whitespace();
+			if (line.same_str("off")) { page_check_scope = -1; }
+			else if (page_check_scope<0) { page_check_scope = scope_depth; }
+			break;
 			
 		case AD_MX:
 			if (line) {
@@ -5203,7 +5736,7 @@ StatusCode Asm::ApplyDirective(AssemblerDirective dir, strref line, strref sourc
 		case AD_ABORT:
 			line.trim_whitespace();
 			if (line)
-				printf("Assembler aborted: " STRREF_FMT "\n", STRREF_ARG(line));
+				Print(stdout, "Assembler aborted: " STRREF_FMT "\n", STRREF_ARG(line));
 			return ERROR_ABORTED;
 			
 		case AD_LST:
@@ -5390,6 +5923,14 @@ StatusCode Asm::AddOpcode(strref line, int index, strref source_file) {
 		}
 	}
 
+	// forward reference that resolved to zero page in an earlier pass, unless the size is explicit
+	int zp_site = -1;
+	if (evalLater && zp_optimize && line.get_first()!='.' &&
+		((addrMode==AMB_ABS && (validModes & AMM_ZP)) || (addrMode==AMB_ABS_X && (validModes & AMM_ZP_X)))) {
+		zp_site = AddZPSite(expression);
+		if (zpSites[zp_site].state == ZPSite::ZPS_ZP) { addrMode = addrMode==AMB_ABS ? AMB_ZP : AMB_ZP_X; }
+	}
+
 	// Check if an explicit 24 bit address
 	if (expression[0] == '$' && (expression + 1).len_hex()>4) {
 		if (addrMode==AMB_ABS&&(validModes & AMM_ABS_L)) {
@@ -5490,17 +6031,19 @@ StatusCode Asm::AddOpcode(strref line, int index, strref source_file) {
 			
 		switch (codeArg) {
 			case CA_ONE_BYTE:
-				if (evalLater)
+				if (evalLater) {
 					AddLateEval(CurrSection().DataOffset(), CurrSection().GetPC(), scope_address[scope_depth], expression, source_file, LateEval::LET_BYTE);
-				else if (error == STATUS_RELATIVE_SECTION)
+					lateEval.back().opt_site = zp_site;
+				} else if (error == STATUS_RELATIVE_SECTION)
 					CurrSection().AddReloc(target_section_offs, CurrSection().DataOffset(), target_section, 1, target_section_shift);
 				AddByte(value);
 				break;
 
 			case CA_TWO_BYTES:
-				if (evalLater)
+				if (evalLater) {
 					AddLateEval(CurrSection().DataOffset(), CurrSection().GetPC(), scope_address[scope_depth], expression, source_file, LateEval::LET_ABS_REF);
-				else if (error == STATUS_RELATIVE_SECTION) {
+					lateEval.back().opt_site = zp_site;
+				} else if (error == STATUS_RELATIVE_SECTION) {
 					CurrSection().AddReloc(target_section_offs, CurrSection().DataOffset(), target_section, 2, target_section_shift);
 					value = 0;
 				}
@@ -5534,13 +6077,25 @@ StatusCode Asm::AddOpcode(strref line, int index, strref source_file) {
 				AddByte(value);
 				break;
 			}
-			case CA_BRANCH:
-				if (evalLater)
+			case CA_BRANCH: {
+				int branch_site = -1;
+				if (relax_branches && validModes == AMM_BRA) {
+					branch_site = AddBranchSite(expression);
+					if (!evalLater && (((int)value - (int)CurrSection().GetPC()-1) < -128 || ((int)value - (int)CurrSection().GetPC()-1) > 127))
+						branchSites[branch_site].relax = true;	// backward branch is known to be out of range
+					if (branchSites[branch_site].relax) {
+						error = AddRelaxedBranch(opcode, expression, source_file);
+						break;
+					}
+				}
+				if (evalLater) {
 					AddLateEval(CurrSection().DataOffset(), CurrSection().GetPC(), scope_address[scope_depth], expression, source_file, LateEval::LET_BRANCH);
-				else if (((int)value - (int)CurrSection().GetPC()-1) < -128 || ((int)value - (int)CurrSection().GetPC()-1) > 127)
+					lateEval.back().opt_site = branch_site;
+				} else if (((int)value - (int)CurrSection().GetPC()-1) < -128 || ((int)value - (int)CurrSection().GetPC()-1) > 127)
 					error = ERROR_BRANCH_OUT_OF_RANGE;
 				AddByte(evalLater ? 0 : (uint8_t)((int)value - (int)CurrSection().GetPC()) - 1);
 				break;
+			}
 
 			case CA_BRANCH_16:
 				if (evalLater)
@@ -5586,13 +6141,78 @@ void Asm::PrintError(strref line, StatusCode error, strref source) {
 	errorText.append(" \"");
 	errorText.append(line.get_trimmed_ws());
 	errorText.append("\"\n");
-	errorText.c_str();
-	fwrite(errorText.get(), errorText.get_len(), 1, stderr);
+	Print(stderr, "%s", errorText.c_str());
 	error_encountered = true;
 }
 
+// Print to stdout or stderr, or add to the held output if this pass may be repeated
+void Asm::Print(FILE *stream, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	if (!hold_output) {
+		vfprintf(stream, format, args);
+		va_end(args);
+		return;
+	}
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(nullptr, 0, format, copy);
+	va_end(copy);
+	if (len > 0) {
+		size_t start = heldText.size();
+		heldText.resize(start + len + 1);
+		vsnprintf(&heldText[start], len + 1, format, args);
+		heldText.pop_back();	// zero terminator
+		if (heldOutput.size() && heldOutput.back().stream == stream) { heldOutput.back().end = heldText.size(); }
+		else {
+			HeldOutput held = { stream, heldText.size() };
+			heldOutput.push_back(held);
+		}
+	}
+	va_end(args);
+}
+
+// Print the held output of the final pass and stop holding
+void Asm::ReleaseOutput() {
+	size_t start = 0;
+	for (std::vector<HeldOutput>::iterator i = heldOutput.begin(); i != heldOutput.end(); ++i) {
+		fwrite(&heldText[start], i->end - start, 1, i->stream);
+		start = i->end;
+	}
+	heldText.clear();
+	heldOutput.clear();
+	hold_output = false;
+}
+
 // Build a line of code
-StatusCode Asm::BuildLine(strref line) {
+// Split the first statement from a line, clips comments and whitespace and returns
+// the statement as code, the first word as operation and the rest in line
+static void LexStatement(strref &line, bool merlin, strref &code, strref &operation) {
+	line.skip_whitespace();				// skip to first character
+	line = line.before_or_full(';');	// clip any line comments
+	line = line.before_or_full(c_comment);
+	line.clip_trailing_whitespace();
+	if (line[0]==':'&&!merlin) { ++line; }	// Kick Assembler macro prefix (incompatible with merlin)
+	code = line;
+	operation = line.split_range(merlin ? label_end_char_range_merlin : label_end_char_range);
+	line.trim_whitespace();
+}
+
+// ignore leading period for instructions and directives - not for labels
+static strref InstructionName(strref operation, bool merlin) {
+	if ((!merlin&&operation[0]==':')||operation[0]=='.') { ++operation; }
+	return operation.before_or_full('.');
+}
+
+static strl_t TokenOffs(strref str, const char *buffer) {
+	return str.get() ? strl_t(str.get() - buffer) : NO_TOKEN_OFFS;
+}
+
+static strref TokenStr(const char *buffer, strl_t offs, strl_t len) {
+	return offs == NO_TOKEN_OFFS ? strref() : strref(buffer + offs, len);
+}
+
+StatusCode Asm::BuildLine(strref line, const LineToken *lexed) {
 	StatusCode error = STATUS_OK;
 
 	// MERLIN: First char of line is * means comment
@@ -5603,20 +6223,25 @@ StatusCode Asm::BuildLine(strref line) {
 	int start_address = CurrSection().address;
 	strref code_line = line;
 	list_flags = 0;
+	relaxed_branch_pc = -1;
+
+	// the first statement may already be lexed, copy it since lexing
+	// more lines of the same buffer can move it
+	LineToken lex = {};
+	if (lexed) { lex = *lexed; }
 
 	while (line && error == STATUS_OK) {
 		strref line_start = line;
 		char char0 = line[0];				// first char including white space
-		line.skip_whitespace();				// skip to first character
-		line = line.before_or_full(';');	// clip any line comments
-		line = line.before_or_full(c_comment);
-		line.clip_trailing_whitespace();
-		if (line[0]==':'&&!Merlin()) { ++line; }	// Kick Assembler macro prefix (incompatible with merlin)
-		strref line_nocom = line;
-		strref operation = line.split_range(Merlin() ? label_end_char_range_merlin : label_end_char_range);
+		strref line_nocom, operation;
+		if (lexed) {
+			const char *buffer = line.get() - lex.line;
+			line_nocom = TokenStr(buffer, lex.code, lex.code_len);
+			operation = TokenStr(buffer, lex.op, lex.op_len);
+			line = TokenStr(buffer, lex.args, lex.args_len);
+		} else { LexStatement(line, Merlin(), line_nocom, operation); }
 		char char1 = operation[0];			// first char of first word
 		char charE = operation.get_last();	// end char of first word
-		line.trim_whitespace();
 		bool force_label = charE==':' || charE=='$';
 		if (!force_label && Merlin()&&(line||operation)) { // MERLIN fixes and PoP does some naughty stuff like 'and = 0'
 			force_label = (!strref::is_ws(char0)&&char0!='{' && char0!='}')||char1==']'||charE=='?';
@@ -5657,12 +6282,10 @@ StatusCode Asm::BuildLine(strref line) {
 				}
 			} else { line.clear(); }
 		} else {
-			// ignore leading period for instructions and directives - not for labels
 			strref label = operation;
-			if ((!Merlin()&&operation[0]==':')||operation[0]=='.') { ++operation; }
-			operation = operation.before_or_full('.');
+			operation = InstructionName(operation, Merlin());
 
-			int op_idx = LookupOpCodeIndex(operation.fnv1a_lower(), aInstructions, num_instructions);
+			int op_idx = LookupOpCodeIndex(lexed ? lex.op_hash : operation.hash_lower(), aInstructions, num_instructions);
 			if (op_idx >= 0 && !force_label && (aInstructions[op_idx].type==OT_DIRECTIVE || line[0]!='=')) {
 				if (line_nocom.is_substr(operation.get())) {
 					line = line_nocom + strl_t(operation.get()+operation.get_len()-line_nocom.get());
@@ -5692,7 +6315,7 @@ StatusCode Asm::BuildLine(strref line) {
 				list_flags |= ListLine::KEYWORD;
 			}
 			else {
-				uint32_t nameHash = label.fnv1a();
+				uint32_t nameHash = lexed ? lex.label_hash : label.hash();
 				uint32_t macro = FindLabelIndex(nameHash, macros.getKeys(), macros.count());
 				bool gotConstruct = false;
 				while (macro < macros.count() && nameHash==macros.getKey(macro)) {
@@ -5760,14 +6383,15 @@ StatusCode Asm::BuildLine(strref line) {
 		if (error<ERROR_STOP_PROCESSING_ON_HIGHER) {
 			error = STATUS_OK;
 		}
+		lexed = nullptr;	// any following statement on the line is lexed here
 	}
 	// update listing
-	if (error == STATUS_OK && list_assembly) {
+	if (error == STATUS_OK && (list_assembly || debug_info || page_check_scope>=0)) {
 		if (SectionId() == start_section) {
 			Section &curr = CurrSection();
 			if (!curr.pListing) { curr.pListing = new Listing; }
 			if (curr.pListing && curr.pListing->size()==curr.pListing->capacity()) {
-				curr.pListing->reserve(curr.pListing->size()+256);
+				curr.pListing->reserve(curr.pListing->size()*2+256);
 			}
 			if (((list_flags&(ListLine::KEYWORD|ListLine::CYCLES_START|ListLine::CYCLES_STOP)) ||
 					(curr.address != start_address && curr.size())) && !curr.IsDummySection()) {
@@ -5777,7 +6401,18 @@ StatusCode Asm::BuildLine(strref line) {
 				lst.code = contextStack.curr().source_file;
 				lst.source_name = contextStack.curr().source_name;
 				lst.line_offs = int(code_line.get() - lst.code.get());
-				lst.flags = list_flags;
+				lst.flags = list_flags | (accumulator_16bit ? ListLine::ACC_16 : 0) | (index_reg_16bit ? ListLine::IDX_16 : 0) |
+					(page_check_scope>=0 ? ListLine::PAGE_CHECK : 0) | (page_check_label && lst.size ? ListLine::LABELED : 0);
+				if (lst.size) { page_check_label = false; }
+				lst.macro_site = contextStack.curr().macro_site;
+				if (relaxed_branch_pc > start_address && relaxed_branch_pc < curr.address) {
+					// the jump of a relaxed branch is listed as an instruction of its own
+					int size = relaxed_branch_pc - start_address;
+					lst.size = size;
+					curr.pListing->push_back(lst);
+					lst.address += size;
+					lst.size = curr.address - relaxed_branch_pc;
+				}
 				curr.pListing->push_back(lst);
 			}
 		}
@@ -5785,12 +6420,102 @@ StatusCode Asm::BuildLine(strref line) {
 	return error;
 }
 
+// Token stream of a code segment that is read more than once, created on the first read
+int Asm::TokenStreamIndex(strref buffer) {
+	if (!buffer) { return -1; }
+	uint64_t addr = (uint64_t)(size_t)buffer.get();
+	uint32_t hash = uint32_t(addr ^ (addr >> 32));
+	uint32_t index = FindLabelIndex(hash, tokenBuffers.getKeys(), tokenBuffers.count());
+	for (uint32_t i = index; i < tokenBuffers.count() && tokenBuffers.getKey(i) == hash; ++i) {
+		TokenStream &stream = tokenStreams[tokenBuffers.getValue(i)];
+		if (stream.buffer == buffer.get() && stream.size == buffer.get_len()) { return tokenBuffers.getValue(i); }
+	}
+	int id = (int)tokenStreams.size();
+	tokenStreams.push_back(TokenStream());
+	TokenStream &stream = tokenStreams[id];
+	stream.buffer = buffer.get();
+	stream.size = buffer.get_len();
+	stream.lexed = 0;
+	tokenBuffers.insert(index, hash);
+	tokenBuffers.getValue(index) = id;
+	return id;
+}
+
+// Lex the next line of a code segment
+void Asm::LexLine(TokenStream &stream) {
+	strref read(stream.buffer + stream.lexed, stream.size - stream.lexed);
+	LineToken tok;
+	tok.read = stream.lexed;
+	strref line = read.line();
+	tok.next = read ? strl_t(read.get() - stream.buffer) : stream.size;
+	tok.line = TokenOffs(line, stream.buffer);
+	tok.line_len = line.get_len();
+	tok.merlin = Merlin();
+	strref code, operation;
+	LexStatement(line, tok.merlin, code, operation);
+	tok.code = TokenOffs(code, stream.buffer);
+	tok.code_len = code.get_len();
+	tok.op = TokenOffs(operation, stream.buffer);
+	tok.op_len = operation.get_len();
+	tok.args = TokenOffs(line, stream.buffer);
+	tok.args_len = line.get_len();
+	tok.op_hash = InstructionName(operation, tok.merlin).hash_lower();
+	tok.label_hash = operation.hash();
+	if (stream.lines.size() == stream.lines.capacity()) { stream.lines.reserve(stream.lines.size() * 2 + 64); }
+	stream.lines.push_back(tok);
+	stream.lexed = tok.next;
+}
+
+// The lexed line at the read position of a context, lines up to the read position are
+// lexed on the first read. Returns nullptr if the context is not at the start of a line.
+const LineToken* Asm::ReadLineToken(SourceContext &ctx) {
+	if (ctx.token_stream < 0) { return nullptr; }
+	TokenStream &stream = tokenStreams[ctx.token_stream];
+	if (ctx.read_source.get() < stream.buffer) { return nullptr; }
+	strl_t read = strl_t(ctx.read_source.get() - stream.buffer);
+	strl_t end = read + ctx.read_source.get_len();
+	if (end > stream.size) { return nullptr; }
+	uint32_t index = ctx.token_line;
+	if (index >= stream.lines.size() || stream.lines[index].read != read) {
+		if (read >= stream.lexed) {
+			while (stream.lexed < read) { LexLine(stream); }
+			if (stream.lexed == read) { LexLine(stream); }
+			index = (uint32_t)stream.lines.size() - 1;
+		} else {
+			uint32_t first = 0, count = (uint32_t)stream.lines.size();
+			while (count) {
+				uint32_t step = count >> 1;
+				if (stream.lines[first + step].read < read) { first += step + 1; count -= step + 1; }
+				else { count = step; }
+			}
+			index = first;
+		}
+		if (index >= stream.lines.size() || stream.lines[index].read != read) { return nullptr; }
+	}
+	const LineToken &tok = stream.lines[index];
+	if (tok.next > end) { return nullptr; }	// the segment ends within the line
+	ctx.token_line = index + 1;
+	return &tok;
+}
+
 // Build a segment of code (file or macro)
 StatusCode Asm::BuildSegment() {
 	StatusCode error = STATUS_OK;
 	while (contextStack.curr().read_source) {
-		contextStack.curr().next_source = contextStack.curr().read_source;
-		error = BuildLine(contextStack.curr().next_source.line());
+		SourceContext &ctx = contextStack.curr();
+		strref line;
+		const LineToken *lexed = ReadLineToken(ctx);
+		if (lexed) {
+			const char *buffer = tokenStreams[ctx.token_stream].buffer;
+			strl_t end = strl_t(ctx.read_source.get() + ctx.read_source.get_len() - buffer);
+			line = strref(buffer + lexed->line, lexed->line_len);
+			ctx.next_source = lexed->next < end ? strref(buffer + lexed->next, end - lexed->next) : strref();
+			if (lexed->merlin != Merlin()) { lexed = nullptr; }
+		} else {
+			ctx.next_source = ctx.read_source;
+			line = ctx.next_source.line();
+		}
+		error = BuildLine(line, lexed);
 		if (error>ERROR_STOP_PROCESSING_ON_HIGHER) { break; }
 		contextStack.curr().read_source = contextStack.curr().next_source;
 	}
@@ -5835,213 +6560,1501 @@ struct cycleCnt {
 	}
 };
 
-bool Asm::List(strref filename) {
-	FILE *f = stdout;
-	bool opened = false;
-	if (filename) {
-		f = fopen(strown<512>(filename).c_str(), "w");
-		if (!f) { return false; }
-		opened = true;
+// Text output is collected in a buffer and written to the file in large blocks
+#define TEXT_FLUSH_SIZE (256*1024)
+struct TextBuffer {
+	std::vector<char> text;
+	FILE *f;				// without a file the text is kept until written
+	TextBuffer(FILE *file = nullptr) : f(file) { if (f) { text.reserve(TEXT_FLUSH_SIZE + 1024); } }
+	~TextBuffer() { flush(); }
+	void append(strref str) {
+		text.insert(text.end(), str.get(), str.get() + str.get_len());
+		if (f && text.size() >= TEXT_FLUSH_SIZE) { flush(); }
 	}
+	void line(strref str) {
+		text.insert(text.end(), str.get(), str.get() + str.get_len());
+		text.push_back('\n');
+		if (f && text.size() >= TEXT_FLUSH_SIZE) { flush(); }
+	}
+	void write(const TextBuffer &o) {
+		if (o.text.size()) { text.insert(text.end(), o.text.begin(), o.text.end()); }
+		if (f && text.size() >= TEXT_FLUSH_SIZE) { flush(); }
+	}
+	void flush() {
+		if (f && text.size()) {
+			fwrite(&text[0], text.size(), 1, f);
+			text.clear();
+		}
+	}
+};
 
-	// ensure that the greatest instruction set referenced is used for listing
-	if (list_cpu!=cpu) { SetCPU(list_cpu); }
-
-	// Build a disassembly lookup table
-	uint8_t mnemonic[256];
-	uint8_t addrmode[256];
-	memset(mnemonic, 255, sizeof(mnemonic));
-	memset(addrmode, 255, sizeof(addrmode));
-	for (int i = 0; i < opcode_count; i++) {
-		for (int j = AMB_COUNT-1; j >= 0; j--) {
-			if (opcode_table[i].modes & (1 << j)) {
-				uint8_t op = opcode_table[i].aCodes[j];
-				if (addrmode[op]==255) {
-					mnemonic[op] = (uint8_t)i;
-					addrmode[op] = (uint8_t)j;
-				}
+// Line numbers of a source file, found by a binary search of the line breaks
+struct ListLineIndex {
+	const char *code;
+	strl_t size;
+	std::vector<strl_t> breaks;	// offset of each line break (CR LF counts as one)
+	void build(strref src) {
+		code = src.get();
+		size = src.get_len();
+		breaks.clear();
+		for (strl_t i = 0; i < size; ++i) {
+			char c = code[i];
+			if (c == 0x0a || c == 0x0d) {
+				breaks.push_back(i);
+				if ((i + 1) < size && ((c == 0x0a && code[i+1] == 0x0d) || (c == 0x0d && code[i+1] == 0x0a))) { ++i; }
 			}
 		}
 	}
+	// same as strref::count_lines(pos)
+	int count_lines(int pos) const {
+		return (int)(std::lower_bound(breaks.begin(), breaks.end(), (strl_t)pos) - breaks.begin());
+	}
+};
+
+// Line indexes for each source file referenced by a listing, all files are
+// added before sections are listed in parallel
+struct ListLineIndices {
+	std::vector<ListLineIndex> files;
+	size_t find(strref code, size_t last) const {
+		if (last < files.size() && files[last].code == code.get() && files[last].size == code.get_len()) { return last; }
+		for (last = 0; last < files.size(); ++last) {
+			if (files[last].code == code.get() && files[last].size == code.get_len()) { break; }
+		}
+		return last;
+	}
+	size_t add(strref code, size_t last) {
+		last = find(code, last);
+		if (last == files.size()) {
+			files.push_back(ListLineIndex());
+			files[last].build(code);
+		}
+		return last;
+	}
+	int count_lines(strref code, int pos, size_t &last) const {
+		last = find(code, last);
+		return last < files.size() ? files[last].count_lines(pos) : code.count_lines(pos);
+	}
+};
+
+// Disassembly tables and line indexes shared by all sections of a listing
+struct ListContext {
+	uint8_t mnemonic[256];
+	uint8_t addrmode[256];
+	ListLineIndices lines;
+};
 
+// Source position and cycle counters carried from one listed section to the next
+struct ListState {
+	strref prev_src;
+	int prev_offs;
+	int16_t cycles_depth;
 	struct cycleCnt cycles[MAX_DEPTH_CYCLE_COUNTER];
-	int16_t cycles_depth = 0;
-	memset(cycles, 0, sizeof(cycles));
+};
 
+// Append a line of source with tabs expanded in a single pass
+static void AppendListSource(strown<256> &out, strref line) {
+	char expand[128];
+	strl_t len = 0;
+	for (strl_t i = 0, n = line.get_len(); i < n && len < sizeof(expand); ++i) {
+		if (line[i] == '\t') {
+			bool odd = !!(len & 1);
+			expand[len++] = ' ';
+			if (!odd && len < sizeof(expand)) { expand[len++] = ' '; }
+		} else { expand[len++] = line[i]; }
+	}
+	out.append(strref(expand, len));
+}
 
-	// show merged sections
-	for (size_t i = 0, n = allSections.size(); i < n; ++i)
-	{
-		Section& s = allSections[i];
-		if (s.type != ST_REMOVED) {
-			if (s.include_from) {
-				fprintf(f, "Section " STRREF_FMT " from " STRREF_FMT " $%04x - $%04x ($%04x)\n",
-					STRREF_ARG(s.name), STRREF_ARG(s.include_from), s.start_address, s.address, s.address - s.start_address);
+// Format the listing of one section, sections can be listed concurrently
+void Asm::ListSection(int index, const ListContext &context, ListState &state, TextBuffer &listing) {
+	Section *si = &allSections[index];
+	strown<512> head;
+	size_t last_file = 0;
+	if (si->merged_into >= 0) {
+		head.sprintf(STRREF_FMT " from " STRREF_FMT " merged into " STRREF_FMT " at offset 0x%04x",
+		STRREF_ARG(si->name), STRREF_ARG(si->include_from), STRREF_ARG(allSections[si->merged_into].name), si->merged_at);
+		listing.line(head.get_strref());
+	}
+	if (si->type==ST_REMOVED) { return; }
+	if (si->address_assigned)
+		head.sprintf("Section " STRREF_FMT " (%d, %s): $%04x-$%04x", STRREF_ARG(si->name),
+				index, si->type>=0 && si->type<num_section_type_str ?
+				str_section_type[si->type] : "???", si->start_address, si->address);
+	else
+		head.sprintf("Section " STRREF_FMT " (%d, %s) (relocatable)", STRREF_ARG(si->name),
+			index, str_section_type[si->type]);
+	listing.line(head.get_strref());
+
+	if (!si->pListing)
+		return;
+	for (Listing::iterator li = si->pListing->begin(); li != si->pListing->end(); ++li) {
+		strown<256> out;
+		const struct ListLine &lst = *li;
+		if ((state.prev_src.get() != lst.source_name.get() && !state.prev_src.same_str_case(lst.source_name)) ||
+			state.prev_src.get_len() != lst.source_name.get_len() || lst.line_offs < state.prev_offs) {
+			head.sprintf(STRREF_FMT "(%d):", STRREF_ARG(lst.source_name), context.lines.count_lines(lst.code, lst.line_offs, last_file));
+			listing.line(head.get_strref());
+			state.prev_src = lst.source_name;
+		} else {
+			strref prvline = lst.code.get_substr(state.prev_offs, lst.line_offs - state.prev_offs);
+			prvline.next_line();
+			if (prvline.count_lines() < 5) {
+				while (strref space_line = prvline.line()) {
+					space_line.clip_trailing_whitespace();
+					out.pad_to(' ', aCPUs[cpu].timing ? 40 : 33);
+					AppendListSource(out, space_line);
+					listing.line(out.get_strref());
+					out.clear();
+				}
 			} else {
-				fprintf(f, "Section " STRREF_FMT " $%04x - $%04x ($%04x)\n",
-					STRREF_ARG(s.name), s.start_address, s.address, s.address - s.start_address);
+				head.sprintf(STRREF_FMT "(%d):", STRREF_ARG(lst.source_name), context.lines.count_lines(lst.code, lst.line_offs, last_file));
+				listing.line(head.get_strref());
 			}
-			for (size_t j = 0; j < n; ++j)
-			{
-				Section& s2 = allSections[j];
-				if (s2.type == ST_REMOVED && s2.merged_into >= 0)
-				{
-					int offset = s2.merged_at;
-					int parent = s2.merged_into;
-					while (parent != i && parent >= 0) {
-						offset += allSections[parent].merged_at;
-						parent = allSections[parent].merged_into;
-					}
-					if (parent == i) {
-						if (s2.include_from) {
-							fprintf(f, " + " STRREF_FMT " from " STRREF_FMT " $%04x - $%04x ($%04x) at offset 0x%04x\n",
-								STRREF_ARG(s2.name), STRREF_ARG(s2.include_from), s2.merged_at + s.start_address,
-								s2.merged_at + s.start_address + s2.merged_size, s2.merged_size, s2.merged_at);
-						} else {
-							fprintf(f, " + " STRREF_FMT " $%04x - $%04x ($%04x) at offset 0x%04x\n",
-								STRREF_ARG(s2.name), s2.merged_at + s.start_address,
-								s2.merged_at + s.start_address + s2.merged_size, s2.merged_size, s2.merged_at);
-						}
+		}
+
+		if (lst.size) { out.sprintf_append("$%04x ", lst.address+si->start_address); }
+
+		int s = lst.wasMnemonic() ? (lst.size < 4 ? lst.size : 4) : (lst.size < 8 ? lst.size : 8);
+		if (si->output && si->output_capacity >= size_t(lst.address + s)) {
+			for (int b = 0; b<s; ++b) {
+				out.sprintf_append("%02x ", si->output[lst.address+b]);
+			}
+		}
+		if (lst.startClock() && state.cycles_depth<MAX_DEPTH_CYCLE_COUNTER) {
+			state.cycles_depth++;	state.cycles[state.cycles_depth].clr();
+			out.pad_to(' ', 6); out.sprintf_append("c>%d", state.cycles_depth);
+		}
+		if (lst.stopClock()) {
+			out.pad_to(' ', 6);
+			if (state.cycles[state.cycles_depth].complex()) {
+				out.sprintf_append("c<%d = %d + m%d + i%d + d%d", state.cycles_depth,
+								   state.cycles[state.cycles_depth].base, state.cycles[state.cycles_depth].a16,
+								   state.cycles[state.cycles_depth].x16, state.cycles[state.cycles_depth].dp);
+			} else {
+				out.sprintf_append("c<%d = %d + %d", state.cycles_depth,
+								   state.cycles[state.cycles_depth].base, state.cycles[state.cycles_depth].plus_acc());
+			}
+			if (state.cycles_depth) {
+				state.cycles_depth--;
+				state.cycles[state.cycles_depth].combine(state.cycles[state.cycles_depth + 1]);
+			}
+		}
+		if (lst.size && lst.wasMnemonic()) {
+			out.pad_to(' ', 18);
+			uint8_t *buf = si->output + lst.address;
+			uint8_t op = context.mnemonic[*buf];
+			uint8_t am = context.addrmode[*buf];
+			if (op != 255 && am != 255 && am<(sizeof(aAddrModeFmt)/sizeof(aAddrModeFmt[0]))) {
+				const char *fmt = aAddrModeFmt[am];
+				if (opcode_table[op].modes & AMM_FLIPXY) {
+					if (am == AMB_ZP_X)	fmt = "%s $%02x,y";
+					else if (am == AMB_ABS_X) fmt = "%s $%04x,y";
+				}
+				if (opcode_table[op].modes & AMM_ZP_ABS) {
+					out.sprintf_append(fmt, opcode_table[op].instr, buf[1], (char)buf[2]+lst.address+si->start_address+3);
+				} else if (opcode_table[op].modes & AMM_BRANCH) {
+					out.sprintf_append(fmt, opcode_table[op].instr, (char)buf[1]+lst.address+si->start_address+2);
+				} else if (opcode_table[op].modes & AMM_BRANCH_L) {
+					out.sprintf_append(fmt, opcode_table[op].instr, (int16_t)(buf[1]|(buf[2]<<8))+lst.address+si->start_address+3);
+				} else if (am==AMB_NON||am==AMB_ACC) {
+					out.sprintf_append(fmt, opcode_table[op].instr);
+				} else if (am==AMB_ABS||am==AMB_ABS_X||am==AMB_ABS_Y||am==AMB_REL||am==AMB_REL_X||am==AMB_REL_L) {
+					out.sprintf_append(fmt, opcode_table[op].instr, buf[1]|(buf[2]<<8));
+				} else if (am==AMB_ABS_L||am==AMB_ABS_L_X) {
+					out.sprintf_append(fmt, opcode_table[op].instr, buf[1]|(buf[2]<<8)|(buf[3]<<16));
+				} else if (am==AMB_BLK_MOV) {
+					out.sprintf_append(fmt, opcode_table[op].instr, buf[1], buf[2]);
+				} else if (am==AMB_IMM && lst.size==3) {
+					out.sprintf_append("%s #$%04x", opcode_table[op].instr, buf[1]|(buf[2]<<8));
+				} else {
+					out.sprintf_append(fmt, opcode_table[op].instr, buf[1]);
+				}
+				if (aCPUs[cpu].timing) {
+					state.cycles[state.cycles_depth].add(aCPUs[cpu].timing[*buf]);
+					out.pad_to(' ', 33);
+					if (cycleCnt::sum_plus(aCPUs[cpu].timing[*buf])==1) {
+						out.sprintf_append("%d+", cycleCnt::get_base(aCPUs[cpu].timing[*buf]));
+					} else if (cycleCnt::sum_plus(aCPUs[cpu].timing[*buf])) {
+						out.sprintf_append("%d+%d", cycleCnt::get_base(aCPUs[cpu].timing[*buf]), cycleCnt::sum_plus(aCPUs[cpu].timing[*buf]));
+					} else {
+						out.sprintf_append("%d", cycleCnt::get_base(aCPUs[cpu].timing[*buf]));
 					}
 				}
 			}
 		}
+
+		out.pad_to(' ', aCPUs[cpu].timing ? 40 : 33);
+		strref line = lst.code.get_skipped(lst.line_offs).get_line();
+		line.clip_trailing_whitespace();
+		AppendListSource(out, line);
+		listing.line(out.get_strref());
+		state.prev_offs = lst.line_offs;
 	}
+}
 
-	strref prev_src;
-	int prev_offs = 0;
-	for (std::vector<Section>::iterator si = allSections.begin(); si != allSections.end(); ++si) {
-		if (si->merged_into >= 0) {
-			fprintf(f, STRREF_FMT " from " STRREF_FMT " merged into " STRREF_FMT " at offset 0x%04x\n",
-			STRREF_ARG(si->name), STRREF_ARG(si->include_from), STRREF_ARG(allSections[si->merged_into].name), si->merged_at); }
-		if (si->type==ST_REMOVED) { continue; }
-		if (si->address_assigned)
-			fprintf(f, "Section " STRREF_FMT " (%d, %s): $%04x-$%04x\n", STRREF_ARG(si->name),
-					(int)(&*si - &allSections[0]), si->type>=0 && si->type<num_section_type_str ?
-					str_section_type[si->type] : "???", si->start_address, si->address);
-		else
-			fprintf(f, "Section " STRREF_FMT " (%d, %s) (relocatable)\n", STRREF_ARG(si->name),
-				(int)(&*si - &allSections[0]), str_section_type[si->type]);
+// Lists sections in parallel into separate buffers
+struct ListSectionJob {
+	Asm *assembler;
+	const ListContext *context;
+	ListState *states;
+	std::vector<TextBuffer> buffers;
+	void Run(int index) { assembler->ListSection(index, *context, states[index], buffers[index]); }
+};
 
-		if (!si->pListing)
-			continue;
-		for (Listing::iterator li = si->pListing->begin(); li != si->pListing->end(); ++li) {
-			strown<256> out;
-			const struct ListLine &lst = *li;
-			if (prev_src.fnv1a() != lst.source_name.fnv1a() || lst.line_offs < prev_offs) {
-				fprintf(f, STRREF_FMT "(%d):\n", STRREF_ARG(lst.source_name), lst.code.count_lines(lst.line_offs));
-				prev_src = lst.source_name;
+bool Asm::List(strref filename, int num_threads) {
+	FILE *f = stdout;
+	bool opened = false;
+	if (filename) {
+		f = fopen(strown<512>(filename).c_str(), "w");
+		if (!f) { return false; }
+		opened = true;
+	}
+
+	// ensure that the greatest instruction set referenced is used for listing
+	if (list_cpu!=cpu) { SetCPU(list_cpu); }
+
+	// Build a disassembly lookup table
+	ListContext context;
+	uint8_t *mnemonic = context.mnemonic;
+	uint8_t *addrmode = context.addrmode;
+	memset(mnemonic, 255, sizeof(context.mnemonic));
+	memset(addrmode, 255, sizeof(context.addrmode));
+	for (int i = 0; i < opcode_count; i++) {
+		for (int j = AMB_COUNT-1; j >= 0; j--) {
+			if (opcode_table[i].modes & (1 << j)) {
+				uint8_t op = opcode_table[i].aCodes[j];
+				if (addrmode[op]==255) {
+					mnemonic[op] = (uint8_t)i;
+					addrmode[op] = (uint8_t)j;
+				}
+			}
+		}
+	}
+
+	TextBuffer listing(f);
+	strown<512> head;
+
+	// sections merged into each section, the merge chains are walked once
+	size_t n = allSections.size();
+	std::vector< std::vector<int> > merged(n);
+	for (size_t j = 0; j < n; ++j) {
+		if (allSections[j].type == ST_REMOVED && allSections[j].merged_into >= 0) {
+			for (int parent = allSections[j].merged_into; parent >= 0; parent = allSections[parent].merged_into) {
+				if (allSections[parent].type != ST_REMOVED) { merged[parent].push_back((int)j); }
+			}
+		}
+	}
+
+	// show merged sections
+	for (size_t i = 0; i < n; ++i)
+	{
+		Section& s = allSections[i];
+		if (s.type != ST_REMOVED) {
+			if (s.include_from) {
+				head.sprintf("Section " STRREF_FMT " from " STRREF_FMT " $%04x - $%04x ($%04x)",
+					STRREF_ARG(s.name), STRREF_ARG(s.include_from), s.start_address, s.address, s.address - s.start_address);
 			} else {
-				strref prvline = lst.code.get_substr(prev_offs, lst.line_offs - prev_offs);
-				prvline.next_line();
-				if (prvline.count_lines() < 5) {
-					while (strref space_line = prvline.line()) {
-						space_line.clip_trailing_whitespace();
-						strown<128> line_fix(space_line);
-						for (strl_t pos = 0; pos < line_fix.len(); ++pos) {
-							if (line_fix[pos]=='\t') {
-								line_fix.exchange(pos, 1, pos&1 ? strref(" ") : strref("  "));
-							}
-						}
-						out.pad_to(' ', aCPUs[cpu].timing ? 40 : 33);
-						out.append(line_fix.get_strref());
-						fprintf(f, STRREF_FMT "\n", STRREF_ARG(out));
-						out.clear();
-					}
+				head.sprintf("Section " STRREF_FMT " $%04x - $%04x ($%04x)",
+					STRREF_ARG(s.name), s.start_address, s.address, s.address - s.start_address);
+			}
+			listing.line(head.get_strref());
+			for (std::vector<int>::iterator j = merged[i].begin(); j != merged[i].end(); ++j)
+			{
+				Section& s2 = allSections[*j];
+				if (s2.include_from) {
+					head.sprintf(" + " STRREF_FMT " from " STRREF_FMT " $%04x - $%04x ($%04x) at offset 0x%04x",
+						STRREF_ARG(s2.name), STRREF_ARG(s2.include_from), s2.merged_at + s.start_address,
+						s2.merged_at + s.start_address + s2.merged_size, s2.merged_size, s2.merged_at);
 				} else {
-					fprintf(f, STRREF_FMT "(%d):\n", STRREF_ARG(lst.source_name), lst.code.count_lines(lst.line_offs));
+					head.sprintf(" + " STRREF_FMT " $%04x - $%04x ($%04x) at offset 0x%04x",
+						STRREF_ARG(s2.name), s2.merged_at + s.start_address,
+						s2.merged_at + s.start_address + s2.merged_size, s2.merged_size, s2.merged_at);
 				}
+				listing.line(head.get_strref());
 			}
+		}
+	}
 
-			if (lst.size) { out.sprintf_append("$%04x ", lst.address+si->start_address); }
+	// the state at the start of each section is found in order, then the sections are listed in parallel
+	ListState state;
+	state.prev_offs = 0;
+	state.cycles_depth = 0;
+	memset(state.cycles, 0, sizeof(state.cycles));
+	std::vector<ListState> states(n);
+	size_t last_file = 0;
+	for (size_t i = 0; i < n; ++i) {
+		states[i] = state;
+		Section &s = allSections[i];
+		if (s.type == ST_REMOVED || !s.pListing) { continue; }
+		for (Listing::iterator li = s.pListing->begin(); li != s.pListing->end(); ++li) {
+			const struct ListLine &lst = *li;
+			last_file = context.lines.add(lst.code, last_file);
+			if ((state.prev_src.get() != lst.source_name.get() && !state.prev_src.same_str_case(lst.source_name)) ||
+				state.prev_src.get_len() != lst.source_name.get_len() || lst.line_offs < state.prev_offs) {
+				state.prev_src = lst.source_name;
+			}
+			if (lst.startClock() && state.cycles_depth<MAX_DEPTH_CYCLE_COUNTER) {
+				state.cycles_depth++; state.cycles[state.cycles_depth].clr();
+			}
+			if (lst.stopClock() && state.cycles_depth) {
+				state.cycles_depth--;
+				state.cycles[state.cycles_depth].combine(state.cycles[state.cycles_depth + 1]);
+			}
+			if (lst.size && lst.wasMnemonic() && aCPUs[cpu].timing) {
+				uint8_t *buf = s.output + lst.address;
+				uint8_t am = context.addrmode[*buf];
+				if (context.mnemonic[*buf] != 255 && am != 255 && am<(sizeof(aAddrModeFmt)/sizeof(aAddrModeFmt[0])))
+					state.cycles[state.cycles_depth].add(aCPUs[cpu].timing[*buf]);
+			}
+			state.prev_offs = lst.line_offs;
+		}
+	}
 
-			int s = lst.wasMnemonic() ? (lst.size < 4 ? lst.size : 4) : (lst.size < 8 ? lst.size : 8);
-			if (si->output && si->output_capacity >= size_t(lst.address + s)) {
-				for (int b = 0; b<s; ++b) {
-					out.sprintf_append("%02x ", si->output[lst.address+b]);
-				}
+	ListSectionJob job = { this, &context, &states[0], std::vector<TextBuffer>(n) };
+	ParallelFor(job, (int)n, num_threads);
+	for (size_t i = 0; i < n; ++i)
+		listing.write(job.buffers[i]);
+	listing.flush();
+	if (opened) { fclose(f); }
+	return true;
+}
+
+// Append a string to a JSON line with quotes and escapes
+static void AppendJSONString(strown<1024> &out, strref str) {
+	out.append('"');
+	for (strl_t i = 0, n = str.get_len(); i < n; ++i) {
+		char c = str[i];
+		if (c == '"' || c == '\\') {
+			out.append('\\');
+			out.append(c);
+		} else if ((uint8_t)c < ' ') {
+			out.sprintf_append("\\u%04x", (uint8_t)c);
+		} else { out.append(c); }
+	}
+	out.append('"');
+}
+
+// Source file and line number of an offset into source text, text expanded
+// from a macro is mapped back into the file that defined the macro.
+struct DebugLineResolver {
+	const std::vector<MacroSite> &sites;
+	ListLineIndices lines;
+	size_t last;
+	DebugLineResolver(const std::vector<MacroSite> &macro_sites) : sites(macro_sites), last(0) {}
+	int line(strref code, int offs) {
+		last = lines.add(code, last);
+		return lines.files[last].count_lines(offs) + 1;
+	}
+	int resolve(strref code, strref name, int offs, int macro_site, strref &file) {
+		if (macro_site >= 0 && sites[macro_site].expansion && code.get() == sites[macro_site].expansion.get()) {
+			const MacroSite &site = sites[macro_site];
+			file = site.source_name;
+			return line(site.source_file, site.source_offs) + line(code, offs) - 1;
+		}
+		file = name;
+		return line(code, offs);
+	}
+};
+
+// Id of a source file in debug info, the file record is written the first time a file is referenced
+static int DebugFileId(TextBuffer &output, pairArray<uint32_t, int> &files, std::vector<strref> &names, strref file) {
+	uint32_t hash = file.hash();
+	uint32_t index = FindLabelIndex(hash, files.getKeys(), files.count());
+	for (uint32_t i = index; i < files.count() && files.getKey(i) == hash; ++i) {
+		if (names[files.getValue(i)].same_str_case(file)) { return files.getValue(i); }
+	}
+	int id = (int)names.size();
+	names.push_back(file);
+	files.insert(index, hash);
+	files.getValue(index) = id;
+	strown<1024> out;
+	out.sprintf("{\"type\":\"file\",\"id\":%d,\"name\":", id);
+	AppendJSONString(out, file);
+	out.append('}');
+	output.line(out.get_strref());
+	return id;
+}
+
+// Write debug info as JSON lines in a single pass: sections, source files and macro expansion
+// sites are written before the first record that refers to them, followed by one record per
+// listed line with address, size, source line and cycles and one record per symbol.
+bool Asm::WriteDebugInfo(strref filename) {
+	FILE *f = fopen(strown<512>(filename).c_str(), "w");
+	if (!f) { return false; }
+	TextBuffer output(f);
+	strown<1024> out;
+	DebugLineResolver resolver(macroSites);
+	pairArray<uint32_t, int> files;			// hash of file name to file id
+	std::vector<strref> fileNames;
+	std::vector<int> siteIds(macroSites.size(), -1);
+	int numSites = 0;
+	const uint8_t *timing = aCPUs[list_cpu].timing;
+
+	out.sprintf("{\"type\":\"x65\",\"version\":1,\"cpu\":\"%s\"}", aCPUs[list_cpu].name);
+	output.line(out.get_strref());
+
+	for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+		Section &s = allSections[i];
+		out.sprintf("{\"type\":\"section\",\"id\":%d,\"name\":", (int)i);
+		AppendJSONString(out, s.name);
+		out.sprintf_append(",\"kind\":\"%s\",\"start\":%d,\"end\":%d,\"fixed\":%s", s.type>=0 && s.type<num_section_type_str ?
+			str_section_type[s.type] : "???", s.start_address, s.address, s.address_assigned ? "true" : "false");
+		if (s.merged_into >= 0) { out.sprintf_append(",\"merged_into\":%d,\"merged_at\":%d", s.merged_into, s.merged_at); }
+		out.append('}');
+		output.line(out.get_strref());
+	}
+
+	std::vector<int> sitePath;
+	for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+		Section &s = allSections[i];
+		if (s.type == ST_REMOVED || !s.pListing || s.IsDummySection()) { continue; }
+		for (Listing::iterator li = s.pListing->begin(); li != s.pListing->end(); ++li) {
+			const struct ListLine &lst = *li;
+			// only lines that generated code or data, org lines have a negative address or move the address past the section end
+			if (!lst.size || lst.address < 0 || (lst.address + lst.size) > (s.address - s.start_address)) { continue; }
+
+			// macro expansions that this line is within are written outermost first
+			sitePath.clear();
+			for (int m = lst.macro_site; m >= 0 && siteIds[m] < 0; m = macroSites[m].parent)
+				sitePath.push_back(m);
+			for (std::vector<int>::reverse_iterator m = sitePath.rbegin(); m != sitePath.rend(); ++m) {
+				const MacroSite &site = macroSites[*m];
+				strref file;
+				int line = resolver.resolve(site.site_file, site.site_name, site.site_offs, site.parent, file);
+				int file_id = DebugFileId(output, files, fileNames, file);
+				siteIds[*m] = numSites++;
+				out.sprintf("{\"type\":\"macro\",\"id\":%d,\"name\":", siteIds[*m]);
+				AppendJSONString(out, site.macro);
+				out.sprintf_append(",\"file\":%d,\"line\":%d", file_id, line);
+				if (site.parent >= 0) { out.sprintf_append(",\"parent\":%d", siteIds[site.parent]); }
+				out.append('}');
+				output.line(out.get_strref());
 			}
-			if (lst.startClock() && cycles_depth<MAX_DEPTH_CYCLE_COUNTER) {
-				cycles_depth++;	cycles[cycles_depth].clr();
-				out.pad_to(' ', 6); out.sprintf_append("c>%d", cycles_depth);
+
+			strref file;
+			int line = resolver.resolve(lst.code, lst.source_name, lst.line_offs, lst.macro_site, file);
+			int file_id = DebugFileId(output, files, fileNames, file);
+			out.sprintf("{\"type\":\"line\",\"addr\":%d,\"size\":%d,\"section\":%d,\"file\":%d,\"line\":%d",
+				lst.address + s.start_address, lst.size, (int)i, file_id, line);
+			if (lst.macro_site >= 0) { out.sprintf_append(",\"macro\":%d", siteIds[lst.macro_site]); }
+			if (lst.wasMnemonic() && timing && s.output && s.output_capacity > size_t(lst.address)) {
+				uint8_t t = timing[s.output[lst.address]];
+				if (t != 0xff) {
+					out.sprintf_append(",\"cycles\":%d,\"extra\":%d", cycleCnt::get_base(t), cycleCnt::sum_plus(t));
+				}
+			} else if (!lst.wasMnemonic()) {
+				out.append(",\"data\":true");
 			}
-			if (lst.stopClock()) {
-				out.pad_to(' ', 6);
-				if (cycles[cycles_depth].complex()) {
-					out.sprintf_append("c<%d = %d + m%d + i%d + d%d", cycles_depth,
-									   cycles[cycles_depth].base, cycles[cycles_depth].a16,
-									   cycles[cycles_depth].x16, cycles[cycles_depth].dp);
-				} else {
-					out.sprintf_append("c<%d = %d + %d", cycles_depth,
-									   cycles[cycles_depth].base, cycles[cycles_depth].plus_acc());
+			out.append('}');
+			output.line(out.get_strref());
+		}
+	}
+
+	// symbols, locals are in the scope of the previous global symbol
+	strref scope;
+	for (MapSymbolArray::iterator i = map.begin(); i != map.end(); ++i) {
+		int value = i->value;
+		if (size_t(i->section) < allSections.size()) { value += allSections[i->section].start_address; }
+		out.copy("{\"type\":\"symbol\",\"name\":");
+		AppendJSONString(out, i->name);
+		out.sprintf_append(",\"value\":%d,\"section\":%d", value, (int)i->section);
+		if (i->local) {
+			out.append(",\"scope\":");
+			AppendJSONString(out, scope);
+		} else { scope = i->name; }
+		out.append('}');
+		output.line(out.get_strref());
+	}
+	output.flush();
+	fclose(f);
+	files.clear();
+	return true;
+}
+
+// 65C02 cycles for the simulator in the same layout as timing_6502,
+// the listing does not show 65C02 cycles so this is not in aCPUs
+static const uint8_t timing_65C02_sim[] = {
+	0x0e, 0x0c, 0xff, 0xff, 0x0a, 0x06, 0x0a, 0xff, 0x06, 0x04, 0x04, 0xff, 0x0c, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0x0a, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x04, 0xff, 0x0c, 0x09, 0x0d, 0x0b,
+	0x0c, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x0a, 0xff, 0x08, 0x04, 0x04, 0xff, 0x08, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0x08, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x04, 0xff, 0x09, 0x09, 0x0d, 0x0b,
+	0x0c, 0x0c, 0xff, 0xff, 0xff, 0x06, 0x0a, 0xff, 0x06, 0x04, 0x04, 0xff, 0x06, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x06, 0xff, 0xff, 0x09, 0x0d, 0x0b,
+	0x0c, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x0a, 0xff, 0x08, 0x04, 0x04, 0xff, 0x0c, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0x08, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x08, 0xff, 0x0c, 0x09, 0x0d, 0x0b,
+	0x07, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x06, 0xff, 0x04, 0x04, 0x04, 0xff, 0x08, 0x08, 0x08, 0x0b,
+	0x05, 0x0c, 0x0a, 0xff, 0x08, 0x08, 0x08, 0xff, 0x04, 0x0a, 0x04, 0xff, 0x08, 0x0a, 0x0a, 0x0b,
+	0x04, 0x0c, 0x04, 0xff, 0x06, 0x06, 0x06, 0xff, 0x04, 0x04, 0x04, 0xff, 0x08, 0x08, 0x08, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0x08, 0x08, 0x08, 0xff, 0x04, 0x09, 0x04, 0xff, 0x09, 0x09, 0x09, 0x0b,
+	0x04, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x0a, 0xff, 0x04, 0x04, 0x04, 0x06, 0x08, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x06, 0x06, 0xff, 0x09, 0x0e, 0x0b,
+	0x04, 0x0c, 0xff, 0xff, 0x06, 0x06, 0x0a, 0xff, 0x04, 0x04, 0x04, 0xff, 0x08, 0x08, 0x0c, 0x0b,
+	0x05, 0x0b, 0x0a, 0xff, 0xff, 0x08, 0x0c, 0xff, 0x04, 0x09, 0x08, 0xff, 0xff, 0x09, 0x0e, 0x0b
+};
+
+// Instructions known by the simulator, undocumented 6502 instructions stop the simulation
+enum SimOp : uint8_t {
+	SIM_UNKNOWN, SIM_ADC, SIM_AND, SIM_ASL, SIM_BCC, SIM_BCS, SIM_BEQ, SIM_BIT, SIM_BMI, SIM_BNE,
+	SIM_BPL, SIM_BRA, SIM_BRK, SIM_BRL, SIM_BVC, SIM_BVS, SIM_CLC, SIM_CLD, SIM_CLI, SIM_CLV,
+	SIM_CMP, SIM_COP, SIM_CPX, SIM_CPY, SIM_DEC, SIM_DEX, SIM_DEY, SIM_EOR, SIM_INC, SIM_INX,
+	SIM_INY, SIM_JML, SIM_JMP, SIM_JSL, SIM_JSR, SIM_LDA, SIM_LDX, SIM_LDY, SIM_LSR, SIM_MVN,
+	SIM_MVP, SIM_NOP, SIM_ORA, SIM_PEA, SIM_PEI, SIM_PER, SIM_PHA, SIM_PHB, SIM_PHD, SIM_PHK,
+	SIM_PHP, SIM_PHX, SIM_PHY, SIM_PLA, SIM_PLB, SIM_PLD, SIM_PLP, SIM_PLX, SIM_PLY, SIM_REP,
+	SIM_ROL, SIM_ROR, SIM_RTI, SIM_RTL, SIM_RTS, SIM_SBC, SIM_SEC, SIM_SED, SIM_SEI, SIM_SEP,
+	SIM_STA, SIM_STP, SIM_STX, SIM_STY, SIM_STZ, SIM_TAX, SIM_TAY, SIM_TCD, SIM_TCS, SIM_TDC,
+	SIM_TRB, SIM_TSB, SIM_TSC, SIM_TSX, SIM_TXA, SIM_TXS, SIM_TXY, SIM_TYA, SIM_TYX, SIM_WAI,
+	SIM_WDM, SIM_XBA, SIM_XCE, SIM_BBR, SIM_BBS, SIM_RMB, SIM_SMB
+};
+
+static const struct { const char *name; SimOp op; } aSimOps[] = {
+	{ "adc", SIM_ADC }, { "and", SIM_AND }, { "asl", SIM_ASL }, { "bcc", SIM_BCC }, { "bcs", SIM_BCS },
+	{ "beq", SIM_BEQ }, { "bit", SIM_BIT }, { "bmi", SIM_BMI }, { "bne", SIM_BNE }, { "bpl", SIM_BPL },
+	{ "bra", SIM_BRA }, { "brk", SIM_BRK }, { "brl", SIM_BRL }, { "bvc", SIM_BVC }, { "bvs", SIM_BVS },
+	{ "clc", SIM_CLC }, { "cld", SIM_CLD }, { "cli", SIM_CLI }, { "clv", SIM_CLV }, { "cmp", SIM_CMP },
+	{ "cop", SIM_COP }, { "cpx", SIM_CPX }, { "cpy", SIM_CPY }, { "dec", SIM_DEC }, { "dea", SIM_DEC },
+	{ "dex", SIM_DEX }, { "dey", SIM_DEY }, { "eor", SIM_EOR }, { "inc", SIM_INC }, { "ina", SIM_INC },
+	{ "inx", SIM_INX }, { "iny", SIM_INY }, { "jml", SIM_JML }, { "jmp", SIM_JMP }, { "jsl", SIM_JSL },
+	{ "jsr", SIM_JSR }, { "lda", SIM_LDA }, { "ldx", SIM_LDX }, { "ldy", SIM_LDY }, { "lsr", SIM_LSR },
+	{ "mvn", SIM_MVN }, { "mvp", SIM_MVP }, { "nop", SIM_NOP }, { "ora", SIM_ORA }, { "pea", SIM_PEA },
+	{ "pei", SIM_PEI }, { "per", SIM_PER }, { "pha", SIM_PHA }, { "phb", SIM_PHB }, { "phd", SIM_PHD },
+	{ "phk", SIM_PHK }, { "php", SIM_PHP }, { "phx", SIM_PHX }, { "phy", SIM_PHY }, { "pla", SIM_PLA },
+	{ "plb", SIM_PLB }, { "pld", SIM_PLD }, { "plp", SIM_PLP }, { "plx", SIM_PLX }, { "ply", SIM_PLY },
+	{ "rep", SIM_REP }, { "rol", SIM_ROL }, { "ror", SIM_ROR }, { "rti", SIM_RTI }, { "rtl", SIM_RTL },
+	{ "rts", SIM_RTS }, { "sbc", SIM_SBC }, { "sec", SIM_SEC }, { "sed", SIM_SED }, { "sei", SIM_SEI },
+	{ "sep", SIM_SEP }, { "sta", SIM_STA }, { "stp", SIM_STP }, { "stx", SIM_STX }, { "sty", SIM_STY },
+	{ "stz", SIM_STZ }, { "tax", SIM_TAX }, { "tay", SIM_TAY }, { "tcd", SIM_TCD }, { "tcs", SIM_TCS },
+	{ "tdc", SIM_TDC }, { "trb", SIM_TRB }, { "tsb", SIM_TSB }, { "tsc", SIM_TSC }, { "tsx", SIM_TSX },
+	{ "txa", SIM_TXA }, { "txs", SIM_TXS }, { "txy", SIM_TXY }, { "tya", SIM_TYA }, { "tyx", SIM_TYX },
+	{ "wai", SIM_WAI }, { "wdm", SIM_WDM }, { "xba", SIM_XBA }, { "xce", SIM_XCE }
+};
+
+// Why the simulation ended
+enum SimStop {
+	SIM_RUNNING,
+	SIM_RETURN,				// returned from the entry routine
+	SIM_STOP_ADDRESS,		// reached the stop address
+	SIM_BREAK,				// brk, cop, wdm, stp or wai
+	SIM_CYCLE_LIMIT,		// ran for the maximum number of cycles
+	SIM_UNKNOWN_OPCODE,		// opcode not in the instruction set of the cpu
+};
+
+static const char *aSimStopStr[] = {
+	"running", "return from entry", "stop address", "break", "cycle limit", "unknown opcode"
+};
+
+// Executions and cycles of the instruction at an address
+struct SimCount {
+	uint64_t cycles;		// all cycles spent on the instruction
+	uint64_t extra;			// cycles from page crossing and taken branches
+	uint32_t count;			// number of times executed
+};
+
+// Opcode to instruction, address mode and timing for a cpu, shared by the
+// simulator and the cycle analysis
+struct SimDecoder {
+	enum { DEC_FLIPXY = 0x01, DEC_BRANCH = 0x02, DEC_BRANCH_L = 0x04, DEC_IMM_A = 0x08, DEC_IMM_XY = 0x10 };
+	struct Decode { SimOp op; uint8_t mode, flags, timing; };
+
+	Decode decode[256];
+	bool wdc65816, cmos;
+
+	SimDecoder(CPUIndex cpu);
+	int Length(const Decode &dec, bool mw, bool xw) const;
+	int Cycles(const Decode &dec, bool mw, bool xw, int &dp_extra) const;
+	static bool IndexedRead(SimOp op);
+};
+
+// Instruction set simulator for the 6502, 65C02 and 65816 that counts cycles by address.
+// The 6502 and 65C02 run as a 65816 that can't leave emulation mode.
+struct Simulator : public SimDecoder {
+	enum { C = 0x01, Z = 0x02, I = 0x04, D = 0x08, X = 0x10, M = 0x20, V = 0x40, N = 0x80 };
+
+	std::vector<uint8_t> mem;
+	std::vector< std::vector<SimCount> > profile;	// 64K counters per bank, allocated when used
+	uint32_t mem_mask;
+	uint32_t pc;			// program counter, bits 16-23 are the program bank
+	uint32_t last;			// address of the most recent instruction
+	uint16_t a, x, y, s, d;
+	uint8_t p, dbr;
+	bool e;					// 65816 emulation mode, always set for 6502 and 65C02
+	uint16_t s_entry;		// stack pointer at entry, returning from here ends the simulation
+	uint64_t cycles, instructions;
+
+	Simulator(CPUIndex cpu);
+	uint8_t rd(uint32_t addr) const { return mem[addr & mem_mask]; }
+	void wr(uint32_t addr, uint8_t v) { mem[addr & mem_mask] = v; }
+	uint32_t rd16(uint32_t addr) const { return rd(addr) | (rd(addr + 1) << 8); }
+	uint32_t rdw(uint32_t addr, bool wide) const { return wide ? rd16(addr) : rd(addr); }
+	void wrw(uint32_t addr, uint32_t v, bool wide) { wr(addr, (uint8_t)v); if (wide) { wr(addr + 1, (uint8_t)(v >> 8)); } }
+	bool m8() const { return e || (p & M); }
+	bool x8() const { return e || (p & X); }
+	void push(uint8_t v) { wr(s, v); s = e ? (0x100 | ((s - 1) & 0xff)) : (uint16_t)(s - 1); }
+	uint8_t pull() { s = e ? (0x100 | ((s + 1) & 0xff)) : (uint16_t)(s + 1); return rd(s); }
+	void push16(uint32_t v) { push((uint8_t)(v >> 8)); push((uint8_t)v); }
+	uint16_t pull16() { uint16_t l = pull(); return l | (pull() << 8); }
+	void nz(uint32_t v, bool wide) {
+		p = (p & ~(N | Z)) | ((wide ? (v & 0xffff) : (v & 0xff)) ? 0 : Z) | ((wide ? (v >> 8) : v) & N);
+	}
+	void set_p(uint8_t v) {
+		p = e ? (v | X | M) : v;
+		if (p & X) { x &= 0xff; y &= 0xff; }
+	}
+	uint32_t direct(uint32_t offs) const {
+		return (e && !(d & 0xff)) ? ((d & 0xff00) | (offs & 0xff)) : ((d + offs) & 0xffff);
+	}
+	uint32_t add(uint32_t acc, uint32_t v, bool wide);
+	uint32_t sub(uint32_t acc, uint32_t v, bool wide);
+	void compare(uint32_t reg, uint32_t v, bool wide) {
+		uint32_t mask = wide ? 0xffff : 0xff;
+		p = (p & ~C) | ((reg & mask) >= (v & mask) ? C : 0);
+		nz(reg - v, wide);
+	}
+	uint32_t shift(SimOp op, uint32_t v, bool wide);
+	void Reset(uint32_t entry);
+	SimStop Step();
+	SimStop Run(uint32_t stop, uint64_t max_cycles);
+};
+
+SimDecoder::SimDecoder(CPUIndex cpu) : wdc65816(cpu == CPU_65816),
+	cmos(cpu == CPU_65C02 || cpu == CPU_65C02_WDC || cpu == CPU_65816) {
+	const mnem *opcodes = aCPUs[cpu].opcodes;
+	int count = aCPUs[cpu].num_opcodes;
+	const uint8_t *timing = (cmos && !wdc65816) ? timing_65C02_sim : aCPUs[cpu].timing;
+
+	// same opcode to instruction mapping as the listing
+	for (int o = 0; o < 256; ++o) {
+		decode[o].op = SIM_UNKNOWN;
+		decode[o].mode = 255;
+		decode[o].flags = 0;
+		decode[o].timing = timing[o];
+	}
+	for (int i = 0; i < count; ++i) {
+		strref name(opcodes[i].instr);
+		SimOp op = SIM_UNKNOWN;
+		if (name.get_len() == 4 && (name.has_prefix("bbr") || name.has_prefix("bbs") || name.has_prefix("rmb") || name.has_prefix("smb")))
+			op = name[0] == 'r' ? SIM_RMB : (name[0] == 's' ? SIM_SMB : (name[2] == 'r' ? SIM_BBR : SIM_BBS));
+		for (size_t n = 0; op == SIM_UNKNOWN && n < sizeof(aSimOps) / sizeof(aSimOps[0]); ++n) {
+			if (name.same_str(aSimOps[n].name)) { op = aSimOps[n].op; }
+		}
+		uint32_t modes = opcodes[i].modes;
+		for (int j = AMB_COUNT - 1; j >= 0; j--) {
+			if (modes & (1 << j)) {
+				uint8_t o = opcodes[i].aCodes[j];
+				if (decode[o].mode == 255) {
+					decode[o].op = op;
+					decode[o].mode = (uint8_t)j;
+					decode[o].flags = ((modes & AMM_FLIPXY) ? DEC_FLIPXY : 0) | ((modes & AMM_BRANCH) ? DEC_BRANCH : 0) |
+						((modes & AMM_BRANCH_L) ? DEC_BRANCH_L : 0) | ((modes & AMM_IMM_DBL_A) ? DEC_IMM_A : 0) |
+						((modes & AMM_IMM_DBL_XY) ? DEC_IMM_XY : 0);
 				}
-				if (cycles_depth) {
-					cycles_depth--;
-					cycles[cycles_depth].combine(cycles[cycles_depth + 1]);
+			}
+		}
+	}
+}
+
+// Number of bytes of an instruction with the given accumulator and index register sizes
+int SimDecoder::Length(const Decode &dec, bool mw, bool xw) const {
+	switch (dec.mode) {
+		case AMB_NON: case AMB_ACC: return 1;
+		case AMB_IMM: return (((dec.flags & DEC_IMM_A) && mw) || ((dec.flags & DEC_IMM_XY) && xw)) ? 3 : 2;
+		case AMB_ABS: return (dec.flags & DEC_BRANCH) ? 2 : 3;
+		case AMB_ABS_Y: case AMB_ABS_X: case AMB_REL: case AMB_REL_X: case AMB_ZP_ABS:
+		case AMB_REL_L: case AMB_BLK_MOV: return 3;
+		case AMB_ABS_L: case AMB_ABS_L_X: return 4;
+	}
+	return 2;
+}
+
+// Cycles before page crossing and branch penalties, the 65816 cycle for a direct
+// page that is not page aligned is returned separately
+int SimDecoder::Cycles(const Decode &dec, bool mw, bool xw, int &dp_extra) const {
+	int base = (dec.timing >> 1) & 7;
+	dp_extra = 0;
+	if (wdc65816) {
+		int i = dec.timing >> 4;
+		if (!base) { base = 8; --i; }	// eight cycles carry into the extra cycles index
+		if (i >= 1 && i <= 8) {
+			base += (mw ? timing_65816_plus[i][0] : 0) + (xw ? timing_65816_plus[i][1] : 0);
+			dp_extra = timing_65816_plus[i][2];
+		}
+	}
+	return base;
+}
+
+// Instructions that take a cycle more for indexing across a page on the 65816,
+// the 6502 and 65C02 timing tables mark these instructions
+bool SimDecoder::IndexedRead(SimOp op) {
+	switch (op) {
+		case SIM_ADC: case SIM_AND: case SIM_BIT: case SIM_CMP: case SIM_EOR:
+		case SIM_LDA: case SIM_LDX: case SIM_LDY: case SIM_ORA: case SIM_SBC: return true;
+		default: return false;
+	}
+}
+
+Simulator::Simulator(CPUIndex cpu) : SimDecoder(cpu), mem(cpu == CPU_65816 ? 0x1000000 : 0x10000, 0),
+	profile(cpu == CPU_65816 ? 256 : 1), mem_mask(cpu == CPU_65816 ? 0xffffff : 0xffff), cycles(0), instructions(0) {
+}
+
+// Reset state as after a jsr to the entry address
+void Simulator::Reset(uint32_t entry) {
+	pc = last = entry & mem_mask;
+	a = x = y = d = 0;
+	dbr = 0;
+	s = 0x1ff;
+	e = true;
+	p = I | X | M;
+	s_entry = s;
+}
+
+uint32_t Simulator::add(uint32_t acc, uint32_t v, bool wide) {
+	uint32_t mask = wide ? 0xffff : 0xff, sign = wide ? 0x8000 : 0x80;
+	uint32_t r = acc + v + (p & C);
+	p &= ~(V | C);
+	if (p & D) {
+		uint32_t carry = r - acc - v;
+		r = 0;
+		for (int b = 0; b < (wide ? 16 : 8); b += 4) {
+			uint32_t digit = ((acc >> b) & 15) + ((v >> b) & 15) + carry;
+			if (digit > 9) { digit += 6; }
+			carry = digit > 15 ? 1 : 0;
+			r |= (digit & 15) << b;
+		}
+		if (carry) { r |= mask + 1; }
+	}
+	if (~(acc ^ v) & (acc ^ r) & sign) { p |= V; }
+	if (r > mask) { p |= C; }
+	r &= mask;
+	nz(r, wide);
+	return r;
+}
+
+uint32_t Simulator::sub(uint32_t acc, uint32_t v, bool wide) {
+	uint32_t mask = wide ? 0xffff : 0xff;
+	if (!(p & D)) { return add(acc, ~v & mask, wide); }
+	uint32_t sign = wide ? 0x8000 : 0x80;
+	uint32_t bin = acc - v - ((p & C) ? 0 : 1);
+	int borrow = (p & C) ? 0 : 1;
+	uint32_t r = 0;
+	for (int b = 0; b < (wide ? 16 : 8); b += 4) {
+		int digit = (int)((acc >> b) & 15) - (int)((v >> b) & 15) - borrow;
+		borrow = digit < 0 ? 1 : 0;
+		if (borrow) { digit += 10; }
+		r |= (uint32_t)(digit & 15) << b;
+	}
+	p &= ~(V | C);
+	if ((acc ^ v) & (acc ^ bin) & sign) { p |= V; }
+	if (!borrow) { p |= C; }
+	nz(r, wide);
+	return r;
+}
+
+uint32_t Simulator::shift(SimOp op, uint32_t v, bool wide) {
+	uint32_t top = wide ? 0x8000 : 0x80, mask = wide ? 0xffff : 0xff;
+	uint32_t carry = p & C;
+	switch (op) {
+		case SIM_ASL: p = (p & ~C) | ((v & top) ? C : 0); v = (v << 1) & mask; break;
+		case SIM_ROL: p = (p & ~C) | ((v & top) ? C : 0); v = ((v << 1) | carry) & mask; break;
+		case SIM_LSR: p = (p & ~C) | (v & 1); v = v >> 1; break;
+		case SIM_ROR: p = (p & ~C) | (v & 1); v = (v >> 1) | (carry ? top : 0); break;
+		case SIM_INC: v = (v + 1) & mask; break;
+		case SIM_DEC: v = (v - 1) & mask; break;
+		default: break;
+	}
+	nz(v, wide);
+	return v;
+}
+
+// Execute one instruction and count its cycles
+SimStop Simulator::Step() {
+	const Decode &dec = decode[rd(pc)];
+	if (dec.op == SIM_UNKNOWN || dec.timing == 0xff) { return SIM_UNKNOWN_OPCODE; }
+	uint32_t pbr = pc & 0xff0000;
+	uint32_t at = pc;
+	bool mw = !m8(), xw = !x8();
+
+	// instruction length and cycles before penalties
+	int len = Length(dec, mw, xw);
+	uint32_t arg = len > 1 ? rd(pbr | ((pc + 1) & 0xffff)) : 0;
+	if (len > 2) { arg |= rd(pbr | ((pc + 2) & 0xffff)) << 8; }
+	if (len > 3) { arg |= rd(pbr | ((pc + 3) & 0xffff)) << 16; }
+	uint32_t next = pbr | ((pc + len) & 0xffff);
+	int dp_extra, extra = 0;
+	int base = Cycles(dec, mw, xw, dp_extra) + ((d & 0xff) ? dp_extra : 0);
+
+	// effective address
+	uint32_t ea = 0, ptr, data = dbr << 16;
+	bool crossed = false, indexed = false;
+	uint16_t ix = (dec.flags & DEC_FLIPXY) ? y : x;
+	switch (dec.mode) {
+		case AMB_ZP_REL_X: ptr = direct(arg + x); ea = data | rd(ptr) | (rd(direct(arg + x + 1)) << 8); break;
+		case AMB_ZP: ea = direct(arg); break;
+		case AMB_IMM: ea = pbr | ((at + 1) & 0xffff); break;
+		case AMB_ABS: ea = data | arg; break;
+		case AMB_ZP_Y_REL:
+			ptr = data | rd(direct(arg)) | (rd(direct(arg + 1)) << 8);
+			ea = (ptr + y) & mem_mask;
+			crossed = ((ptr ^ ea) & 0xff00) != 0;
+			indexed = true;
+			break;
+		case AMB_ZP_X: ea = direct(arg + ix); break;
+		case AMB_ABS_Y: case AMB_ABS_X:
+			ptr = data | arg;
+			ea = (ptr + ((dec.mode == AMB_ABS_Y || (dec.flags & DEC_FLIPXY)) ? y : x)) & mem_mask;
+			crossed = ((ptr ^ ea) & 0xff00) != 0;
+			indexed = true;
+			break;
+		case AMB_ZP_REL: ea = data | rd(direct(arg)) | (rd(direct(arg + 1)) << 8); break;
+		case AMB_ZP_REL_L: ptr = direct(arg); ea = rd(ptr) | (rd(ptr + 1) << 8) | (rd(ptr + 2) << 16); break;
+		case AMB_ZP_REL_Y_L:
+			ptr = direct(arg);
+			ea = ((rd(ptr) | (rd(ptr + 1) << 8) | (rd(ptr + 2) << 16)) + y) & mem_mask;
+			break;
+		case AMB_ABS_L: ea = arg; break;
+		case AMB_ABS_L_X: ea = (arg + x) & mem_mask; break;
+		case AMB_STK: ea = (arg + s) & 0xffff; break;
+		case AMB_STK_REL_Y: ea = ((data | rd16((arg + s) & 0xffff)) + y) & mem_mask; break;
+		default: break;
+	}
+
+	// taken branches are one cycle more and one more if the target is in another page,
+	// the 65816 only adds the page cycle in emulation mode
+	bool branch = false;
+	switch (dec.op) {
+		case SIM_BPL: branch = !(p & N); break;
+		case SIM_BMI: branch = !!(p & N); break;
+		case SIM_BVC: branch = !(p & V); break;
+		case SIM_BVS: branch = !!(p & V); break;
+		case SIM_BCC: branch = !(p & C); break;
+		case SIM_BCS: branch = !!(p & C); break;
+		case SIM_BNE: branch = !(p & Z); break;
+		case SIM_BEQ: branch = !!(p & Z); break;
+		case SIM_BRA: branch = true; --extra; break;	// base cycles include the taken branch
+		case SIM_BBR: branch = !(rd(direct(arg & 0xff)) & (1 << ((rd(at) >> 4) & 7))); break;
+		case SIM_BBS: branch = !!(rd(direct(arg & 0xff)) & (1 << ((rd(at) >> 4) & 7))); break;
+		default: break;
+	}
+	if (branch) {
+		uint32_t target = pbr | ((next + (int8_t)(dec.op == SIM_BBR || dec.op == SIM_BBS ? (arg >> 8) : arg)) & 0xffff);
+		extra++;
+		if ((!wdc65816 || e) && ((target ^ next) & 0xff00)) { extra++; }
+		next = target;
+	}
+
+	// page crossing of indexed reads, on the 65816 also with 16 bit index registers
+	if (indexed) {
+		if (!wdc65816) {
+			if ((dec.timing & 1) && crossed) { extra++; }
+		} else if ((crossed || xw) && IndexedRead(dec.op)) { extra++; }
+	}
+
+	SimStop stop = SIM_RUNNING;
+	uint32_t v;
+	switch (dec.op) {
+		case SIM_ADC: case SIM_SBC:
+			v = rdw(ea, mw);
+			v = dec.op == SIM_ADC ? add(a & (mw ? 0xffff : 0xff), v, mw) : sub(a & (mw ? 0xffff : 0xff), v, mw);
+			a = mw ? (uint16_t)v : ((a & 0xff00) | v);
+			if (cmos && !wdc65816 && (p & D)) { base++; }
+			break;
+		case SIM_AND: v = a & rdw(ea, mw); if (!mw) { v |= a & 0xff00; } a = (uint16_t)v; nz(a, mw); break;
+		case SIM_ORA: v = rdw(ea, mw); a |= v; nz(a, mw); break;
+		case SIM_EOR: v = rdw(ea, mw); a ^= v; nz(a, mw); break;
+		case SIM_ASL: case SIM_ROL: case SIM_LSR: case SIM_ROR: case SIM_INC: case SIM_DEC:
+			if (dec.mode == AMB_ACC || dec.mode == AMB_NON) {
+				v = shift(dec.op, a & (mw ? 0xffff : 0xff), mw);
+				a = mw ? (uint16_t)v : ((a & 0xff00) | v);
+			} else { wrw(ea, shift(dec.op, rdw(ea, mw), mw), mw); }
+			break;
+		case SIM_BIT:
+			v = rdw(ea, mw);
+			p = (p & ~Z) | ((a & v & (mw ? 0xffff : 0xff)) ? 0 : Z);
+			if (dec.mode != AMB_IMM) { p = (p & ~(N | V)) | ((mw ? (v >> 8) : v) & (N | V)); }
+			break;
+		case SIM_CMP: compare(a, rdw(ea, mw), mw); break;
+		case SIM_CPX: compare(x, rdw(ea, xw), xw); break;
+		case SIM_CPY: compare(y, rdw(ea, xw), xw); break;
+		case SIM_DEX: x = (uint16_t)shift(SIM_DEC, x, xw); break;
+		case SIM_DEY: y = (uint16_t)shift(SIM_DEC, y, xw); break;
+		case SIM_INX: x = (uint16_t)shift(SIM_INC, x, xw); break;
+		case SIM_INY: y = (uint16_t)shift(SIM_INC, y, xw); break;
+		case SIM_LDA: v = rdw(ea, mw); a = mw ? (uint16_t)v : ((a & 0xff00) | v); nz(v, mw); break;
+		case SIM_LDX: x = (uint16_t)rdw(ea, xw); nz(x, xw); break;
+		case SIM_LDY: y = (uint16_t)rdw(ea, xw); nz(y, xw); break;
+		case SIM_STA: wrw(ea, a, mw); break;
+		case SIM_STX: wrw(ea, x, xw); break;
+		case SIM_STY: wrw(ea, y, xw); break;
+		case SIM_STZ: wrw(ea, 0, mw); break;
+		case SIM_TRB: case SIM_TSB:
+			v = rdw(ea, mw);
+			p = (p & ~Z) | ((a & v & (mw ? 0xffff : 0xff)) ? 0 : Z);
+			wrw(ea, dec.op == SIM_TSB ? (v | a) : (v & ~a), mw);
+			break;
+		case SIM_RMB: wr(ea, rd(ea) & ~(1 << ((rd(at) >> 4) & 7))); break;
+		case SIM_SMB: wr(ea, rd(ea) | (1 << ((rd(at) >> 4) & 7))); break;
+		case SIM_CLC: p &= ~C; break;
+		case SIM_CLD: p &= ~D; break;
+		case SIM_CLI: p &= ~I; break;
+		case SIM_CLV: p &= ~V; break;
+		case SIM_SEC: p |= C; break;
+		case SIM_SED: p |= D; break;
+		case SIM_SEI: p |= I; break;
+		case SIM_REP: set_p(p & ~arg); break;
+		case SIM_SEP: set_p(p | arg); break;
+		case SIM_XCE: {
+			bool carry = !!(p & C);
+			p = (p & ~C) | (e ? C : 0);
+			e = carry;
+			if (e) { s = 0x100 | (s & 0xff); }
+			set_p(p);
+			break;
+		}
+		case SIM_TAX: x = xw ? a : (a & 0xff); nz(x, xw); break;
+		case SIM_TAY: y = xw ? a : (a & 0xff); nz(y, xw); break;
+		case SIM_TXA: a = mw ? x : ((a & 0xff00) | (x & 0xff)); nz(a, mw); break;
+		case SIM_TYA: a = mw ? y : ((a & 0xff00) | (y & 0xff)); nz(a, mw); break;
+		case SIM_TXY: y = x; nz(y, xw); break;
+		case SIM_TYX: x = y; nz(x, xw); break;
+		case SIM_TSX: x = xw ? s : (s & 0xff); nz(x, xw); break;
+		case SIM_TXS: s = e ? (0x100 | (x & 0xff)) : x; break;
+		case SIM_TCD: d = a; nz(d, true); break;
+		case SIM_TDC: a = d; nz(a, true); break;
+		case SIM_TCS: s = e ? (0x100 | (a & 0xff)) : a; break;
+		case SIM_TSC: a = s; nz(a, true); break;
+		case SIM_XBA: a = (uint16_t)((a >> 8) | (a << 8)); nz(a, false); break;
+		case SIM_PHA: if (mw) { push16(a); } else { push((uint8_t)a); } break;
+		case SIM_PHX: if (xw) { push16(x); } else { push((uint8_t)x); } break;
+		case SIM_PHY: if (xw) { push16(y); } else { push((uint8_t)y); } break;
+		case SIM_PLA: v = mw ? pull16() : pull(); a = mw ? (uint16_t)v : ((a & 0xff00) | v); nz(v, mw); break;
+		case SIM_PLX: x = xw ? pull16() : pull(); nz(x, xw); break;
+		case SIM_PLY: y = xw ? pull16() : pull(); nz(y, xw); break;
+		case SIM_PHB: push(dbr); break;
+		case SIM_PLB: dbr = pull(); nz(dbr, false); break;
+		case SIM_PHD: push16(d); break;
+		case SIM_PLD: d = pull16(); nz(d, true); break;
+		case SIM_PHK: push((uint8_t)(pbr >> 16)); break;
+		case SIM_PHP: push(e ? (p | X | M) : p); break;
+		case SIM_PLP: set_p(pull()); break;
+		case SIM_PEA: push16(arg); break;
+		case SIM_PEI: push16(rd16(direct(arg))); break;
+		case SIM_PER: push16(next + arg); break;
+		case SIM_BRL: next = pbr | ((next + arg) & 0xffff); break;
+		case SIM_JMP: case SIM_JML: case SIM_JSR: case SIM_JSL: {
+			uint32_t target = pbr | arg;
+			if (dec.mode == AMB_REL) {
+				// the 6502 reads the high byte of the pointer from the same page
+				target = pbr | rd(arg) | (rd((!cmos && (arg & 0xff) == 0xff) ? (arg & 0xff00) : (arg + 1)) << 8);
+			} else if (dec.mode == AMB_REL_X) {
+				target = pbr | rd16(pbr | ((arg + x) & 0xffff));
+			} else if (dec.mode == AMB_REL_L) {
+				target = rd16(arg) | (rd(arg + 2) << 16);
+			} else if (dec.mode == AMB_ABS_L) { target = arg; }
+			if (dec.op == SIM_JSL || (dec.op == SIM_JSR && dec.mode == AMB_ABS_L)) {
+				push((uint8_t)(pbr >> 16));
+				push16(next - 1);
+			} else if (dec.op == SIM_JSR) { push16(next - 1); }
+			next = target & mem_mask;
+			break;
+		}
+		case SIM_RTS: case SIM_RTL: case SIM_RTI:
+			if (s == s_entry) { stop = SIM_RETURN; }
+			if (dec.op == SIM_RTI) {
+				set_p(pull());
+				next = pull16();
+				next |= e ? pbr : (pull() << 16);
+			} else {
+				next = (pull16() + 1) & 0xffff;
+				next |= dec.op == SIM_RTL ? (pull() << 16) : pbr;
+			}
+			break;
+		case SIM_MVN: case SIM_MVP: {
+			// move the whole block as one instruction, seven cycles per byte
+			uint32_t dst = (arg & 0xff) << 16, src = (arg & 0xff00) << 8;
+			int step = dec.op == SIM_MVN ? 1 : -1;
+			base = 0;
+			do {
+				wr(dst | y, rd(src | x));
+				x = (uint16_t)(x + step);
+				y = (uint16_t)(y + step);
+				if (!xw) { x &= 0xff; y &= 0xff; }
+				base += 7;
+			} while (a-- != 0);
+			dbr = (uint8_t)(dst >> 16);
+			break;
+		}
+		case SIM_BRK: case SIM_COP: case SIM_WDM: case SIM_STP: case SIM_WAI:
+			stop = SIM_BREAK;
+			break;
+		default: break;
+	}
+
+	std::vector<SimCount> &bank = profile[at >> 16];
+	if (bank.empty()) {
+		SimCount zero = { 0, 0, 0 };
+		bank.resize(0x10000, zero);
+	}
+	SimCount &count = bank[at & 0xffff];
+	count.count++;
+	count.cycles += base + extra;
+	count.extra += extra;
+	cycles += base + extra;
+	instructions++;
+	last = at;
+	pc = next;
+	return stop;
+}
+
+// Run until returning from the entry, reaching the stop address or a break
+SimStop Simulator::Run(uint32_t stop, uint64_t max_cycles) {
+	for (;;) {
+		if (pc == stop) { return SIM_STOP_ADDRESS; }
+		SimStop reason = Step();
+		if (reason != SIM_RUNNING) { return reason; }
+		if (cycles >= max_cycles) { return SIM_CYCLE_LIMIT; }
+	}
+}
+
+// Address from a label, a $hex or a decimal number
+bool Asm::SimAddress(strref name, uint32_t &address) {
+	name.trim_whitespace();
+	if (name.get_first() == '$' && name.get_len() > 1) {
+		address = (uint32_t)(name + 1).ahextoui();
+		return true;
+	} else if (name.is_number()) {
+		address = (uint32_t)name.atoi();
+		return true;
+	}
+	Label *label = GetLabel(name);
+	if (!label || !label->evaluated) { return false; }
+	address = (uint32_t)label->value;
+	if (label->section >= 0) {
+		if (!allSections[label->section].address_assigned) { return false; }
+		address += allSections[label->section].start_address;
+	}
+	return true;
+}
+
+// Run the code at entry in a cycle counting simulator of the listing cpu with all sections with
+// fixed addresses loaded, and write the executions and cycles of each instruction with its source line.
+bool Asm::Simulate(strref entry, strref stop, uint64_t max_cycles, strref profile_file) {
+	uint32_t entry_addr, stop_addr = 0xffffffff;
+	if (!SimAddress(entry, entry_addr)) {
+		printf("ERROR: SIMULATION ENTRY \"" STRREF_FMT "\" HAS NO ADDRESS\n", STRREF_ARG(entry));
+		return false;
+	}
+	if (stop && !SimAddress(stop, stop_addr)) {
+		printf("ERROR: SIMULATION STOP \"" STRREF_FMT "\" HAS NO ADDRESS\n", STRREF_ARG(stop));
+		return false;
+	}
+	Simulator sim(list_cpu);
+	for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+		Section &s = allSections[i];
+		if (s.type == ST_REMOVED || !s.address_assigned || s.IsDummySection() || !s.output) { continue; }
+		size_t size = s.address > s.start_address ? size_t(s.address - s.start_address) : 0;
+		if (size > s.output_capacity) { size = s.output_capacity; }
+		for (size_t b = 0; b < size; ++b)
+			sim.wr((uint32_t)(s.start_address + b), s.output[b]);
+	}
+
+	sim.Reset(entry_addr);
+	SimStop reason = sim.Run(stop_addr, max_cycles);
+	uint32_t stop_at = (reason == SIM_RETURN || reason == SIM_BREAK) ? sim.last : sim.pc;
+	printf("Simulated %" PRIu64 " instructions in %" PRIu64 " cycles from $%04x, %s at $%04x\n",
+		sim.instructions, sim.cycles, entry_addr, aSimStopStr[reason], stop_at);
+	if (reason == SIM_UNKNOWN_OPCODE) {
+		printf("ERROR: UNKNOWN OPCODE $%02x AT $%04x IN SIMULATION\n", sim.rd(sim.pc), sim.pc);
+	}
+
+	if (profile_file) {
+		FILE *f = fopen(strown<512>(profile_file).c_str(), "w");
+		if (!f) { return false; }
+		TextBuffer output(f);
+		strown<256> out;
+		DebugLineResolver resolver(macroSites);
+		double total = sim.cycles ? (double)sim.cycles : 1.0;
+		out.sprintf("; %s profile from $%04x: %" PRIu64 " instructions, %" PRIu64 " cycles, %s at $%04x",
+			aCPUs[list_cpu].name, entry_addr, sim.instructions, sim.cycles, aSimStopStr[reason], stop_at);
+		output.line(out.get_strref());
+		output.line("; address     count      cycles  extra      %  source");
+		for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+			Section &s = allSections[i];
+			if (s.type == ST_REMOVED || !s.pListing || !s.address_assigned || s.IsDummySection()) { continue; }
+			for (Listing::iterator li = s.pListing->begin(); li != s.pListing->end(); ++li) {
+				const struct ListLine &lst = *li;
+				if (!lst.wasMnemonic() || !lst.size) { continue; }
+				uint32_t addr = (uint32_t)(lst.address + s.start_address) & sim.mem_mask;
+				std::vector<SimCount> &bank = sim.profile[addr >> 16];
+				if (bank.empty() || !bank[addr & 0xffff].count) { continue; }
+				SimCount &c = bank[addr & 0xffff];
+				strref file;
+				int line = resolver.resolve(lst.code, lst.source_name, lst.line_offs, lst.macro_site, file);
+				strref source = lst.code.get_skipped(lst.line_offs).get_line();
+				source.trim_whitespace();
+				out.sprintf("$%04x %11u %11" PRIu64 " %6" PRIu64 " %5.1f%%  " STRREF_FMT "(%d): ", addr, c.count, c.cycles,
+					c.extra, 100.0 * (double)c.cycles / total, STRREF_ARG(file), line);
+				AppendListSource(out, source);
+				output.line(out.get_strref());
+				c.count = 0;	// listed, anything left was not assembled from source
+			}
+		}
+		for (size_t b = 0; b < sim.profile.size(); ++b) {
+			for (size_t o = 0; o < sim.profile[b].size(); ++o) {
+				const SimCount &c = sim.profile[b][o];
+				if (c.count) {
+					out.sprintf("$%04x %11u %11" PRIu64 " %6" PRIu64 " %5.1f%%  (no source)", (uint32_t)((b << 16) | o),
+						c.count, c.cycles, c.extra, 100.0 * (double)c.cycles / total);
+					output.line(out.get_strref());
 				}
 			}
-			if (lst.size && lst.wasMnemonic()) {
-				out.pad_to(' ', 18);
-				uint8_t *buf = si->output + lst.address;
-				uint8_t op = mnemonic[*buf];
-				uint8_t am = addrmode[*buf];
-				if (op != 255 && am != 255 && am<(sizeof(aAddrModeFmt)/sizeof(aAddrModeFmt[0]))) {
-					const char *fmt = aAddrModeFmt[am];
-					if (opcode_table[op].modes & AMM_FLIPXY) {
-						if (am == AMB_ZP_X)	fmt = "%s $%02x,y";
-						else if (am == AMB_ABS_X) fmt = "%s $%04x,y";
-					}
-					if (opcode_table[op].modes & AMM_ZP_ABS) {
-						out.sprintf_append(fmt, opcode_table[op].instr, buf[1], (char)buf[2]+lst.address+si->start_address+3);
-					} else if (opcode_table[op].modes & AMM_BRANCH) {
-						out.sprintf_append(fmt, opcode_table[op].instr, (char)buf[1]+lst.address+si->start_address+2);
-					} else if (opcode_table[op].modes & AMM_BRANCH_L) {
-						out.sprintf_append(fmt, opcode_table[op].instr, (int16_t)(buf[1]|(buf[2]<<8))+lst.address+si->start_address+3);
-					} else if (am==AMB_NON||am==AMB_ACC) {
-						out.sprintf_append(fmt, opcode_table[op].instr);
-					} else if (am==AMB_ABS||am==AMB_ABS_X||am==AMB_ABS_Y||am==AMB_REL||am==AMB_REL_X||am==AMB_REL_L) {
-						out.sprintf_append(fmt, opcode_table[op].instr, buf[1]|(buf[2]<<8));
-					} else if (am==AMB_ABS_L||am==AMB_ABS_L_X) {
-						out.sprintf_append(fmt, opcode_table[op].instr, buf[1]|(buf[2]<<8)|(buf[3]<<16));
-					} else if (am==AMB_BLK_MOV) {
-						out.sprintf_append(fmt, opcode_table[op].instr, buf[1], buf[2]);
-					} else if (am==AMB_IMM && lst.size==3) {
-						out.sprintf_append("%s #$%04x", opcode_table[op].instr, buf[1]|(buf[2]<<8));
-					} else {
-						out.sprintf_append(fmt, opcode_table[op].instr, buf[1]);
-					}
-					if (aCPUs[cpu].timing) {
-						cycles[cycles_depth].add(aCPUs[cpu].timing[*buf]);
-						out.pad_to(' ', 33);
-						if (cycleCnt::sum_plus(aCPUs[cpu].timing[*buf])==1) {
-							out.sprintf_append("%d+", cycleCnt::get_base(aCPUs[cpu].timing[*buf]));
-						} else if (cycleCnt::sum_plus(aCPUs[cpu].timing[*buf])) {
-							out.sprintf_append("%d+%d", cycleCnt::get_base(aCPUs[cpu].timing[*buf]), cycleCnt::sum_plus(aCPUs[cpu].timing[*buf]));
-						} else {
-							out.sprintf_append("%d", cycleCnt::get_base(aCPUs[cpu].timing[*buf]));
-						}
-					}
+		}
+		output.flush();
+		fclose(f);
+	}
+	return reason != SIM_UNKNOWN_OPCODE;
+}
+
+// Instruction in a cycle counted region for the static cycle analysis
+struct CycleNode {
+	uint32_t address;
+	const ListLine *line;
+	int cost_min, cost_max;			// cycles of the instruction without branch penalties
+	int next[2];					// successor instruction or -1 to leave the region, -2 for none
+	int extra_min[2], extra_max[2];	// branch penalties for each successor
+};
+
+// Analysis notes that refer to an instruction
+struct CycleNote {
+	const ListLine *line;
+	uint32_t address;
+	const char *text;
+};
+
+// Build the control flow graph of the instructions in one cycle counted region at their linked
+// addresses and find the fewest and most cycles from the first instruction to leaving the region.
+// Branch penalties are exact for the 6502 and 65C02, page crossing of indexed reads is only
+// known to be possible. Loops can't be bounded so the most cycles count each loop once.
+static bool AnalyzeCycleRegion(const SimDecoder &decoder, const Section &s, const std::vector<const ListLine*> &lines,
+	std::vector<CycleNote> &notes, int &best, int &worst, bool &loops) {
+	std::vector<CycleNode> nodes;
+	nodes.reserve(lines.size());
+	for (size_t l = 0; l < lines.size(); ++l) {
+		const ListLine &lst = *lines[l];
+		if (!lst.wasMnemonic() || !lst.size || !s.output || s.output_capacity < size_t(lst.address + lst.size)) { continue; }
+		CycleNode node;
+		node.address = (uint32_t)(lst.address + s.start_address);
+		node.line = &lst;
+		nodes.push_back(node);
+	}
+	if (nodes.empty()) { return false; }
+	std::vector< std::pair<uint32_t, int> > addresses(nodes.size());
+	for (size_t n = 0; n < nodes.size(); ++n)
+		addresses[n] = std::make_pair(nodes[n].address, (int)n);
+	std::sort(addresses.begin(), addresses.end());
+
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		CycleNode &node = nodes[n];
+		const ListLine &lst = *node.line;
+		const uint8_t *code = s.output + lst.address;
+		const SimDecoder::Decode &dec = decoder.decode[code[0]];
+		node.next[0] = node.next[1] = -2;
+		node.extra_min[0] = node.extra_min[1] = node.extra_max[0] = node.extra_max[1] = 0;
+		if (dec.op == SIM_UNKNOWN || dec.timing == 0xff) {
+			CycleNote note = { &lst, node.address, "unknown opcode, leaves the region" };
+			notes.push_back(note);
+			node.cost_min = node.cost_max = 0;
+			node.next[0] = -1;
+			continue;
+		}
+		uint32_t arg = 0;
+		for (int b = lst.size - 1; b > 0; --b)
+			arg = (arg << 8) | code[b];
+		int dp_extra;
+		node.cost_min = decoder.Cycles(dec, lst.acc16(), lst.idx16(), dp_extra);
+		node.cost_max = node.cost_min + dp_extra;	// direct page alignment is not known
+
+		// indexed reads that may cross a page
+		bool indexed = dec.mode == AMB_ABS_X || dec.mode == AMB_ABS_Y || dec.mode == AMB_ZP_Y_REL;
+		if (indexed && (decoder.wdc65816 ? SimDecoder::IndexedRead(dec.op) : (dec.timing & 1))) {
+			if (decoder.wdc65816 && lst.idx16()) {
+				node.cost_min++;
+				node.cost_max++;
+			} else if (dec.mode == AMB_ZP_Y_REL || (arg & 0xff)) {
+				node.cost_max++;
+				CycleNote note = { &lst, node.address, "indexed read may cross a page" };
+				notes.push_back(note);
+			}
+		}
+		if (decoder.cmos && !decoder.wdc65816 && (dec.op == SIM_ADC || dec.op == SIM_SBC)) { node.cost_max++; }	// decimal mode
+
+		uint32_t bank = node.address & 0xff0000;
+		uint32_t fall = bank | ((node.address + lst.size) & 0xffff);
+		uint32_t target = 0;
+		bool branch = false, jump = false, fallthrough = true, cond = false;
+		switch (dec.op) {
+			case SIM_BPL: case SIM_BMI: case SIM_BVC: case SIM_BVS: case SIM_BCC: case SIM_BCS: case SIM_BNE: case SIM_BEQ:
+				target = bank | ((fall + (int8_t)arg) & 0xffff);
+				branch = cond = true;
+				break;
+			case SIM_BBR: case SIM_BBS:
+				target = bank | ((fall + (int8_t)(arg >> 8)) & 0xffff);
+				branch = cond = true;
+				break;
+			case SIM_BRA:
+				target = bank | ((fall + (int8_t)arg) & 0xffff);
+				branch = true;
+				fallthrough = false;
+				break;
+			case SIM_BRL:
+				target = bank | ((fall + arg) & 0xffff);
+				jump = true;
+				fallthrough = false;
+				break;
+			case SIM_JMP: case SIM_JML:
+				fallthrough = false;
+				if (dec.mode == AMB_ABS || dec.mode == AMB_ABS_L) {
+					target = dec.mode == AMB_ABS ? (bank | arg) : arg;
+					jump = true;
+				} else {
+					CycleNote note = { &lst, node.address, "indirect jump leaves the region" };
+					notes.push_back(note);
+					node.next[0] = -1;
 				}
+				break;
+			case SIM_JSR: case SIM_JSL: {
+				CycleNote note = { &lst, node.address, "cycles of the called code are not included" };
+				notes.push_back(note);
+				break;
+			}
+			case SIM_MVN: case SIM_MVP: {
+				CycleNote note = { &lst, node.address, "block move counted for one byte" };
+				notes.push_back(note);
+				node.cost_min = node.cost_max = 7;
+				break;
 			}
+			case SIM_RTS: case SIM_RTL: case SIM_RTI: case SIM_BRK: case SIM_COP: case SIM_WDM: case SIM_STP: case SIM_WAI:
+				fallthrough = false;
+				node.next[0] = -1;
+				break;
+			default:
+				break;
+		}
+		int slot = 0;
+		if (fallthrough) {
+			std::vector< std::pair<uint32_t, int> >::iterator f = std::lower_bound(addresses.begin(), addresses.end(), std::make_pair(fall, 0));
+			node.next[slot++] = (f != addresses.end() && f->first == fall) ? f->second : -1;
+		}
+		if (branch || jump) {
+			std::vector< std::pair<uint32_t, int> >::iterator f = std::lower_bound(addresses.begin(), addresses.end(), std::make_pair(target, 0));
+			node.next[slot] = (f != addresses.end() && f->first == target) ? f->second : -1;
+			if (branch) {
+				// the base cycles of bra include the taken branch, the 65816 only pays for the page in emulation mode
+				int taken = cond ? 1 : 0;
+				bool page = ((target ^ fall) & 0xff00) != 0;
+				node.extra_min[slot] = taken + ((page && !decoder.wdc65816) ? 1 : 0);
+				node.extra_max[slot] = taken + (page ? 1 : 0);
+			}
+		}
+	}
 
-			out.pad_to(' ', aCPUs[cpu].timing ? 40 : 33);
-			strref line = lst.code.get_skipped(lst.line_offs).get_line();
-			line.clip_trailing_whitespace();
-			strown<128> line_fix(line);
-			for (strl_t pos = 0; pos < line_fix.len(); ++pos) {
-				if (line_fix[pos] == '\t')
-					line_fix.exchange(pos, 1, pos & 1 ? strref(" ") : strref("  "));
+	// fewest cycles, shortest path with non negative costs
+	const int unreached = 0x7fffffff;
+	std::vector<int> dist(nodes.size(), unreached);
+	std::vector< std::pair<int, int> > heap;	// negated distance, node
+	dist[0] = 0;
+	heap.push_back(std::make_pair(0, 0));
+	best = unreached;
+	while (heap.size()) {
+		std::pop_heap(heap.begin(), heap.end());
+		int d = -heap.back().first, n = heap.back().second;
+		heap.pop_back();
+		if (d > dist[n]) { continue; }
+		const CycleNode &node = nodes[n];
+		for (int e = 0; e < 2; ++e) {
+			if (node.next[e] == -2) { continue; }
+			int c = d + node.cost_min + node.extra_min[e];
+			if (node.next[e] < 0) { best = c < best ? c : best; }
+			else if (c < dist[node.next[e]]) {
+				dist[node.next[e]] = c;
+				heap.push_back(std::make_pair(-c, node.next[e]));
+				std::push_heap(heap.begin(), heap.end());
 			}
-			out.append(line_fix.get_strref());
+		}
+	}
 
-			fprintf(f, STRREF_FMT "\n", STRREF_ARG(out));
-			prev_offs = lst.line_offs;
+	// most cycles, order the instructions depth first and ignore edges back into the current path
+	std::vector<int> order, stack;
+	std::vector<uint8_t> state(nodes.size(), 0);	// 0 = not visited, 1 = on path, 2 = done
+	std::vector<uint8_t> back(nodes.size(), 0);		// bit per successor that loops back
+	loops = false;
+	stack.push_back(0);
+	state[0] = 1;
+	std::vector<int> edge(nodes.size(), 0);
+	while (stack.size()) {
+		int n = stack.back();
+		if (edge[n] < 2) {
+			int e = edge[n]++;
+			int next = nodes[n].next[e];
+			if (next < 0) { continue; }
+			if (state[next] == 1) {
+				back[n] |= 1 << e;
+				if (!loops) {
+					CycleNote note = { nodes[next].line, nodes[next].address, "loop, counted once for the most cycles" };
+					notes.push_back(note);
+				}
+				loops = true;
+			} else if (!state[next]) {
+				state[next] = 1;
+				stack.push_back(next);
+			}
+		} else {
+			state[n] = 2;
+			order.push_back(n);
+			stack.pop_back();
+		}
+	}
+	std::vector<int> most(nodes.size(), -1);
+	most[0] = 0;
+	worst = -1;
+	for (std::vector<int>::reverse_iterator o = order.rbegin(); o != order.rend(); ++o) {
+		const CycleNode &node = nodes[*o];
+		if (most[*o] < 0) { continue; }
+		for (int e = 0; e < 2; ++e) {
+			if (node.next[e] == -2 || (back[*o] & (1 << e))) { continue; }
+			int c = most[*o] + node.cost_max + node.extra_max[e];
+			if (node.next[e] < 0) { worst = c > worst ? c : worst; }
+			else if (c > most[node.next[e]]) { most[node.next[e]] = c; }
+		}
+	}
+	if (best == unreached) { best = -1; }
+	return true;
+}
+
+// Report the fewest and most cycles through each cycle counted region ('{' - '}' scopes
+// and Merlin CYC) from the instructions at their linked addresses.
+bool Asm::CycleReport(strref filename) {
+	FILE *f = stdout;
+	bool opened = false;
+	if (filename) {
+		f = fopen(strown<512>(filename).c_str(), "w");
+		if (!f) { return false; }
+		opened = true;
+	}
+	TextBuffer output(f);
+	strown<256> out;
+	DebugLineResolver resolver(macroSites);
+	SimDecoder decoder(list_cpu);
+	std::vector<const ListLine*> starts;
+	std::vector<const ListLine*> lines;
+	std::vector<CycleNote> notes;
+	for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+		Section &s = allSections[i];
+		if (s.type == ST_REMOVED || !s.pListing || !s.address_assigned || s.IsDummySection()) { continue; }
+		starts.clear();
+		for (size_t l = 0, nl = s.pListing->size(); l <= nl; ++l) {
+			const ListLine *lst = l < nl ? &(*s.pListing)[l] : nullptr;
+			// regions still open at the end of the section end with it
+			while (starts.size() && (!lst || lst->stopClock())) {
+				const ListLine *start = starts.back();
+				starts.pop_back();
+				lines.clear();
+				for (const ListLine *r = start; r != (lst ? lst : &(*s.pListing)[0] + nl); ++r)
+					lines.push_back(r);
+				notes.clear();
+				int best, worst;
+				bool loops;
+				if (AnalyzeCycleRegion(decoder, s, lines, notes, best, worst, loops)) {
+					strref file;
+					int line = resolver.resolve(start->code, start->source_name, start->line_offs, start->macro_site, file);
+					out.sprintf(STRREF_FMT "(%d): $%04x-$%04x", STRREF_ARG(file), line, start->address + s.start_address,
+						(lst ? lst->address : (s.address - s.start_address)) + s.start_address);
+					if (best >= 0) { out.sprintf_append(" best %d", best); }
+					else { out.append(" never leaves"); }
+					if (worst >= 0) { out.sprintf_append(" worst %d%s", worst, loops ? " (loops once)" : ""); }
+					output.line(out.get_strref());
+					for (std::vector<CycleNote>::iterator note = notes.begin(); note != notes.end(); ++note) {
+						line = resolver.resolve(note->line->code, note->line->source_name, note->line->line_offs, note->line->macro_site, file);
+						strref source = note->line->code.get_skipped(note->line->line_offs).get_line();
+						source.trim_whitespace();
+						out.sprintf("  $%04x %s: " STRREF_FMT "(%d): ", note->address, note->text, STRREF_ARG(file), line);
+						AppendListSource(out, source);
+						output.line(out.get_strref());
+					}
+				}
+				if (lst) { break; }
+			}
+			if (lst && lst->startClock()) { starts.push_back(lst); }
 		}
 	}
+	output.flush();
 	if (opened) { fclose(f); }
 	return true;
 }
 
+// Report taken branches that cross into another page and labeled data that straddles
+// a page from lines assembled within PAGECHECK, at the linked addresses.
+int Asm::PageCheck(bool as_error) {
+	int found = 0;
+	strown<512> out;
+	DebugLineResolver resolver(macroSites);
+	SimDecoder decoder(list_cpu);
+	for (size_t i = 0, n = allSections.size(); i < n; ++i) {
+		Section &s = allSections[i];
+		if (s.type == ST_REMOVED || !s.pListing || !s.address_assigned || s.IsDummySection() || !s.output) { continue; }
+		for (size_t l = 0, nl = s.pListing->size(); l < nl; ++l) {
+			const ListLine &lst = (*s.pListing)[l];
+			if (!lst.pageCheck() || !lst.size || s.output_capacity < size_t(lst.address + lst.size)) { continue; }
+			uint32_t address = uint32_t(lst.address + s.start_address);
+			uint32_t end = address + lst.size;
+			const ListLine *last = &lst;
+			if (lst.wasMnemonic()) {
+				const uint8_t *code = s.output + lst.address;
+				const SimDecoder::Decode &dec = decoder.decode[code[0]];
+				int offs;
+				switch (dec.op) {
+					case SIM_BPL: case SIM_BMI: case SIM_BVC: case SIM_BVS: case SIM_BCC: case SIM_BCS:
+					case SIM_BNE: case SIM_BEQ: case SIM_BRA:
+						offs = lst.size > 1 ? (int8_t)code[1] : 0;
+						break;
+					case SIM_BBR: case SIM_BBS:
+						offs = lst.size > 2 ? (int8_t)code[2] : 0;
+						break;
+					default:
+						continue;
+				}
+				uint32_t target = (end & 0xff0000) | ((end + offs) & 0xffff);
+				if ((target & 0xffff00) == (end & 0xffff00)) { continue; }
+				out.sprintf("branch to $%04x crosses a page", target);
+			} else {
+				// data from a label up to the next label, code or gap
+				if (!lst.labeled()) { continue; }
+				while ((l + 1) < nl) {
+					const ListLine &next = (*s.pListing)[l + 1];
+					if (next.address < last->address + last->size) { break; }
+					if (next.size && (next.labeled() || next.wasMnemonic() || !next.pageCheck() ||
+						next.address != last->address + last->size)) { break; }
+					if (next.size) { last = &next; }
+					++l;
+				}
+				end = uint32_t(last->address + last->size + s.start_address);
+				if ((address & 0xffff00) == ((end - 1) & 0xffff00)) { continue; }
+				strref name;
+				for (size_t m = 0, nm = map.size(); m < nm && !name; ++m) {
+					const MapSymbol &sym = map[m];
+					if (sym.section == (int)i ? sym.value == lst.address : (sym.section < 0 && sym.value == (int)address))
+						name = sym.name;
+				}
+				if (name) { out.sprintf("data " STRREF_FMT " $%04x-$%04x crosses a page", STRREF_ARG(name), address, end - 1); }
+				else { out.sprintf("data $%04x-$%04x crosses a page", address, end - 1); }
+			}
+			strref file;
+			int line = resolver.resolve(lst.code, lst.source_name, lst.line_offs, lst.macro_site, file);
+			fprintf(stderr, "%s " STRREF_FMT "(%d): %s \"" STRREF_FMT "\"\n", as_error ? "Error" : "Warning",
+				STRREF_ARG(file), line, out.c_str(), STRREF_ARG(lst.code.get_skipped(lst.line_offs).get_line().get_trimmed_ws()));
+			++found;
+		}
+	}
+	return found;
+}
+
 // Create a listing of all valid instructions and addressing modes
 bool Asm::AllOpcodes(strref filename) {
 	FILE *f = stdout;
@@ -6107,36 +8120,141 @@ void Asm::Assemble(strref source, strref filename, bool obj_target) {
 		}
 	}
 	if (error==STATUS_OK) {
-		if (!obj_target) { LinkZP(); }
-		error = CheckLateEval();
-		if (error>STATUS_XREF_DEPENDENT) {
-			strown<512> errorText;
-			errorText.copy("Error: ");
-			errorText.append(aStatusStrings[error]);
-			fwrite(errorText.get(), errorText.get_len(), 1, stderr);
-		} else { CheckLateEval(strref(), -1, true); } // output any missing xref's
-
-		if (!obj_target) {
-			for (std::vector<LateEval>::iterator i = lateEval.begin(); i!=lateEval.end(); ++i) {
-				strown<512> errorText;
-				int line = i->source_file.count_lines(i->expression);
-				errorText.sprintf("Error (%d): ", line+1);
-				errorText.append("Failed to evaluate label \"");
-				errorText.append(i->expression);
-				if (line>=0) {
-					errorText.append("\" : \"");
-					errorText.append(i->source_file.get_line(line).get_trimmed_ws());
-				}
-				errorText.append("\"\n");
-				fwrite(errorText.get(), errorText.get_len(), 1, stderr);
-			}
-		}
+		CompleteAssembly(obj_target);
 	} else {
 		PrintError(&contextStack.curr() ?
 				   contextStack.curr().read_source.get_line() : strref(), error);
 	}
 }
 
+// Resolve remaining expressions and report anything that could not be resolved
+void Asm::CompleteAssembly(bool obj_target) {
+	if (!obj_target) { LinkZP(); }
+	StatusCode error = CheckLateEval();
+	if (error>STATUS_XREF_DEPENDENT) {
+		strown<512> errorText;
+		errorText.copy("Error: ");
+		errorText.append(aStatusStrings[error]);
+		Print(stderr, "%s", errorText.c_str());
+	} else { CheckLateEval(strref(), -1, true); } // output any missing xref's
+
+	if (!obj_target) {
+		for (std::vector<LateEval>::iterator i = lateEval.begin(); i!=lateEval.end(); ++i) {
+			strown<512> errorText;
+			int line = i->source_file.count_lines(i->expression);
+			errorText.sprintf("Error (%d): ", line+1);
+			errorText.append("Failed to evaluate label \"");
+			errorText.append(i->expression);
+			if (line>=0) {
+				errorText.append("\" : \"");
+				errorText.append(i->source_file.get_line(line).get_trimmed_ws());
+			}
+			errorText.append("\"\n");
+			Print(stderr, "%s", errorText.c_str());
+		}
+	}
+}
+
+// Find or add the zero page optimization site of the next forward referenced operand,
+// a site that doesn't match the previous pass stays absolute.
+int Asm::AddZPSite(strref expression) {
+	int site = zp_site_count++;
+	uint32_t hash = expression.hash();
+	if (site >= (int)zpSites.size()) {
+		ZPSite add = { hash, ZPSite::ZPS_ABS, false };
+		zpSites.push_back(add);
+	} else if (zpSites[site].hash != hash) {
+		zpSites[site].hash = hash;
+		zpSites[site].state = ZPSite::ZPS_KEEP_ABS;
+	}
+	zpSites[site].fits = false;
+	return site;
+}
+
+// Find or add the relaxation site of the next branch, a site that doesn't match
+// the previous pass starts over as a short branch.
+int Asm::AddBranchSite(strref expression) {
+	int site = branch_site_count++;
+	uint32_t hash = expression.hash();
+	if (site >= (int)branchSites.size()) {
+		BranchSite add = { hash, false, false };
+		branchSites.push_back(add);
+	} else if (branchSites[site].hash != hash) {
+		branchSites[site].hash = hash;
+		branchSites[site].relax = false;
+	}
+	branchSites[site].out_of_range = false;
+	return site;
+}
+
+// Assemble an out of range branch as the inverted branch over a jmp, or a brl
+// on 65816. The opcode of the branch has already been added.
+StatusCode Asm::AddRelaxedBranch(uint8_t opcode, strref expression, strref source_file) {
+	bool brl = cpu == CPU_65816;
+	if (opcode != 0x80) {	// conditional branch skips the jump with the opposite condition
+		CurrSection().SetByte(CurrSection().DataOffset() - 1, opcode ^ 0x20);
+		AddByte(3);
+		relaxed_branch_pc = CurrSection().GetPC();
+		AddByte(brl ? 0x82 : 0x4c);
+	} else { CurrSection().SetByte(CurrSection().DataOffset() - 1, brl ? 0x82 : 0x4c); }
+
+	struct EvalContext etx;
+	SetEvalCtxDefaults(etx);
+	if (brl) { etx.relative_section = SectionId(); }
+	int value = 0;
+	StatusCode error = EvalExpression(expression, etx, value);
+	if (error == STATUS_NOT_READY || error == STATUS_XREF_DEPENDENT) {
+		AddLateEval(CurrSection().DataOffset(), CurrSection().GetPC(), scope_address[scope_depth], expression, source_file,
+			brl ? LateEval::LET_BRANCH_16 : LateEval::LET_ABS_REF);
+		value = 0;
+	} else if (error == STATUS_RELATIVE_SECTION && !brl) {
+		CurrSection().AddReloc(lastEvalValue, CurrSection().DataOffset(), lastEvalSection, 2, lastEvalShift);
+		value = 0;
+	} else if (error != STATUS_OK && error != STATUS_RELATIVE_SECTION) {
+		return error;
+	} else if (brl) { value -= CurrSection().GetPC() + 2; }
+	AddWord(value);
+
+	RelaxedBranch relaxed = { contextStack.curr().source_name, expression,
+		contextStack.curr().source_file.count_lines(expression) + 1 };
+	relaxedBranches.push_back(relaxed);
+	return STATUS_OK;
+}
+
+// After a pass, operands that resolved to zero page are assembled as zero page in the
+// next pass and zero page operands that no longer fit return to absolute for good.
+// Branches that were out of range are relaxed in the next pass and stay relaxed.
+// Returns true if another pass is needed.
+bool Asm::UpdatePassSites() {
+	bool changed = zp_site_count != (int)zpSites.size() || branch_site_count != (int)branchSites.size();
+	zpSites.resize(zp_site_count);
+	for (std::vector<ZPSite>::iterator i = zpSites.begin(); i != zpSites.end(); ++i) {
+		if (i->state == ZPSite::ZPS_ABS && i->fits) {
+			i->state = ZPSite::ZPS_ZP;
+			changed = true;
+		} else if (i->state == ZPSite::ZPS_ZP && !i->fits) {
+			i->state = ZPSite::ZPS_KEEP_ABS;
+			changed = true;
+		}
+	}
+	branchSites.resize(branch_site_count);
+	for (std::vector<BranchSite>::iterator i = branchSites.begin(); i != branchSites.end(); ++i) {
+		if (!i->relax && i->out_of_range) {
+			i->relax = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// Print each branch that was assembled as a long branch
+void Asm::ListRelaxedBranches() {
+	for (std::vector<RelaxedBranch>::iterator i = relaxedBranches.begin(); i != relaxedBranches.end(); ++i) {
+		printf("Note " STRREF_FMT "(%d): branch to \"" STRREF_FMT "\" relaxed to %s\n", STRREF_ARG(i->source_name),
+			i->line, STRREF_ARG(i->expression), cpu == CPU_65816 ? "brl" : "jmp");
+	}
+}
+
 //
 //
 // OBJECT FILE HANDLING
@@ -6221,10 +8339,10 @@ struct ObjFileMapSymbol {
 static int _AddStrPool(const strref str, pairArray<uint32_t, int> *pLookup, char **strPool, uint32_t &strPoolSize, uint32_t &strPoolCap) {
 	if (!str.get()||!str.get_len()) { return -1; }	// empty string
 
-	uint32_t hash = str.fnv1a();
+	uint32_t hash = str.hash();
 	uint32_t index = FindLabelIndex(hash, pLookup->getKeys(), pLookup->count());
-	if (index<pLookup->count()&&str.same_str_case(*strPool+pLookup->getValue(index))) {
-		return pLookup->getValue(index);
+	for (uint32_t i = index; i<pLookup->count() && pLookup->getKey(i)==hash; ++i) {
+		if (str.same_str_case(*strPool+pLookup->getValue(i))) { return pLookup->getValue(i); }
 	}
 	int strOffs = strPoolSize;
 	if ((strOffs + str.get_len() + 1) > strPoolCap) {
@@ -6250,6 +8368,26 @@ static int _AddStrPool(const strref str, pairArray<uint32_t, int> *pLookup, char
 	return strOffs;
 }
 
+// Byte order of label names, object files list labels in this order so the
+// output doesn't depend on the label hash of the host that wrote it
+struct LabelNameOrder {
+	const Label *labels;
+	bool operator()(uint32_t a, uint32_t b) const {
+		const strref &na = labels[a].label_name, &nb = labels[b].label_name;
+		strl_t len = na.get_len() < nb.get_len() ? na.get_len() : nb.get_len();
+		if (int diff = len ? memcmp(na.get(), nb.get(), len) : 0) { return diff < 0; }
+		if (na.get_len() != nb.get_len()) { return na.get_len() < nb.get_len(); }
+		return a < b;
+	}
+};
+
+static void SortLabelsByName(pairArray<uint32_t, Label> &table, std::vector<uint32_t> &order) {
+	order.resize(table.count());
+	for (uint32_t i = 0; i < table.count(); ++i) { order[i] = i; }
+	LabelNameOrder cmp = { table.getValues() };
+	std::sort(order.begin(), order.end(), cmp);
+}
+
 StatusCode Asm::WriteObjectFile(strref filename) {
 	if (allSections.size()==0)
 		return ERROR_NOT_A_SECTION;
@@ -6342,9 +8480,11 @@ StatusCode Asm::WriteObjectFile(strref filename) {
 		hdr.sections = (int16_t)sect;
 
 		// write out labels
+		std::vector<uint32_t> order;
 		if (hdr.labels) {
+			SortLabelsByName(labels, order);
 			for (uint32_t li = 0; li<labels.count(); li++) {
-				Label &lo = labels.getValue(li);
+				Label &lo = labels.getValue(order[li]);
 				if (!lo.reference) {
 					struct ObjFileLabel &l = aLabels[labs++];
 					l.name.offs = _AddStrPool(lo.label_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
@@ -6364,8 +8504,9 @@ StatusCode Asm::WriteObjectFile(strref filename) {
 		if (hdr.labels) {
 			int file_index = 1;
 			for (std::vector<ExtLabels>::iterator el = externals.begin(); el != externals.end(); ++el) {
+				SortLabelsByName(el->labels, order);
 				for (uint32_t li = 0; li < el->labels.count(); ++li) {
-					Label &lo = el->labels.getValue(li);
+					Label &lo = el->labels.getValue(order[li]);
 					struct ObjFileLabel &l = aLabels[labs++];
 					l.name.offs = _AddStrPool(lo.label_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
 					l.value = lo.value;
@@ -6435,20 +8576,54 @@ StatusCode Asm::WriteObjectFile(strref filename) {
 }
 
 StatusCode Asm::ReadObjectFile(strref filename, int link_to_section)
+{
+	ObjFileStage stage;
+	if (LoadObjectFile(filename, stage) != STATUS_OK)
+		return stage.status;
+	return LinkObjectFile(stage, link_to_section);
+}
+
+// Load an object file and validate the header, does not modify the assembler state
+StatusCode Asm::LoadObjectFile(strref filename, ObjFileStage &stage)
 {
 	size_t size;
 	strown<512> file;
 	file.copy(filename); // Merlin mostly uses extension-less files, append .x65 as a default
 	if ((Merlin() && !file.has_suffix(".x65")) || filename.find('.')<0)
 		file.append(".x65");
-	int file_index = (int)externals.size();
+	stage.filename = filename;
+	stage.data = nullptr;
+	stage.str_pool = nullptr;
+	stage.size = 0;
+	stage.status = STATUS_OK;	// missing object files are silently skipped
 	if (char *data = LoadBinary(file.get_strref(), size)) {
 		struct ObjFileHeader &hdr = *(struct ObjFileHeader*)data;
-		size_t sum = sizeof(hdr) + hdr.sections*sizeof(struct ObjFileSection) +
+		size_t sum = size < sizeof(hdr) ? 0 : (sizeof(hdr) + hdr.sections*sizeof(struct ObjFileSection) +
 			hdr.relocs * sizeof(struct ObjFileReloc) + hdr.labels * sizeof(struct ObjFileLabel) +
 			hdr.late_evals * sizeof(struct ObjFileLateEval) +
-			hdr.map_symbols * sizeof(struct ObjFileMapSymbol) + hdr.stringdata + hdr.bindata;
-		if (hdr.id == 0x7836 && sum == size) {
+			hdr.map_symbols * sizeof(struct ObjFileMapSymbol) + hdr.stringdata + hdr.bindata);
+		if (sum != size || hdr.id != 0x7836) {
+			free(data);
+			stage.status = ERROR_NOT_AN_X65_OBJECT_FILE;
+			return stage.status;
+		}
+		const char *str_orig = data + size - hdr.stringdata - hdr.bindata;
+		stage.str_pool = (char*)malloc(hdr.stringdata);
+		memcpy(stage.str_pool, str_orig, hdr.stringdata);
+		stage.data = data;
+		stage.size = size;
+	}
+	return stage.status;
+}
+
+// Add the contents of a loaded object file to the assembler state
+StatusCode Asm::LinkObjectFile(ObjFileStage &stage, int link_to_section)
+{
+	strref filename = stage.filename;
+	int file_index = (int)externals.size();
+	if (char *data = stage.data) {
+		struct ObjFileHeader &hdr = *(struct ObjFileHeader*)data;
+		{
 			struct ObjFileSection *aSect = (struct ObjFileSection*)(&hdr + 1);
 			struct ObjFileReloc *aReloc = (struct ObjFileReloc*)(aSect + hdr.sections);
 			struct ObjFileLabel *aLabels = (struct ObjFileLabel*)(aReloc + hdr.relocs);
@@ -6457,10 +8632,8 @@ StatusCode Asm::ReadObjectFile(strref filename, int link_to_section)
 			const char *str_orig = (const char*)(aMapSyms + hdr.map_symbols);
 			const char *bin_data = str_orig + hdr.stringdata;
 
-			char *str_pool = (char*)malloc(hdr.stringdata);
-			memcpy(str_pool, str_orig, hdr.stringdata);
+			char *str_pool = stage.str_pool;
 			loadedData.push_back(str_pool);
-
 			int prevSection = SectionId();
 			int16_t *aSctRmp = (int16_t*)malloc(hdr.sections * sizeof(int16_t));
 			int last_linked_section = link_to_section;
@@ -6545,7 +8718,7 @@ StatusCode Asm::ReadObjectFile(strref filename, int link_to_section)
 				int16_t f = (int16_t)l.flags;
 				int external = f & ObjFileLabel::OFL_XDEF;
 				if (external == ObjFileLabel::OFL_XDEF) {
-					if (!lbl) { lbl = AddLabel(name.fnv1a()); }	// insert shared label
+					if (!lbl) { lbl = AddLabel(name.hash()); }	// insert shared label
 					else if (!lbl->reference) { continue; }
 				} else {								// insert protected label
 					while ((file_index + external) >= (int)externals.size()) {
@@ -6554,7 +8727,7 @@ StatusCode Asm::ReadObjectFile(strref filename, int link_to_section)
 						}
 						externals.push_back(ExtLabels());
 					}
-					uint32_t hash = name.fnv1a();
+					uint32_t hash = name.hash();
 					uint32_t index = FindLabelIndex(hash, externals[file_index].labels.getKeys(), externals[file_index].labels.count());
 					externals[file_index].labels.insert(index, hash);
 					lbl = externals[file_index].labels.getValues() + index;
@@ -6598,12 +8771,476 @@ StatusCode Asm::ReadObjectFile(strref filename, int link_to_section)
 
 			// restore previous section
 			current_section = &allSections[prevSection];
-		} else { return ERROR_NOT_AN_X65_OBJECT_FILE; }
-
+		}
+		free(data);
+		stage.data = nullptr;
 	}
 	return STATUS_OK;
 }
 
+// Loads object files in parallel and links them in order
+struct ObjFileLoader {
+	Asm *assembler;
+	const strref *files;
+	ObjFileStage *stages;
+	void Run(int index) { assembler->LoadObjectFile(files[index], stages[index]); }
+};
+
+// Link only mode, link a number of object files without a source file
+void Asm::LinkObjectFiles(const strref *files, int count, int num_threads)
+{
+	std::vector<ObjFileStage> stages(count);
+	ObjFileLoader loader = { this, files, &stages[0] };
+	ParallelFor(loader, count, num_threads);
+
+	// object files are linked in order within an empty source context
+	SetCPU(cpu);
+	StatusCode error = PushContext(strref("link"), strref(), strref());
+	int failed_file = -1;
+	for (int f = 0; f < count; f++) {
+		ObjFileStage &stage = stages[f];
+		if (error == STATUS_OK) {
+			error = (stage.data || stage.status != STATUS_OK) ? stage.status : ERROR_COULD_NOT_INCLUDE_FILE;
+			if (error == STATUS_OK) {
+				error = LinkObjectFile(stage);
+				continue;
+			}
+			failed_file = f;
+		}
+		if (stage.data) { free(stage.data); }
+		if (stage.str_pool) { free(stage.str_pool); }
+	}
+	StatusCode pop_error = PopContext();
+	if (error == STATUS_OK) { error = pop_error; }
+	if (error != STATUS_OK) {
+		PrintError(failed_file >= 0 ? files[failed_file] : strref(), error);
+		return;
+	}
+	CompleteAssembly(false);
+}
+
+
+//
+//
+// PRECOMPILED PREFIX SNAPSHOT
+//
+//
+
+// A snapshot holds the labels, macros, structs, strings, label pools and xdefs
+// defined by a prefix include that does not generate any code or data.
+
+#define SNAPSHOT_VERSION 3
+
+struct SnapFileHeader {
+	int16_t id;				// 'x7'
+	int16_t version;
+	uint64_t state_hash;	// options that affect the prefix
+	int files;
+	int missing;			// files probed and not found, must still not exist
+	int labels;
+	int map_symbols;
+	int macros;
+	int structs;
+	int members;
+	int strings;
+	int pools;
+	int xdefs;
+	uint32_t stringdata;
+	int8_t cpu;
+	int8_t syntax;
+	int8_t end_macro_directive;
+};
+
+struct SnapFile {
+	struct ObjFileStr name;
+	uint64_t hash;				// fnv1a 64 of file contents
+};
+
+struct SnapLabel {
+	enum LabelFlags {
+		SL_EVAL = 1,
+		SL_ADDR = 2,
+		SL_CNST = 4,
+		SL_XDEF = 8,
+		SL_REF = 16
+	};
+	uint32_t key;
+	struct ObjFileStr name;
+	struct ObjFileStr pool_name;
+	int value;
+	int mapIndex;
+	int flags;
+};
+
+struct SnapMacro {
+	uint32_t key;
+	struct ObjFileStr name;
+	struct ObjFileStr source_name;
+	struct ObjFileStr source_file;	// macro is a range within the source file
+	int macro_offs;
+	int macro_len;
+	bool params_first_line;
+};
+
+struct SnapStruct {
+	uint32_t key;
+	struct ObjFileStr name;
+	uint16_t first_member;
+	uint16_t numMembers;
+	uint16_t size;
+};
+
+struct SnapMember {
+	struct ObjFileStr name;
+	struct ObjFileStr sub_struct;
+	uint32_t name_hash;
+	uint16_t offset;
+};
+
+struct SnapString {
+	uint32_t key;
+	struct ObjFileStr name;
+	struct ObjFileStr value;
+};
+
+struct SnapPool {
+	uint32_t key;
+	struct ObjFileStr name;
+	int16_t numRanges;
+	int16_t depth;
+	uint16_t start;
+	uint16_t end;
+	uint16_t scopeUsed[MAX_SCOPE_DEPTH][2];
+};
+
+struct SnapXdef {
+	uint32_t key;
+	struct ObjFileStr name;
+};
+
+// the compiled layout of the snapshot must match
+static uint64_t SnapshotStateHash(uint64_t state_hash) {
+	return strref(__DATE__ " " __TIME__).fnv1a_64(state_hash);
+}
+
+// Assemble a prefix include or adopt the snapshot of it if the snapshot is current
+void Asm::AssemblePrefix(strref prefix, strref snapshot, uint64_t state_hash)
+{
+	if (snapshot && ReadSnapshot(snapshot, state_hash)) { return; }
+
+	size_t first_file = filesRead.size();
+	size_t first_missing = filesMissing.size();
+	bool hash_files = hash_files_read;
+	hash_files_read = true;
+	size_t size = 0;
+	if (char *text = LoadText(prefix, size)) {
+		loadedData.push_back(text);
+		Assemble(strref(text, (strl_t)size), prefix, true);
+	} else {
+		PrintError(prefix, ERROR_COULD_NOT_INCLUDE_FILE);
+	}
+	hash_files_read = hash_files;
+	if (snapshot && !error_encountered) {
+		if (WriteSnapshot(snapshot, state_hash, first_file, first_missing) != STATUS_OK)
+			Print(stdout, "Note: snapshot of \"" STRREF_FMT "\" not saved, prefix must not generate code or data\n", STRREF_ARG(prefix));
+	}
+}
+
+StatusCode Asm::WriteSnapshot(strref filename, uint64_t state_hash, size_t first_file, size_t first_missing)
+{
+	// only the state that doesn't depend on sections can be saved
+	for (std::vector<Section>::iterator s = allSections.begin(); s != allSections.end(); ++s) {
+		if (s->size() || s->addr_size()) { return ERROR_UNABLE_TO_PROCESS; }
+	}
+	for (uint32_t l = 0; l < labels.count(); l++) {
+		if (labels.getValue(l).section >= 0) { return ERROR_UNABLE_TO_PROCESS; }
+	}
+	if (lateEval.size() || externals.size()) { return ERROR_UNABLE_TO_PROCESS; }
+
+	struct SnapFileHeader hdr = { 0 };
+	hdr.id = 0x7837;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.state_hash = SnapshotStateHash(state_hash);
+	hdr.files = (int)(filesRead.size() - first_file);
+	hdr.missing = (int)(filesMissing.size() - first_missing);
+	hdr.labels = (int)labels.count();
+	hdr.map_symbols = (int)map.size();
+	hdr.macros = (int)macros.count();
+	hdr.structs = (int)labelStructs.count();
+	hdr.members = (int)structMembers.size();
+	hdr.strings = (int)strings.count();
+	hdr.pools = (int)labelPools.count();
+	hdr.xdefs = (int)xdefs.count();
+	hdr.cpu = (int8_t)cpu;
+	hdr.syntax = (int8_t)syntax;
+	hdr.end_macro_directive = end_macro_directive ? 1 : 0;
+
+	char *stringPool = nullptr;
+	uint32_t stringPoolCap = 0;
+	pairArray<uint32_t, int> stringArray;
+	stringArray.reserve(hdr.labels * 2 + hdr.macros * 3 + hdr.members * 2 + 64);
+
+	std::vector<SnapFile> aFiles(hdr.files + hdr.missing);
+	for (int i = 0; i < (hdr.files + hdr.missing); i++) {
+		FileRead &file = i < hdr.files ? filesRead[first_file + i] : filesMissing[first_missing + i - hdr.files];
+		aFiles[i].name.offs = _AddStrPool(file.name.get_strref(), &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aFiles[i].hash = file.hash;
+	}
+	std::vector<SnapLabel> aLabels(hdr.labels);
+	for (int i = 0; i < hdr.labels; i++) {
+		Label &lbl = labels.getValue(i);
+		SnapLabel &sl = aLabels[i];
+		sl.key = labels.getKey(i);
+		sl.name.offs = _AddStrPool(lbl.label_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		sl.pool_name.offs = _AddStrPool(lbl.pool_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		sl.value = lbl.value;
+		sl.mapIndex = lbl.mapIndex;
+		sl.flags = (lbl.evaluated ? SnapLabel::SL_EVAL : 0) | (lbl.pc_relative ? SnapLabel::SL_ADDR : 0) |
+			(lbl.constant ? SnapLabel::SL_CNST : 0) | (lbl.external ? SnapLabel::SL_XDEF : 0) |
+			(lbl.reference ? SnapLabel::SL_REF : 0);
+	}
+	std::vector<ObjFileMapSymbol> aMapSyms(hdr.map_symbols);
+	for (int i = 0; i < hdr.map_symbols; i++) {
+		aMapSyms[i].name.offs = _AddStrPool(map[i].name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aMapSyms[i].value = map[i].value;
+		aMapSyms[i].section = -1;
+		aMapSyms[i].local = map[i].local;
+	}
+	std::vector<SnapMacro> aMacros(hdr.macros);
+	for (int i = 0; i < hdr.macros; i++) {
+		Macro &m = macros.getValue(i);
+		SnapMacro &sm = aMacros[i];
+		sm.key = macros.getKey(i);
+		sm.name.offs = _AddStrPool(m.name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		sm.source_name.offs = _AddStrPool(m.source_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		strref source = m.source_file;
+		if (m.macro.get() < source.get() || (m.macro.get() + m.macro.get_len()) > (source.get() + source.get_len()))
+			source = m.macro;	// keep the macro with the source if possible for line numbers
+		sm.source_file.offs = _AddStrPool(source, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		sm.macro_offs = (int)(m.macro.get() - source.get());
+		sm.macro_len = (int)m.macro.get_len();
+		sm.params_first_line = m.params_first_line;
+	}
+	std::vector<SnapStruct> aStructs(hdr.structs);
+	for (int i = 0; i < hdr.structs; i++) {
+		LabelStruct &ls = labelStructs.getValue(i);
+		aStructs[i].key = labelStructs.getKey(i);
+		aStructs[i].name.offs = _AddStrPool(ls.name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aStructs[i].first_member = ls.first_member;
+		aStructs[i].numMembers = ls.numMembers;
+		aStructs[i].size = ls.size;
+	}
+	std::vector<SnapMember> aMembers(hdr.members);
+	for (int i = 0; i < hdr.members; i++) {
+		MemberOffset &mo = structMembers[i];
+		aMembers[i].name.offs = _AddStrPool(mo.name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aMembers[i].sub_struct.offs = _AddStrPool(mo.sub_struct, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aMembers[i].name_hash = mo.name_hash;
+		aMembers[i].offset = mo.offset;
+	}
+	std::vector<SnapString> aStrings(hdr.strings);
+	for (int i = 0; i < hdr.strings; i++) {
+		StringSymbol &str = strings.getValue(i);
+		aStrings[i].key = strings.getKey(i);
+		aStrings[i].name.offs = _AddStrPool(str.string_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		aStrings[i].value.offs = _AddStrPool(str.get(), &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+	}
+	std::vector<SnapPool> aPools(hdr.pools);
+	for (int i = 0; i < hdr.pools; i++) {
+		LabelPool &pool = labelPools.getValue(i);
+		SnapPool &sp = aPools[i];
+		sp.key = labelPools.getKey(i);
+		sp.name.offs = _AddStrPool(pool.pool_name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		sp.numRanges = pool.numRanges;
+		sp.depth = pool.depth;
+		sp.start = pool.start;
+		sp.end = pool.end;
+		memcpy(sp.scopeUsed, pool.scopeUsed, sizeof(sp.scopeUsed));
+	}
+	std::vector<SnapXdef> aXdefs(hdr.xdefs);
+	for (int i = 0; i < hdr.xdefs; i++) {
+		aXdefs[i].key = xdefs.getKey(i);
+		aXdefs[i].name.offs = _AddStrPool(xdefs.getValue(i), &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+	}
+
+	StatusCode status = ERROR_CANT_WRITE_TO_FILE;
+	if (FILE *f = fopen(strown<512>(filename).c_str(), "wb")) {
+		fwrite(&hdr, sizeof(hdr), 1, f);
+		if (aFiles.size()) { fwrite(&aFiles[0], sizeof(aFiles[0]), aFiles.size(), f); }
+		if (hdr.labels) { fwrite(&aLabels[0], sizeof(aLabels[0]), hdr.labels, f); }
+		if (hdr.map_symbols) { fwrite(&aMapSyms[0], sizeof(aMapSyms[0]), hdr.map_symbols, f); }
+		if (hdr.macros) { fwrite(&aMacros[0], sizeof(aMacros[0]), hdr.macros, f); }
+		if (hdr.structs) { fwrite(&aStructs[0], sizeof(aStructs[0]), hdr.structs, f); }
+		if (hdr.members) { fwrite(&aMembers[0], sizeof(aMembers[0]), hdr.members, f); }
+		if (hdr.strings) { fwrite(&aStrings[0], sizeof(aStrings[0]), hdr.strings, f); }
+		if (hdr.pools) { fwrite(&aPools[0], sizeof(aPools[0]), hdr.pools, f); }
+		if (hdr.xdefs) { fwrite(&aXdefs[0], sizeof(aXdefs[0]), hdr.xdefs, f); }
+		if (hdr.stringdata) { fwrite(stringPool, hdr.stringdata, 1, f); }
+		fclose(f);
+		status = STATUS_OK;
+	}
+	if (stringPool) { free(stringPool); }
+	stringArray.clear();
+	return status;
+}
+
+// Adopt the state from a snapshot if all the files it was made from are unchanged
+bool Asm::ReadSnapshot(strref filename, uint64_t state_hash)
+{
+	size_t size;
+	char *data = ReadFileData(strown<512>(filename).c_str(), size);
+	if (!data) { return false; }
+	struct SnapFileHeader &hdr = *(struct SnapFileHeader*)data;
+	size_t sum = size < sizeof(hdr) ? 0 : (sizeof(hdr) + (hdr.files + hdr.missing) * sizeof(SnapFile) +
+		hdr.labels * sizeof(SnapLabel) + hdr.map_symbols * sizeof(ObjFileMapSymbol) +
+		hdr.macros * sizeof(SnapMacro) + hdr.structs * sizeof(SnapStruct) +
+		hdr.members * sizeof(SnapMember) + hdr.strings * sizeof(SnapString) +
+		hdr.pools * sizeof(SnapPool) + hdr.xdefs * sizeof(SnapXdef) + hdr.stringdata);
+	if (sum != size || hdr.id != 0x7837 || hdr.version != SNAPSHOT_VERSION ||
+		hdr.state_hash != SnapshotStateHash(state_hash)) {
+		free(data);
+		return false;
+	}
+	SnapFile *aFiles = (SnapFile*)(&hdr + 1);
+	SnapLabel *aLabels = (SnapLabel*)(aFiles + hdr.files + hdr.missing);
+	ObjFileMapSymbol *aMapSyms = (ObjFileMapSymbol*)(aLabels + hdr.labels);
+	SnapMacro *aMacros = (SnapMacro*)(aMapSyms + hdr.map_symbols);
+	SnapStruct *aStructs = (SnapStruct*)(aMacros + hdr.macros);
+	SnapMember *aMembers = (SnapMember*)(aStructs + hdr.structs);
+	SnapString *aStrings = (SnapString*)(aMembers + hdr.members);
+	SnapPool *aPools = (SnapPool*)(aStrings + hdr.strings);
+	SnapXdef *aXdefs = (SnapXdef*)(aPools + hdr.pools);
+	const char *str_pool = (const char*)(aXdefs + hdr.xdefs);
+
+	// all files read by the prefix must be unchanged
+	for (int i = 0; i < hdr.files; i++) {
+		size_t file_size;
+		char *file = LoadFile(str_pool + aFiles[i].name.offs, file_size);
+		bool same = file && strref(file, (strl_t)file_size).fnv1a_64() == aFiles[i].hash;
+		if (file) { free(file); }
+		if (!same) {
+			filesRead.resize(filesRead.size() - (i + (file ? 1 : 0)));
+			free(data);
+			return false;
+		}
+		filesRead[filesRead.size()-1].hash = aFiles[i].hash;
+	}
+
+	// and files that were searched for and not found must still be missing
+	for (int i = hdr.files; i < (hdr.files + hdr.missing); i++) {
+		size_t file_size;
+		int64_t mtime;
+		if (GetFileStat(str_pool + aFiles[i].name.offs, file_size, mtime)) {
+			filesRead.resize(filesRead.size() - hdr.files);
+			free(data);
+			return false;
+		}
+	}
+	for (int i = hdr.files; i < (hdr.files + hdr.missing); i++) {
+		FileRead file;
+		file.name.copy(str_pool + aFiles[i].name.offs);
+		file.hash = 0;
+		filesMissing.push_back(file);
+	}
+
+	// the snapshot replaces the state since it was made with the same options
+	loadedData.push_back(data);
+	labels.reset();
+	map.clear();
+	macros.reset();
+	labelStructs.reset();
+	structMembers.clear();
+	for (uint32_t i = 0; i < strings.count(); ++i)
+		strings.getValue(i).clear();
+	strings.reset();
+	labelPools.reset();
+	xdefs.reset();
+
+	#define SNAP_STR(s) ((s).offs >= 0 ? strref(str_pool + (s).offs) : strref())
+	labels.reserve(hdr.labels);
+	for (int i = 0; i < hdr.labels; i++) {
+		labels.insert(i, aLabels[i].key);
+		Label &lbl = labels.getValue(i);
+		lbl.label_name = SNAP_STR(aLabels[i].name);
+		lbl.pool_name = SNAP_STR(aLabels[i].pool_name);
+		lbl.value = aLabels[i].value;
+		lbl.section = -1;
+		lbl.mapIndex = aLabels[i].mapIndex;
+		lbl.evaluated = !!(aLabels[i].flags & SnapLabel::SL_EVAL);
+		lbl.pc_relative = !!(aLabels[i].flags & SnapLabel::SL_ADDR);
+		lbl.constant = !!(aLabels[i].flags & SnapLabel::SL_CNST);
+		lbl.external = !!(aLabels[i].flags & SnapLabel::SL_XDEF);
+		lbl.reference = !!(aLabels[i].flags & SnapLabel::SL_REF);
+	}
+	map.reserve(hdr.map_symbols + 256);
+	for (int i = 0; i < hdr.map_symbols; i++) {
+		MapSymbol sym;
+		sym.name = SNAP_STR(aMapSyms[i].name);
+		sym.value = aMapSyms[i].value;
+		sym.section = -1;
+		sym.local = aMapSyms[i].local;
+		map.push_back(sym);
+	}
+	macros.reserve(hdr.macros);
+	for (int i = 0; i < hdr.macros; i++) {
+		macros.insert(i, aMacros[i].key);
+		Macro &m = macros.getValue(i);
+		m.name = SNAP_STR(aMacros[i].name);
+		m.source_name = SNAP_STR(aMacros[i].source_name);
+		m.source_file = SNAP_STR(aMacros[i].source_file);
+		m.macro = strref(m.source_file.get() + aMacros[i].macro_offs, (strl_t)aMacros[i].macro_len);
+		m.params_first_line = aMacros[i].params_first_line;
+	}
+	labelStructs.reserve(hdr.structs);
+	for (int i = 0; i < hdr.structs; i++) {
+		labelStructs.insert(i, aStructs[i].key);
+		LabelStruct &ls = labelStructs.getValue(i);
+		ls.name = SNAP_STR(aStructs[i].name);
+		ls.first_member = aStructs[i].first_member;
+		ls.numMembers = aStructs[i].numMembers;
+		ls.size = aStructs[i].size;
+	}
+	structMembers.reserve(hdr.members);
+	for (int i = 0; i < hdr.members; i++) {
+		MemberOffset mo;
+		mo.name = SNAP_STR(aMembers[i].name);
+		mo.sub_struct = SNAP_STR(aMembers[i].sub_struct);
+		mo.name_hash = aMembers[i].name_hash;
+		mo.offset = aMembers[i].offset;
+		structMembers.push_back(mo);
+	}
+	strings.reserve(hdr.strings);
+	for (int i = 0; i < hdr.strings; i++) {
+		strings.insert(i, aStrings[i].key);
+		StringSymbol &str = strings.getValue(i);
+		str.string_name = SNAP_STR(aStrings[i].name);
+		str.string_const = SNAP_STR(aStrings[i].value);
+		str.string_value.invalidate();
+	}
+	labelPools.reserve(hdr.pools);
+	for (int i = 0; i < hdr.pools; i++) {
+		labelPools.insert(i, aPools[i].key);
+		LabelPool &pool = labelPools.getValue(i);
+		pool.pool_name = SNAP_STR(aPools[i].name);
+		pool.numRanges = aPools[i].numRanges;
+		pool.depth = aPools[i].depth;
+		pool.start = aPools[i].start;
+		pool.end = aPools[i].end;
+		memcpy(pool.scopeUsed, aPools[i].scopeUsed, sizeof(pool.scopeUsed));
+	}
+	xdefs.reserve(hdr.xdefs);
+	for (int i = 0; i < hdr.xdefs; i++) {
+		xdefs.insert(i, aXdefs[i].key);
+		xdefs.getValue(i) = SNAP_STR(aXdefs[i].name);
+	}
+	#undef SNAP_STR
+
+	if (hdr.cpu != (int8_t)cpu) { SetCPU((CPUIndex)hdr.cpu); }
+	syntax = (AsmSyntax)hdr.syntax;
+	end_macro_directive = !!hdr.end_macro_directive;
+	return true;
+}
+
 // number of section types that can be merged
 enum OMFRecCode {
 	OMFR_END = 0,
@@ -6646,10 +9283,117 @@ static void _writeNBytes(uint8_t *dest, int bytes, int value) {
 }
 
 // sort relocs before writing GS OS reloc instructions
+// qsort is not stable so relocs at the same offset are ordered by the remaining fields
 static int sortRelocByOffs(const void *A, const void *B) {
-	return ((const Reloc*)A)->section_offset - ((const Reloc*)B)->section_offset;
+	const Reloc &a = *(const Reloc*)A, &b = *(const Reloc*)B;
+	if (a.section_offset != b.section_offset) { return a.section_offset < b.section_offset ? -1 : 1; }
+	if (a.target_section != b.target_section) { return a.target_section < b.target_section ? -1 : 1; }
+	if (a.base_value != b.base_value) { return a.base_value < b.base_value ? -1 : 1; }
+	if (a.bytes != b.bytes) { return a.bytes < b.bytes ? -1 : 1; }
+	return a.shift < b.shift ? -1 : (a.shift > b.shift ? 1 : 0);
+}
+
+// SUPER record subtypes, each replaces relocs of one size, shift and target
+enum OMFSuperType {
+	OMFS_RELOC2 = 0,		// 2 byte self reference
+	OMFS_RELOC3 = 1,		// 3 byte self reference
+	OMFS_INTERSEG1 = 2,		// 3 byte reference, segment number in the third byte
+	OMFS_INTERSEG13 = 14,	// 2 byte reference to segment 1-12
+	OMFS_INTERSEG25 = 26,	// 2 byte reference to the bank of segment 1-12
+	OMFS_TYPES = 38,
+	OMFS_SEGMENTS = 12,
+};
+
+// SUPER subtype that can write a reloc or -1 if it needs its own record
+static int OMFSuperType(const Reloc &r, bool self, int segnum) {
+	if (self) {
+		if (r.shift == 0 && (r.bytes == 2 || r.bytes == 3)) { return r.bytes == 2 ? OMFS_RELOC2 : OMFS_RELOC3; }
+	} else if (r.base_value >= 0 && r.base_value < 0x10000 && segnum > 0) {
+		if (r.bytes == 3 && r.shift == 0 && segnum < 0x100) { return OMFS_INTERSEG1; }
+		if (r.bytes == 2 && r.shift == 0 && segnum <= OMFS_SEGMENTS) { return OMFS_INTERSEG13 + segnum - 1; }
+		if (r.bytes == 2 && r.shift == -16 && segnum <= OMFS_SEGMENTS) { return OMFS_INTERSEG25 + segnum - 1; }
+	}
+	return -1;
+}
+
+// Size of a reloc written as a RELOC, cRELOC, INTERSEG or cINTERSEG record
+static int OMFRelocSize(const Reloc &r, bool self) {
+	bool compact = r.section_offset < 0x10000 && r.base_value < 0x10000;
+	return self ? (compact ? 7 : 11) : (compact ? 8 : 15);
+}
+
+// Write relocs of one subtype as a SUPER record or only get the size if dest is null.
+// Each list of patch offsets is for one 256 byte page and moves the loader to the next
+// page, a byte with the high bit set skips up to 127 pages. Returns the size of the
+// record or 0 if a page has too many patches.
+static int OMFWriteSuper(uint8_t *dest, int type, const Reloc *relocs, const int *index, int count) {
+	int size = 6;	// SUPER, length(4), subtype
+	int patches = -1;	// number of patches - 1 in the current page
+	int patches_offs = 0;
+	int page = 0;
+	for (int i = 0; i < count; i++) {
+		int offs = relocs[index[i]].section_offset;
+		if (patches >= 0 && (offs >> 8) == (page - 1)) {
+			if (patches == 0x7f) { return 0; }
+			patches++;
+			if (dest) { dest[patches_offs] = (uint8_t)patches; }
+		} else {
+			for (int skip = (offs >> 8) - page; skip > 0; skip -= 0x7f) {
+				if (dest) { dest[size] = uint8_t(0x80 | (skip < 0x7f ? skip : 0x7f)); }
+				size++;
+			}
+			patches = 0;
+			patches_offs = size++;
+			if (dest) { dest[patches_offs] = 0; }
+			page = (offs >> 8) + 1;
+		}
+		if (dest) { dest[size] = (uint8_t)offs; }
+		size++;
+	}
+	if (dest) {
+		dest[0] = OMFR_SUPER;
+		_writeNBytes(dest + 1, 4, size - 5);
+		dest[5] = (uint8_t)type;
+	}
+	return size;
+}
+
+// Value the loader reads from the binary for a reloc written in a SUPER record
+static int OMFSuperPatch(const Reloc &r, int type, int segnum) {
+	int value = r.base_value & (r.bytes == 2 ? 0xffff : 0xffffff);
+	return type == OMFS_INTERSEG1 ? ((value & 0xffff) | (segnum << 16)) : value;
 }
 
+// The executable is built in memory and written with a single fwrite
+struct OMFImage {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+
+	OMFImage() : data(nullptr), size(0), capacity(0) {}
+	~OMFImage() { if (data) { free(data); } }
+
+	// room for more bytes at the end of the image, valid until the next call
+	uint8_t* Reserve(size_t bytes) {
+		if ((size + bytes) > capacity) {
+			size_t grow = capacity ? capacity * 2 : 64 * 1024;
+			while (grow < (size + bytes)) { grow *= 2; }
+			uint8_t *grown = (uint8_t*)realloc(data, grow);
+			if (!grown) { return nullptr; }
+			data = grown;
+			capacity = grow;
+		}
+		return data + size;
+	}
+	bool Append(const void *src, size_t bytes) {
+		uint8_t *dest = Reserve(bytes);
+		if (!dest) { return false; }
+		memcpy(dest, src, bytes);
+		size += bytes;
+		return true;
+	}
+};
+
 // Export an Apple II GS relocatable executable
 StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 	// determine the section with startup code - either first loaded object file or current file
@@ -6690,7 +9434,7 @@ StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 	std::vector<int> SegLookup;	// inverse of SegNum
 	SegNum.reserve(allSections.size());
 	SegLookup.reserve(allSections.size());
-	int reloc_max = 1;
+	size_t image_size = 0;		// upper bound of the executable size
 
 	// OMF super instructions work by incremental addresses, sort relocs to simplify output
 	for (std::vector<Section>::iterator s = allSections.begin(); s != allSections.end(); ++s) {
@@ -6702,29 +9446,20 @@ StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 		SegLookup.push_back(-1);
 		if ((s->type == ST_CODE || s->type == ST_DATA) && s->pRelocs && s->pRelocs->size() > 1) {
 			qsort(&(*s->pRelocs)[0], s->pRelocs->size(), sizeof(Reloc), sortRelocByOffs);
-			if ((int)s->pRelocs->size()>reloc_max) {
-				reloc_max = (int)s->pRelocs->size();
-			}
+		}
+		if (s->type != ST_REMOVED) {
+			image_size += sizeof(OMFSegHdr) + 10 + 1 + 255 + 5 + s->size() + 1;
+			if (s->pRelocs) { image_size += s->pRelocs->size() * 15; }
 		}
 	}
 
-	// reloc_max needs to greater than zero
-	if (reloc_max<1) { return ERROR_ABORTED; }
-
 	for (std::vector<int>::iterator i = SegNum.begin(); i!=SegNum.end(); ++i) {
 		SegLookup[*i] = (int)(&*i-&SegNum[0]);
 	}
-	uint8_t *instructions = (uint8_t*)malloc(reloc_max * 16);
-	if (!instructions) { return ERROR_OUT_OF_MEMORY; }
-	
-	// open a file for writing
-	FILE *f = fopen(strown<512>(filename).c_str(), "wb");
-	if (!f) {
-		free(instructions);
-		return ERROR_CANT_WRITE_TO_FILE;
-	}
 
-	// consume all the relocs
+	OMFImage image;
+	if (!image.Reserve(image_size + sizeof(OMFSegHdr) + 10 + 1 + 7 + 1)) { return ERROR_OUT_OF_MEMORY; }
+
 	struct OMFSegHdr hdr = { 0 };	// initialize segment header
 	hdr.NumLen[0] = 4;		// numbers are 4 bytes under GS OS
 	hdr.Version[0] = 2;		// version is 2 for GS OS
@@ -6736,17 +9471,57 @@ StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 	memset(segfile, ' ', 10);
 	memcpy(segfile, fileBase.get(), fileBase.get_len() > 10 ? 10 : fileBase.get_len());
 
+	std::vector<int> superType;	// SUPER subtype of each reloc or -1
+	std::vector<int> bucketed;	// reloc indices grouped by subtype in offset order
 	for (std::vector<int>::iterator i = SegNum.begin(); i != SegNum.end(); ++i) {
 		Section &s = allSections[*i];
 		strref segName = s.name ? s.name : (s.type == ST_CODE ? strref("CODE") : strref("DATA"));
+		int numRelocs = s.pRelocs ? (int)s.pRelocs->size() : 0;
+		const Reloc *relocs = numRelocs ? &(*s.pRelocs)[0] : nullptr;
+
+		// group the relocs by SUPER subtype, the relocs are already in offset order
+		int bucket[OMFS_TYPES + 1] = { 0 };
+		superType.resize(numRelocs);
+		bucketed.resize(numRelocs);
+		for (int r = 0; r < numRelocs; r++) {
+			const Reloc &rel = relocs[r];
+			int segnum = rel.target_section >= 0 ? SegLookup[rel.target_section] + 1 : 0;
+			superType[r] = OMFSuperType(rel, rel.target_section == *i, segnum);
+			if (superType[r] >= 0) { bucket[superType[r] + 1]++; }
+		}
+		for (int t = 0; t < OMFS_TYPES; t++) { bucket[t + 1] += bucket[t]; }
+		int fill[OMFS_TYPES];
+		memcpy(fill, bucket, sizeof(fill));
+		for (int r = 0; r < numRelocs; r++) {
+			if (superType[r] >= 0) { bucketed[fill[superType[r]]++] = r; }
+		}
+
+		// use a SUPER record for each subtype if that is smaller than separate records
+		int superSize[OMFS_TYPES] = { 0 };
+		for (int t = 0; t < OMFS_TYPES; t++) {
+			int first = bucket[t], count = bucket[t + 1] - bucket[t];
+			if (!count) { continue; }
+			int separate = 0;
+			for (int b = first; b < (first + count); b++)
+				separate += OMFRelocSize(relocs[bucketed[b]], t <= OMFS_RELOC3);
+			superSize[t] = OMFWriteSuper(nullptr, t, relocs, &bucketed[first], count);
+			if (!superSize[t] || superSize[t] >= separate) {
+				superSize[t] = 0;
+				for (int b = first; b < (first + count); b++) { superType[bucketed[b]] = -1; }
+			}
+		}
 
-		// support zero bytes at end of block
-		int num_zeroes_at_end = s.addr_size() - s.size();
+		// support zero bytes at end of block, the loader reads SUPER reloc values from the binary
 		int num_bytes_file = s.size();
-		while (num_bytes_file && s.output[num_bytes_file - 1] == 0) {
-			num_zeroes_at_end++;
-			num_bytes_file--;
+		while (num_bytes_file && s.output[num_bytes_file - 1] == 0) { num_bytes_file--; }
+		for (int r = 0; r < numRelocs; r++) {
+			const Reloc &rel = relocs[r];
+			if (superType[r] >= 0 && (rel.section_offset + rel.bytes) > num_bytes_file &&
+				OMFSuperPatch(rel, superType[r], SegLookup[rel.target_section] + 1))
+				num_bytes_file = rel.section_offset + rel.bytes;
 		}
+		if (num_bytes_file > (int)s.size()) { num_bytes_file = (int)s.size(); }
+		int num_zeroes_at_end = s.addr_size() - num_bytes_file;
 
 		_writeNBytes(hdr.SegNum, 2, SegLookup[*i] + 1);
 		_writeNBytes(hdr.Kind, 2, s.type == ST_CODE ? 0x1000 : (s.type == ST_ZEROPAGE ? 0x12 : 0x1001));
@@ -6754,99 +9529,80 @@ StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 		_writeNBytes(hdr.Length, 4, num_bytes_file + num_zeroes_at_end);
 		_writeNBytes(hdr.ResSpc, 4, num_zeroes_at_end);
 		_writeNBytes(hdr.Align, 4, s.align_address > 1 ? 256 : 0);
-		// instruction list starts with a LCONST + Length(4) + binary, the relocs begin after that
-		int instruction_offs = 0;
-		instructions[instruction_offs++] = OMFR_LCONST;
-		_writeNBytes(instructions+instruction_offs, 4, num_bytes_file);
-		instruction_offs += 4;
-		if (s.pRelocs && s.pRelocs->size()) {
-			// insert all SUPER_RELOC2 / SUPER_RELOC3
-			for (int b = 0; b <= 1; b++) {
-				int count_offs = -1;
-				int prev_page = 0;
-				int inst_curr = instruction_offs;
-				instructions[inst_curr++] = OMFR_SUPER;
-				int len_offs = inst_curr;
-				inst_curr += 4;
-				instructions[inst_curr++] = (uint8_t)b;	// SUPER_RELOC2 / SUPER_RELOC3
-				// try all SUPER_RELOC2 (2 bytes self reference, no shift)
-				relocList::iterator r = s.pRelocs->begin();
-				while (r != s.pRelocs->end()) {
-					if (r->shift == 0 && r->bytes == (b+2) && r->target_section == SectionId(s)) {
-						if ((r->section_offset >> 8) != prev_page) {
-							instructions[inst_curr++] = uint8_t(0x80 | ((r->section_offset >> 8) - prev_page - 1));
-							count_offs = -1;
-						}	// update patch counter for current page or add a new counter
-						if (count_offs < 0) {
-							count_offs = inst_curr;
-							instructions[inst_curr++] = 0;
-						} else
-							instructions[count_offs]++;
-						prev_page = r->section_offset>>8;
-						instructions[inst_curr++] = (uint8_t)r->section_offset;	// write patch offset into binary
-						_writeNBytes(s.output + r->section_offset, b + 2, r->base_value);	// patch binary with base value
-						r = s.pRelocs->erase(r);
-					} else
-						++r;
-				}
-				if (inst_curr > (instruction_offs + 6)) {
-					_writeNBytes(instructions + len_offs, 4, inst_curr - instruction_offs - 5);
-					instruction_offs = inst_curr;
-				}
-			}
-			// insert all other records as they are encountered
-			relocList::iterator r = s.pRelocs->begin();
-			while (r != s.pRelocs->end()) {
-				if (r->target_section == SectionId(s)) {
-					// this is a reloc, check if cRELOC is ok or if need RELOC
-					bool cRELOC = r->section_offset < 0x10000 && r->base_value < 0x10000;
-					instructions[instruction_offs++] = uint8_t(cRELOC ? OMFR_cRELOC : OMFR_RELOC);
-					instructions[instruction_offs++] = r->bytes;
-					instructions[instruction_offs++] = r->shift;
-					_writeNBytes(instructions + instruction_offs, cRELOC ? 2 : 4, r->section_offset);
-					instruction_offs += cRELOC ? 2 : 4;
-					_writeNBytes(instructions + instruction_offs, cRELOC ? 2 : 4, r->base_value);
-					instruction_offs += cRELOC ? 2 : 4;
-				} else {
-					// this is an interseg
-					bool cINTERSEG = r->section_offset < 0x10000 && r->base_value < 0x10000;
-					instructions[instruction_offs++] = uint8_t(cINTERSEG ? OMFR_cINTERSEG : OMFR_INTERSEG);
-					instructions[instruction_offs++] = r->bytes;
-					instructions[instruction_offs++] = r->shift;
-					_writeNBytes(instructions + instruction_offs, cINTERSEG ? 2 : 4, r->section_offset);
-					instruction_offs += cINTERSEG ? 2 : 4;
-					_writeNBytes(instructions + instruction_offs, cINTERSEG ? 0: 2 , 1);	// file number = 1
-					instruction_offs += cINTERSEG ? 0 : 2;
-					_writeNBytes(instructions + instruction_offs, cINTERSEG ? 1 : 2, SegLookup[r->target_section] + 1);	// segment number starting from 1
-					instruction_offs += cINTERSEG ? 1 : 2;
-					_writeNBytes(instructions + instruction_offs, cINTERSEG ? 2 : 4, r->base_value);
-					instruction_offs += cINTERSEG ? 2 : 4;
-				}
-				r = s.pRelocs->erase(r);
+		size_t seg_start = image.size;
+		uint8_t lenSegName = (uint8_t)segName.get_len();
+		image.Append(&hdr, sizeof(hdr));
+		image.Append(segfile, 10);
+		image.Append(&lenSegName, 1);
+		image.Append(segName.get(), segName.get_len());
+
+		// segment data is a LCONST + Length(4) + binary, the relocs begin after that
+		size_t data_start = image.size + 5;
+		if (num_bytes_file) {
+			uint8_t lconst[5] = { OMFR_LCONST };
+			_writeNBytes(lconst + 1, 4, num_bytes_file);
+			image.Append(lconst, 5);
+			image.Append(s.output, num_bytes_file);
+		}
+
+		// SUPER records, the loader adds the segment address to the value in the binary
+		for (int t = 0; t < OMFS_TYPES; t++) {
+			if (!superSize[t]) { continue; }
+			uint8_t *dest = image.Reserve(superSize[t]);
+			if (!dest) { return ERROR_OUT_OF_MEMORY; }
+			image.size += OMFWriteSuper(dest, t, relocs, &bucketed[bucket[t]], bucket[t + 1] - bucket[t]);
+			for (int b = bucket[t]; b < bucket[t + 1]; b++) {
+				const Reloc &r = relocs[bucketed[b]];
+				int patch = OMFSuperPatch(r, t, SegLookup[r.target_section] + 1);
+				for (int p = 0; p < r.bytes && (r.section_offset + p) < num_bytes_file; p++)
+					image.data[data_start + r.section_offset + p] = (uint8_t)(patch >> (8 * p));
 			}
 		}
-		instructions[instruction_offs++] = OMFR_END;
 
-		// size of seg = file header + 10 bytes file name + 1 byte seg name length + seg nameh + seg.addr_size() + instruction_size 
-		int segSize = sizeof(hdr) + 10 + 1 + (int)segName.get_len() + num_bytes_file + instruction_offs;
-		if (num_bytes_file==0) { segSize -= 5; }
-		_writeNBytes(hdr.SegTotal, 4, segSize);
-		uint8_t lenSegName = (uint8_t)segName.get_len();
-		fwrite(&hdr, sizeof(hdr), 1, f);
-		fwrite(segfile, 10, 1, f);
-		fwrite(&lenSegName, 1, 1, f);
-		fwrite(segName.get(), segName.get_len(), 1, f);
-		if (num_bytes_file) {
-			fwrite(instructions, 5, 1, f);	// $f2 + 4 bytes data size
-			fwrite(s.output, num_bytes_file, 1, f); // segment data
+		// insert all other records in offset order
+		for (int ri = 0; ri < numRelocs; ri++) {
+			if (superType[ri] >= 0) { continue; }
+			const Reloc *r = relocs + ri;
+			uint8_t *instructions = image.Reserve(15);
+			if (!instructions) { return ERROR_OUT_OF_MEMORY; }
+			int instruction_offs = 0;
+			if (r->target_section == *i) {
+				// this is a reloc, check if cRELOC is ok or if need RELOC
+				bool cRELOC = r->section_offset < 0x10000 && r->base_value < 0x10000;
+				instructions[instruction_offs++] = uint8_t(cRELOC ? OMFR_cRELOC : OMFR_RELOC);
+				instructions[instruction_offs++] = r->bytes;
+				instructions[instruction_offs++] = r->shift;
+				_writeNBytes(instructions + instruction_offs, cRELOC ? 2 : 4, r->section_offset);
+				instruction_offs += cRELOC ? 2 : 4;
+				_writeNBytes(instructions + instruction_offs, cRELOC ? 2 : 4, r->base_value);
+				instruction_offs += cRELOC ? 2 : 4;
+			} else {
+				// this is an interseg
+				bool cINTERSEG = r->section_offset < 0x10000 && r->base_value < 0x10000;
+				instructions[instruction_offs++] = uint8_t(cINTERSEG ? OMFR_cINTERSEG : OMFR_INTERSEG);
+				instructions[instruction_offs++] = r->bytes;
+				instructions[instruction_offs++] = r->shift;
+				_writeNBytes(instructions + instruction_offs, cINTERSEG ? 2 : 4, r->section_offset);
+				instruction_offs += cINTERSEG ? 2 : 4;
+				_writeNBytes(instructions + instruction_offs, cINTERSEG ? 0: 2 , 1);	// file number = 1
+				instruction_offs += cINTERSEG ? 0 : 2;
+				_writeNBytes(instructions + instruction_offs, cINTERSEG ? 1 : 2, SegLookup[r->target_section] + 1);	// segment number starting from 1
+				instruction_offs += cINTERSEG ? 1 : 2;
+				_writeNBytes(instructions + instruction_offs, cINTERSEG ? 2 : 4, r->base_value);
+				instruction_offs += cINTERSEG ? 2 : 4;
+			}
+			image.size += instruction_offs;
 		}
-		if (instruction_offs > 5)
-			fwrite(instructions + 5, instruction_offs - 5, 1, f); // reloc instructions
+		uint8_t end = OMFR_END;
+		if (!image.Append(&end, 1)) { return ERROR_OUT_OF_MEMORY; }
+
+		// size of seg = file header + 10 bytes file name + 1 byte seg name length + seg name + data + instructions
+		_writeNBytes(image.data + seg_start, 4, (int)(image.size - seg_start));
 	}
 	// if there is a size of the direct page & stack, write it
 	if (DP_Stack_Size) {
 		strref segName("DPStack");
-		char lenSegName = (char)segName.get_len();
+		uint8_t lenSegName = (uint8_t)segName.get_len();
 		_writeNBytes(hdr.SegNum, 2, (int)SegNum.size()+1);
 		_writeNBytes(hdr.Kind, 2, 0x12);
 		_writeNBytes(hdr.DispDataOffset, 2, sizeof(hdr) + 10 + 1 + (int)segName.get_len());
@@ -6855,44 +9611,306 @@ StatusCode Asm::WriteA2GS_OMF(strref filename, bool full_collapse) {
 		_writeNBytes(hdr.Align, 4, 256);
 		int segSize = sizeof(hdr) + 10 + 1 + (int)segName.get_len() + 1;
 		_writeNBytes(hdr.SegTotal, 4, segSize);
-		instructions[0] = 0;
-		fwrite(&hdr, sizeof(hdr), 1, f);
-		fwrite(segfile, 10, 1, f);
-		fwrite(&lenSegName, 1, 1, f);
-		fwrite(segName.get(), segName.get_len(), 1, f);
-		fwrite(instructions, 1, 1, f); // end instruction
+		uint8_t end = OMFR_END;
+		image.Append(&hdr, sizeof(hdr));
+		image.Append(segfile, 10);
+		image.Append(&lenSegName, 1);
+		image.Append(segName.get(), segName.get_len());
+		image.Append(&end, 1);	// end instruction
+	}
+
+	// open a file for writing
+	FILE *f = fopen(strown<512>(filename).c_str(), "wb");
+	if (!f) { return ERROR_CANT_WRITE_TO_FILE; }
+	bool written = fwrite(image.data, image.size, 1, f) == 1;
+	fclose(f);
+	return written ? STATUS_OK : ERROR_CANT_WRITE_TO_FILE;
+}
+
+// Builds and writes the laid out export binaries, one export per job
+struct ExportWriter {
+	const Asm *assembler;
+	const ExportLayout *layouts;
+	strown<512> *files;
+	bool load_header;
+	bool size_header;
+
+	void Run(int index) {
+		const ExportLayout &layout = layouts[index];
+		strown<512> &file = files[index];
+		int addr = layout.start_address;
+		int size_export = layout.end_address - layout.start_address;
+		if (uint8_t *buf = assembler->BuildExportImage(layout)) {
+			if (FILE *f = fopen(file.c_str(), "wb")) {
+				if (load_header) {
+					uint8_t load_addr[2] = { (uint8_t)addr, (uint8_t)(addr >> 8) };
+					fwrite(load_addr, 2, 1, f);
+				}
+				if (size_header) {
+					uint8_t byte_size[2] = { (uint8_t)size_export, (uint8_t)(size_export >> 8) };
+					fwrite(byte_size, 2, 1, f);
+				}
+				fwrite(buf, size_export, 1, f);
+				fclose(f);
+			}
+			free(buf);
+		}
+	}
+};
+
+//
+//
+// EMBEDDING INTERFACE (x65.h)
+//
+//
+
+struct X65State {
+	Asm assembler;
+	FileCache files;
+	std::vector<strref> exportNames;
+	std::vector<ExportLayout> layouts;
+
+	// strings passed in are copied and released on reset
+	strref Keep(const char *str) {
+		size_t len = strlen(str);
+		char *copy = (char*)malloc(len + 1);
+		memcpy(copy, str, len + 1);
+		assembler.loadedData.push_back(copy);
+		return strref(copy, (strl_t)len);
+	}
+};
+
+X65Assembler::X65Assembler() : state(new X65State) {
+	state->assembler.file_cache = &state->files;
+}
+
+X65Assembler::~X65Assembler() {
+	state->assembler.Cleanup();
+	delete state;
+}
+
+void X65Assembler::Reset() {
+	state->assembler.Reset();
+	state->exportNames.clear();
+	state->layouts.clear();
+}
+
+bool X65Assembler::SetCPU(const char *name) {
+	for (int c = 0; c<nCPUs; c++) {
+		if (strref(name).same_str(aCPUs[c].name)) {
+			state->assembler.SetCPU((CPUIndex)c);
+			return true;
+		}
+	}
+	return false;
+}
+
+void X65Assembler::SetMerlinSyntax(bool merlin) { state->assembler.syntax = merlin ? SYNTAX_MERLIN : SYNTAX_SANE; }
+void X65Assembler::SetEndMacroDirective(bool endm) { state->assembler.end_macro_directive = endm; }
+void X65Assembler::SetDefaultOrg(int address) { state->assembler.default_org = address; }
+void X65Assembler::AddIncludePath(const char *path) { state->assembler.AddIncludeFolder(state->Keep(path)); }
+
+void X65Assembler::Define(const char *label, const char *value) {
+	state->assembler.AssignLabel(state->Keep(label), state->Keep(value));
+}
+
+void X65Assembler::AddFile(const char *filename, const void *data, size_t size) {
+	state->files.AddFile(filename, data, size);
+}
+
+bool X65Assembler::Assemble(const char *source, size_t size, const char *filename, bool object_target) {
+	Asm &assembler = state->assembler;
+	char *copy = (char*)malloc(size ? size : 1);
+	memcpy(copy, source, size);
+	assembler.loadedData.push_back(copy);
+	assembler.Assemble(strref(copy, (strl_t)size), state->Keep(filename), object_target);
+	return !assembler.error_encountered;
+}
+
+bool X65Assembler::Link() {
+	Asm &assembler = state->assembler;
+	if (assembler.error_encountered) { return false; }
+	StatusCode err = assembler.LinkZP();
+	if (err > FIRST_ERROR) {
+		assembler.PrintError(strref(), err);
+		return false;
 	}
-	free(instructions);
-	fclose(f);
-	return STATUS_OK;
+	strref aAppendNames[MAX_EXPORT_FILES];
+	int numExportFiles = assembler.GetExportNames(aAppendNames, MAX_EXPORT_FILES);
+	assembler.PrepareExports();
+	state->exportNames.clear();
+	state->layouts.clear();
+	for (int e = 0; e < numExportFiles; e++) {
+		ExportLayout layout;
+		if (assembler.LayoutExport(aAppendNames[e], layout)) {
+			state->exportNames.push_back(aAppendNames[e]);
+			state->layouts.push_back(layout);
+		}
+	}
+	return !assembler.error_encountered;
 }
 
-int main(int argc, char **argv) {
+int X65Assembler::GetExportCount() const { return (int)state->layouts.size(); }
+
+const char* X65Assembler::GetExportName(int index, int &name_length) const {
+	if (index < 0 || index >= (int)state->exportNames.size()) { return nullptr; }
+	name_length = (int)state->exportNames[index].get_len();
+	return state->exportNames[index].get();
+}
+
+uint8_t* X65Assembler::Export(int index, size_t &size, int &address) {
+	if (index < 0 || index >= (int)state->layouts.size()) { return nullptr; }
+	const ExportLayout &layout = state->layouts[index];
+	size = (size_t)(layout.end_address - layout.start_address);
+	address = layout.start_address;
+	return state->assembler.BuildExportImage(layout);
+}
+
+int X65Assembler::GetSymbolCount() const { return (int)state->assembler.map.size(); }
+
+bool X65Assembler::GetSymbol(int index, X65Symbol &symbol) const {
+	const Asm &assembler = state->assembler;
+	if (index < 0 || index >= (int)assembler.map.size()) { return false; }
+	const MapSymbol &sym = assembler.map[index];
+	symbol.name = sym.name.get();
+	symbol.name_length = (int)sym.name.get_len();
+	symbol.value = sym.value;
+	symbol.section = sym.section;
+	symbol.local = sym.local;
+	if (size_t(sym.section) < assembler.allSections.size()) { symbol.value += assembler.allSections[sym.section].start_address; }
+	return true;
+}
+
+int X65Assembler::GetSectionCount() const { return (int)state->assembler.allSections.size(); }
+
+bool X65Assembler::GetSection(int index, X65Section &section) const {
+	const Asm &assembler = state->assembler;
+	if (index < 0 || index >= (int)assembler.allSections.size()) { return false; }
+	const Section &s = assembler.allSections[index];
+	section.name = s.name.get();
+	section.name_length = (int)s.name.get_len();
+	section.data = s.output;
+	section.size = s.size();
+	section.start_address = s.start_address;
+	section.end_address = s.address;
+	section.relative = s.IsRelativeSection();
+	section.dummy = s.IsDummySection();
+	return true;
+}
+
+bool X65Assembler::HasError() const { return state->assembler.error_encountered; }
+
+#ifndef X65_LIBRARY
+
+// Order of exported symbols
+enum SymbolSort {
+	SYM_SORT_SOURCE,		// order of definition
+	SYM_SORT_ADDRESS,
+	SYM_SORT_NAME,
+};
+
+// Arguments applied by ParseOptions, kept to apply them again for another pass
+struct OptionArgs {
+	int argc;
+	char **argv;
+};
+
+// Options for building one target from the command line or a batch manifest line
+struct BuildOptions {
+	const char *source_filename;
+	const char *obj_out_file;
+	const char *binary_out_name;
+	const char *sym_file;
+	const char *vs_file;
+	const char *batch_file;
+	const char *server_socket;
+	const char *client_socket;
+	const char *cache_dir;
+	const char *prefix_file;
+	const char *pch_file;
+	const char *dep_file;
+	const char *hashes_file;
+	const char *debug_file;
+	const char *symtab_file;
+	const char *sim_entry;
+	const char *sim_stop;
+	const char *profile_file;
+	uint64_t sim_max_cycles;
+	int client_arg;			// first argument to send to the server
+	uint64_t options_hash;	// hash of all arguments for the build cache
+	uint64_t state_hash;	// hash of arguments that change the assembler state for the prefix
+	strref list_file;
+	strref allinstr_file;
+	strref cycles_file;
+	std::vector<strref> link_objects;
+	SymbolSort sym_sort;
+	int num_threads;
+	bool load_header;
+	bool size_header;
+	bool info;
+	bool gen_allinstr;
+	bool cycle_report;
+	bool page_errors;
+	bool gs_os_reloc;
+	bool force_merge_sections;
+	bool link_only;
+	bool up_to_date_check;
+	bool watch;
+	bool quiet;				// options are applied again for another pass
+	std::vector<OptionArgs> option_args;	// arguments applied to the assembler
+	std::vector<FileRead> *files_read;		// receives the files read by the build
+	BuildOptions() : source_filename(nullptr), obj_out_file(nullptr), binary_out_name(nullptr),
+		sym_file(nullptr), vs_file(nullptr), batch_file(nullptr), server_socket(nullptr),
+		client_socket(nullptr), cache_dir(nullptr), prefix_file(nullptr), pch_file(nullptr), dep_file(nullptr), hashes_file(nullptr), debug_file(nullptr),
+		symtab_file(nullptr), sim_entry(nullptr), sim_stop(nullptr), profile_file(nullptr),
+		sim_max_cycles(100000000), client_arg(0),
+		options_hash(0), state_hash(0), sym_sort(SYM_SORT_SOURCE), num_threads(0), load_header(true),
+		size_header(false), info(false), gen_allinstr(false), cycle_report(false), page_errors(false), gs_os_reloc(false),
+		force_merge_sections(false), link_only(false), up_to_date_check(false), watch(false), quiet(false),
+		files_read(nullptr) {}
+};
+
+// Apply command line options to the assembler and build options,
+// returns -1 to continue or an exit code.
+static int ParseOptions(int argc, char **argv, Asm &assembler, BuildOptions &opt) {
+	OptionArgs args = { argc, argv };
+	opt.option_args.push_back(args);
 	const strref listing("lst");
 	const strref allinstr("opcodes");
+	const strref cycles("cycles");
 	const strref endmacro("endm");
 	const strref cpu("cpu");
 	const strref acc("acc");
 	const strref xy("xy");
 	const strref org("org");
-	int return_value = 0;
-	bool load_header = true;
-	bool size_header = false;
-	bool info = false;
-	bool gen_allinstr = false;
-	bool gs_os_reloc = false;
-	bool force_merge_sections = false;
-	Asm assembler;
-
-	const char *source_filename = nullptr, *obj_out_file = nullptr;
-	const char *binary_out_name = nullptr;
-	const char *sym_file = nullptr, *vs_file = nullptr;
-	strref list_file, allinstr_file;
-	for (int a = 1; a<argc; a++) {
+	const strref threads("threads");
+	const strref cache("cache");
+	const strref prefix("prefix");
+	const strref pch("pch");
+	const strref symsort("symsort");
+	const strref sim("sim");
+	const strref simstop("simstop");
+	const strref simcycles("simcycles");
+	for (int a = 0; a<argc; a++) {
+		// the length separates the arguments in the hash
+		opt.options_hash = strref(argv[a]).fnv1a_64(opt.options_hash ^ (uint64_t)strlen(argv[a]));
 		if (argv[a][0]=='-') {
 			strref arg(argv[a]+1);
+			// options that define labels or change how the prefix is assembled
+			if (arg.get_first()=='i' || ((arg.get_first()=='D' || arg.get_first()=='d') && !arg.same_str("dep") && !arg.same_str("dbg")) || arg.same_str("merlin") ||
+				arg.same_str(endmacro) || arg.has_prefix(cpu) || arg.has_prefix(acc) || arg.has_prefix(xy) ||
+				arg.has_prefix(org) || arg.same_str("a2b") || arg.same_str("a2p") || arg.has_prefix(prefix))
+				opt.state_hash = arg.fnv1a_64(opt.state_hash ^ (uint64_t)arg.get_len());
 			if (arg.get_first()=='i') { assembler.AddIncludeFolder(arg+1); }
 			else if (arg.same_str("merlin")) { assembler.syntax = SYNTAX_MERLIN; }
+			else if (arg.same_str("dep")&&(a+1)<argc) { opt.dep_file = argv[++a]; }
+			else if (arg.same_str("hashes")&&(a+1)<argc) { opt.hashes_file = argv[++a]; }
+			else if (arg.same_str("dbg")&&(a+1)<argc) {
+				opt.debug_file = argv[++a];
+				assembler.debug_info = true;
+			}
+			else if (arg.same_str("uptodate")) { opt.up_to_date_check = true; }
+			else if (arg.same_str("watch")) { opt.watch = true; }
 			else if (arg.get_first()=='D'||arg.get_first()=='d') {
 				++arg;
 				if (arg.find('=')>0) {
@@ -6901,33 +9919,39 @@ int main(int argc, char **argv) {
 					assembler.AssignLabel(arg, "1");
 				}
 			} else if (arg.same_str("c64")) {
-				load_header = true;
-				size_header = false;
+				opt.load_header = true;
+				opt.size_header = false;
 			} else if (arg.same_str("a2b")) {
 				assembler.default_org = 0x0803;
-				load_header = true;
-				size_header = true;
+				opt.load_header = true;
+				opt.size_header = true;
 			} else if (arg.same_str("bin")) {
-				load_header = false;
-				size_header = false;
+				opt.load_header = false;
+				opt.size_header = false;
 			} else if (arg.same_str("a2p")) {
 				assembler.default_org = 0x2000;
-				load_header = false;
-				size_header = false;
+				opt.load_header = false;
+				opt.size_header = false;
 			} else if (arg.same_str("a2o")) {
-				gs_os_reloc = true;
+				opt.gs_os_reloc = true;
 			} else if (arg.same_str("mrg")) {
-				force_merge_sections = true;
+				opt.force_merge_sections = true;
 			} else if (arg.same_str("sect")) {
-				info = true;
+				opt.info = true;
 			} else if (arg.same_str(endmacro)) {
 				assembler.end_macro_directive = true;
 			} else if (arg.has_prefix(listing)&&(arg.get_len()==listing.get_len()||arg[listing.get_len()]=='=')) {
 				assembler.list_assembly = true;
-				list_file = arg.after('=');
+				opt.list_file = arg.after('=');
+			} else if (arg.has_prefix(cycles)&&(arg.get_len()==cycles.get_len()||arg[cycles.get_len()]=='=')) {
+				opt.cycle_report = true;
+				opt.cycles_file = arg.after('=');
+				assembler.debug_info = true;
+			} else if (arg.same_str("pageerr")) {
+				opt.page_errors = true;
 			} else if (arg.has_prefix(allinstr)&&(arg.get_len()==allinstr.get_len()||arg[allinstr.get_len()]=='=')) {
-				gen_allinstr = true;
-				allinstr_file = arg.after('=');
+				opt.gen_allinstr = true;
+				opt.allinstr_file = arg.after('=');
 			} else if (arg.has_prefix(org)) {
 				arg = arg.after('=');
 				if (arg && arg.get_first()=='$' && arg.get_len()>1) {
@@ -6935,6 +9959,14 @@ int main(int argc, char **argv) {
 				} else if (arg.is_number()) { assembler.default_org = (int)arg.atoi(); }
 				// force the current section to be org'd
 				assembler.AssignAddressToSection(assembler.SectionId(), assembler.default_org);
+			} else if (arg.has_prefix(cache)&&arg[cache.get_len()]=='=') {
+				opt.cache_dir = argv[a] + 2 + cache.get_len();
+			} else if (arg.has_prefix(prefix)&&arg[prefix.get_len()]=='=') {
+				opt.prefix_file = argv[a] + 2 + prefix.get_len();
+			} else if (arg.has_prefix(pch)&&arg[pch.get_len()]=='=') {
+				opt.pch_file = argv[a] + 2 + pch.get_len();
+			} else if (arg.has_prefix(threads)&&arg[threads.get_len()]=='=') {
+				opt.num_threads = arg.after('=').atoi();
 			} else if (arg.has_prefix(acc)&&arg[acc.get_len()]=='=') {
 				assembler.accumulator_16bit = arg.after('=').atoi()==16;
 			} else if (arg.has_prefix(xy)&&arg[xy.get_len()]=='=') {
@@ -6956,108 +9988,615 @@ int main(int argc, char **argv) {
 					return 1;
 				}
 				if (!arg) { return 0; }
+			} else if (arg.has_prefix(sim)&&arg[sim.get_len()]=='=') {
+				opt.sim_entry = argv[a] + 2 + sim.get_len();
+			} else if (arg.has_prefix(simstop)&&arg[simstop.get_len()]=='=') {
+				opt.sim_stop = argv[a] + 2 + simstop.get_len();
+			} else if (arg.has_prefix(simcycles)&&arg[simcycles.get_len()]=='=') {
+				opt.sim_max_cycles = (uint64_t)strtoull(argv[a] + 2 + simcycles.get_len(), nullptr, 10);
+			} else if (arg.same_str("profile")&&(a+1)<argc) {
+				opt.profile_file = argv[++a];
+				assembler.debug_info = true;
 			} else if (arg.same_str("sym")&&(a+1)<argc) {
-				sym_file = argv[++a];
+				opt.sym_file = argv[++a];
+			} else if (arg.same_str("symtab")&&(a+1)<argc) {
+				opt.symtab_file = argv[++a];
+			} else if (arg.has_prefix(symsort)&&arg[symsort.get_len()]=='=') {
+				strref order = arg.after('=');
+				if (order.same_str("addr")) { opt.sym_sort = SYM_SORT_ADDRESS; }
+				else if (order.same_str("name")) { opt.sym_sort = SYM_SORT_NAME; }
+				else { opt.sym_sort = SYM_SORT_SOURCE; }
 			} else if (arg.same_str("obj")&&(a+1)<argc) {
-				obj_out_file = argv[++a];
+				opt.obj_out_file = argv[++a];
+			} else if (arg.same_str("batch")&&(a+1)<argc) {
+				opt.batch_file = argv[++a];
+			} else if (arg.same_str("server")&&(a+1)<argc) {
+				opt.server_socket = argv[++a];
+			} else if (arg.same_str("client")&&(a+1)<argc) {
+				opt.client_socket = argv[++a];
+				opt.client_arg = a+1;	// remaining arguments are sent to the server
+				break;
+			} else if (arg.same_str("link")) {
+				opt.link_only = true;
+			} else if (arg.same_str("o")&&(a+1)<argc) {
+				opt.binary_out_name = argv[++a];
 			} else if (arg.same_str("vice")&&(a+1)<argc) {
-				vs_file = argv[++a];
-			} else { printf("Unexpected option " STRREF_FMT "\n", STRREF_ARG(arg)); }
-		} else if (!source_filename) { source_filename = argv[a]; }
-		else if (!binary_out_name) { binary_out_name = argv[a]; }
+				opt.vs_file = argv[++a];
+			} else if (arg.same_str("zpopt")) {
+				assembler.zp_optimize = true;
+			} else if (arg.same_str("relax")) {
+				assembler.relax_branches = true;
+			} else if (!opt.quiet) { printf("Unexpected option " STRREF_FMT "\n", STRREF_ARG(arg)); }
+		} else if (opt.link_only) { opt.link_objects.push_back(strref(argv[a])); }
+		else if (!opt.source_filename) { opt.source_filename = argv[a]; }
+		else if (!opt.binary_out_name) { opt.binary_out_name = argv[a]; }
+	}
+	return -1;
+}
+
+// Symbol as exported to .sym, vice and binary symbol files
+struct ExportSymbol {
+	strref name;
+	strref scope;		// global symbol that a local symbol belongs to
+	uint32_t hash;		// fnv1a of name
+	int value;			// address including section start
+	int section;
+	int order;			// index of the first definition
+	bool local;
+	// the global symbol of the scope for sorting, locals stay with their global
+	strref group_name;
+	int group_value;
+	int group_order;
+};
+
+// Sort to find duplicates, by name, then scope then definition order
+struct ExportSymbolSame {
+	bool operator()(const ExportSymbol &a, const ExportSymbol &b) const {
+		if (a.hash != b.hash) { return a.hash < b.hash; }
+		if (a.local != b.local) { return b.local; }
+		if (!a.name.same_str_case(b.name)) { return a.name < b.name; }
+		if (!a.scope.same_str_case(b.scope)) { return a.scope < b.scope; }
+		return a.order < b.order;
 	}
-	for (int a = 1; a < argc; a++) {
-		strref arg(argv[a]);
-		printf(STRREF_FMT "\n", STRREF_ARG(arg));
+};
+
+// Sort the scopes by the global symbol, then the global symbol before the locals
+struct ExportSymbolOrder {
+	SymbolSort sort;
+	bool before(strref name_a, int value_a, int order_a, strref name_b, int value_b, int order_b) const {
+		if (sort == SYM_SORT_ADDRESS && value_a != value_b) { return value_a < value_b; }
+		if (sort == SYM_SORT_NAME && !name_a.same_str_case(name_b)) { return name_a < name_b; }
+		return order_a < order_b;
 	}
-	if (gen_allinstr) {
-		assembler.AllOpcodes(allinstr_file);
-	} else if (!source_filename) {
-		puts("Usage:\n"
-			 " x65 filename.s code.prg [options]\n"
-			 "  * -i(path) : Add include path\n"
-			 "  * -D(label)[=value] : Define a label with an optional value (otherwise defined as 1)\n"
-			 "  * -cpu=6502/65c02/65c02wdc/65816: assemble with opcodes for a different cpu\n"
-			 "  * -acc=8/16: set the accumulator mode for 65816 at start, default is 8 bits\n"
-			 "  * -xy=8/16: set the index register mode for 65816 at start, default is 8 bits\n"
-			 "  * -org = $2000 or - org = 4096: force fixed address code at address\n"
-			 "  * -obj (file.x65) : generate object file for later linking\n"
-			 "  * -bin : Raw binary\n"
-			 "  * -c64 : Include load address(default)\n"
-			 "  * -a2b : Apple II Dos 3.3 Binary\n"
-			 "  * -a2p : Apple II ProDos Binary\n"
-			 "  * -a2o : Apple II GS OS executable (relocatable)\n"
-			 "  * -mrg : Force merge all sections (use with -a2o)\n"
-			 "  * -sym (file.sym) : symbol file\n"
-			 "  * -lst / -lst = (file.lst) : generate disassembly text from result(file or stdout)\n"
-			 "  * -opcodes / -opcodes = (file.s) : dump all available opcodes(file or stdout)\n"
-			 "  * -sect: display sections loaded and built\n"
-			 "  * -vice (file.vs) : export a vice symbol file\n"
-			 "  * -merlin: use Merlin syntax\n"
-			 "  * -endm : macros end with endm or endmacro instead of scoped('{' - '}')\n");
-		return 0;
+	bool operator()(const ExportSymbol &a, const ExportSymbol &b) const {
+		if (a.group_order != b.group_order) {
+			return before(a.group_name, a.group_value, a.group_order, b.group_name, b.group_value, b.group_order);
+		}
+		if (a.local != b.local) { return b.local; }
+		return before(a.name, a.value, a.order, b.name, b.value, b.order);
+	}
+};
+
+// Collect the symbols of the map with one entry per name and scope, each symbol
+// keeps the position of the first definition and the last assigned value
+static void GatherExportSymbols(Asm &assembler, std::vector<ExportSymbol> &symbols, SymbolSort sort) {
+	symbols.clear();
+	symbols.reserve(assembler.map.size());
+	strref scope;
+	for (size_t i = 0, n = assembler.map.size(); i < n; ++i) {
+		const MapSymbol &m = assembler.map[i];
+		ExportSymbol sym;
+		sym.name = m.name;
+		sym.hash = m.name.fnv1a();
+		sym.value = m.value;
+		if (size_t(m.section) < assembler.allSections.size()) { sym.value += assembler.allSections[m.section].start_address; }
+		sym.section = m.section;
+		sym.order = (int)i;
+		sym.local = m.local;
+		if (!m.local) { scope = m.name; }
+		sym.scope = m.local ? scope : strref();
+		symbols.push_back(sym);
+	}
+	if (symbols.empty()) { return; }
+
+	std::sort(symbols.begin(), symbols.end(), ExportSymbolSame());
+	size_t count = 0;
+	for (size_t i = 0, n = symbols.size(); i < n; ++i) {
+		if (count && symbols[count-1].hash == symbols[i].hash && symbols[count-1].local == symbols[i].local &&
+			symbols[count-1].name.same_str_case(symbols[i].name) && symbols[count-1].scope.same_str_case(symbols[i].scope)) {
+			symbols[count-1].value = symbols[i].value;
+			symbols[count-1].section = symbols[i].section;
+		} else { symbols[count++] = symbols[i]; }
+	}
+	symbols.resize(count);
+
+	// globals are unique now, find the global of each local by the hash of the scope
+	pairArray<uint32_t, int> globals;
+	globals.reserve((uint32_t)count);
+	for (size_t i = 0; i < count; ++i) {
+		if (!symbols[i].local) {
+			uint32_t index = FindLabelIndex(symbols[i].hash, globals.getKeys(), globals.count());
+			globals.insert(index, symbols[i].hash);
+			globals.getValue(index) = (int)i;
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		ExportSymbol &sym = symbols[i];
+		int head = sym.local ? -1 : (int)i;
+		if (sym.local && sym.scope) {
+			uint32_t hash = sym.scope.fnv1a();
+			for (uint32_t g = FindLabelIndex(hash, globals.getKeys(), globals.count());
+				 g < globals.count() && globals.getKey(g) == hash; ++g) {
+				if (symbols[globals.getValue(g)].name.same_str_case(sym.scope)) { head = globals.getValue(g); break; }
+			}
+		}
+		sym.group_name = head >= 0 ? symbols[head].name : strref();
+		sym.group_value = head >= 0 ? symbols[head].value : -1;
+		sym.group_order = head >= 0 ? symbols[head].order : -1;
+	}
+	ExportSymbolOrder order = { sort };
+	std::sort(symbols.begin(), symbols.end(), order);
+	globals.clear();
+}
+
+// .sym file with locals in braces after their global symbol
+static bool WriteSymFile(const char *filename, const std::vector<ExportSymbol> &symbols) {
+	FILE *f = fopen(filename, "w");
+	if (!f) { return false; }
+	TextBuffer output(f);
+	strown<512> line;
+	bool wasLocal = false;
+	for (std::vector<ExportSymbol>::const_iterator i = symbols.begin(); i != symbols.end(); ++i) {
+		line.sprintf("%s.label " STRREF_FMT " = $%04x", wasLocal==i->local ? "\n" :
+			(i->local ? " {\n" : "\n}\n"), STRREF_ARG(i->name), (uint32_t)i->value);
+		output.append(line.get_strref());
+		wasLocal = i->local;
+	}
+	output.append(strref(wasLocal ? "\n}\n" : "\n"));
+	output.flush();
+	fclose(f);
+	return true;
+}
+
+// Vice monitor commands, a label named debugbreak sets a breakpoint
+static bool WriteViceFile(const char *filename, const std::vector<ExportSymbol> &symbols) {
+	FILE *f = fopen(filename, "w");
+	if (!f) { return false; }
+	TextBuffer output(f);
+	strown<512> line;
+	for (std::vector<ExportSymbol>::const_iterator i = symbols.begin(); i != symbols.end(); ++i) {
+		if (i->name.same_str("debugbreak")) {
+			line.sprintf("break $%04x", (uint32_t)i->value);
+		} else {
+			line.sprintf("al $%04x %s" STRREF_FMT, (uint32_t)i->value, i->name[0]=='.' ? "" : ".",
+				STRREF_ARG(i->name));
+		}
+		output.line(line.get_strref());
+	}
+	output.flush();
+	fclose(f);
+	return true;
+}
+
+// Binary symbol table, symbols are sorted by address for lookup by address and
+// a hash table of name hashes chains symbols with the same bucket for lookup by name.
+struct SymTabHeader {
+	char id[4];				// 'x65s'
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t symbols;
+	uint32_t buckets;		// power of two
+	uint32_t stringdata;
+};
+
+struct SymTabSymbol {
+	uint32_t hash;			// fnv1a of name
+	uint32_t name;			// offset in string data
+	uint32_t scope;			// offset in string data of global symbol for locals or ~0
+	int32_t value;
+	int16_t section;		// -1 if not relative
+	uint8_t local;
+	uint8_t reserved;
+	uint32_t next;			// next symbol in the same bucket or ~0
+};
+
+struct ExportSymbolAddress {
+	bool operator()(const ExportSymbol &a, const ExportSymbol &b) const {
+		return a.value != b.value ? a.value < b.value : a.order < b.order;
+	}
+};
+
+static bool WriteSymbolTable(const char *filename, const std::vector<ExportSymbol> &symbols) {
+	struct SymTabHeader hdr;
+	memcpy(hdr.id, "x65s", 4);
+	hdr.version = 1;
+	hdr.reserved = 0;
+	hdr.symbols = (uint32_t)symbols.size();
+	hdr.buckets = 16;
+	while (hdr.buckets < hdr.symbols) { hdr.buckets <<= 1; }
+	hdr.stringdata = 0;
+
+	// symbols are stored in address order, names are zero terminated and shared
+	std::vector<ExportSymbol> sorted(symbols);
+	std::sort(sorted.begin(), sorted.end(), ExportSymbolAddress());
+
+	char *stringPool = nullptr;
+	uint32_t stringPoolCap = 0;
+	pairArray<uint32_t, int> stringArray;
+	stringArray.reserve(hdr.symbols * 2);
+	std::vector<SymTabSymbol> aSymbols(hdr.symbols);
+	std::vector<uint32_t> aBuckets(hdr.buckets, ~0u);
+	for (uint32_t i = hdr.symbols; i > 0; --i) {	// chains in address order
+		const ExportSymbol &sym = sorted[i-1];
+		SymTabSymbol &ss = aSymbols[i-1];
+		ss.hash = sym.hash;
+		ss.name = (uint32_t)_AddStrPool(sym.name, &stringArray, &stringPool, hdr.stringdata, stringPoolCap);
+		ss.scope = sym.local ? (uint32_t)_AddStrPool(sym.scope, &stringArray, &stringPool, hdr.stringdata, stringPoolCap) : ~0u;
+		ss.value = sym.value;
+		ss.section = (int16_t)sym.section;
+		ss.local = sym.local ? 1 : 0;
+		ss.reserved = 0;
+		uint32_t bucket = sym.hash & (hdr.buckets - 1);
+		ss.next = aBuckets[bucket];
+		aBuckets[bucket] = i-1;
+	}
+
+	bool ok = false;
+	if (FILE *f = fopen(filename, "wb")) {
+		fwrite(&hdr, sizeof(hdr), 1, f);
+		if (hdr.symbols) { fwrite(&aSymbols[0], sizeof(aSymbols[0]), hdr.symbols, f); }
+		fwrite(&aBuckets[0], sizeof(aBuckets[0]), hdr.buckets, f);
+		if (hdr.stringdata) { fwrite(stringPool, hdr.stringdata, 1, f); }
+		fclose(f);
+		ok = true;
+	}
+	if (stringPool) { free(stringPool); }
+	stringArray.clear();
+	return ok;
+}
+
+// Changing this invalidates all build cache entries
+#define BUILD_CACHE_VERSION 1
+
+// Hash of the contents of a file, false if it could not be read
+static bool HashFile(const char *filename, uint64_t &hash) {
+	size_t size;
+	char *data = ReadFileData(filename, size);
+	if (!data) { return false; }
+	hash = strref(data, (strl_t)size).fnv1a_64();
+	free(data);
+	return true;
+}
+
+static bool WriteFileData(const char *filename, const char *data, size_t size) {
+	if (FILE *f = fopen(filename, "wb")) {
+		bool ok = fwrite(data, size, 1, f) == 1 || !size;
+		fclose(f);
+		return ok;
+	}
+	return false;
+}
+
+// Build cache entries are found by a hash of the arguments, working directory and version of
+// x65. The entry lists the contents of every file read and written by the build and the
+// include paths that were searched without finding the file. Returns 0
+// for builds that write to stdout (info, listing or cycle report) and can't be cached.
+static uint64_t BuildCacheKey(Asm &assembler, BuildOptions &opt) {
+	if (opt.info || (assembler.list_assembly && !opt.list_file) || (opt.cycle_report && !opt.cycles_file)) { return 0; }
+	char cwd[1024];
+#ifdef _WIN32
+	if (!_getcwd(cwd, sizeof(cwd))) { cwd[0] = 0; }
+#else
+	if (!getcwd(cwd, sizeof(cwd))) { cwd[0] = 0; }
+#endif
+	strown<64> version;
+	version.sprintf("%d " __DATE__ " " __TIME__, BUILD_CACHE_VERSION);
+	uint64_t key = strref(cwd).fnv1a_64(opt.options_hash);
+	key = version.get_strref().fnv1a_64(key);
+	return key ? key : 1;
+}
+
+// Restore the outputs of a previous build if all the files it read are unchanged and
+// no file has been added where the build searched for one
+static bool FetchCachedBuild(const char *cache_dir, uint64_t key) {
+	strown<512> entry;
+	entry.sprintf("%s/%016" PRIx64 ".x65c", cache_dir, key);
+	size_t size;
+	char *data = ReadFileData(entry.c_str(), size);
+	if (!data) { return false; }
+	strref lines(data, (strl_t)size);
+
+	// each line is "in" or "out", a content hash and a file name, or "miss" and a file name
+	bool valid = true;
+	for (strref scan = lines; valid && scan;) {
+		strref line = scan.line();
+		if (line.get_word().same_str("in")) {
+			line.next_word_ws();
+			uint64_t hash = 0;
+			strown<512> name(line.after(' '));
+			valid = HashFile(name.c_str(), hash) && hash == strtoull(strown<32>(line.before(' ')).c_str(), nullptr, 16);
+		} else if (line.get_word().same_str("miss")) {
+			line.next_word_ws();
+			size_t file_size;
+			int64_t mtime;
+			valid = !GetFileStat(strown<512>(line).c_str(), file_size, mtime);
+		}
+	}
+	int restored = 0;
+	for (strref scan = lines; valid && scan;) {
+		strref line = scan.line();
+		if (line.get_word().same_str("out")) {
+			line.next_word_ws();
+			strown<512> blob;
+			blob.sprintf("%s/" STRREF_FMT ".out", cache_dir, STRREF_ARG(line.before(' ')));
+			strown<512> name(line.after(' '));
+			size_t blob_size;
+			if (char *blob_data = ReadFileData(blob.c_str(), blob_size)) {
+				valid = WriteFileData(name.c_str(), blob_data, blob_size);
+				free(blob_data);
+				restored++;
+			} else { valid = false; }
+		}
+	}
+	free(data);
+	if (valid) { printf("Build cache: restored %d files\n", restored); }
+	return valid;
+}
+
+// Store the outputs of a build along with the files it read
+static void StoreCachedBuild(const char *cache_dir, uint64_t key, Asm &assembler, std::vector<strref> &outputs) {
+	strown<512> entry;
+	entry.sprintf("%s/%016" PRIx64 ".x65c", cache_dir, key);
+	strown<512> temp(entry);
+	temp.append(".tmp");
+	FILE *f = fopen(temp.c_str(), "w");
+	if (!f) { return; }
+	for (std::vector<FileRead>::iterator i = assembler.filesRead.begin(); i != assembler.filesRead.end(); ++i)
+		fprintf(f, "in %016" PRIx64 " %s\n", i->hash, i->name.c_str());
+	for (std::vector<FileRead>::iterator i = assembler.filesMissing.begin(); i != assembler.filesMissing.end(); ++i)
+		fprintf(f, "miss %s\n", i->name.c_str());
+	bool valid = true;
+	for (std::vector<strref>::iterator o = outputs.begin(); valid && o != outputs.end(); ++o) {
+		strown<512> name(*o);
+		size_t size;
+		char *data = ReadFileData(name.c_str(), size);
+		if (!data) { valid = false; break; }
+		uint64_t hash = strref(data, (strl_t)size).fnv1a_64();
+		strown<512> blob;
+		blob.sprintf("%s/%016" PRIx64 ".out", cache_dir, hash);
+		struct stat st;
+		if (stat(blob.c_str(), &st) != 0) {	// identical outputs are stored once
+			strown<512> blob_temp(blob);
+			blob_temp.append(".tmp");
+			valid = WriteFileData(blob_temp.c_str(), data, size) && rename(blob_temp.c_str(), blob.c_str()) == 0;
+		}
+		free(data);
+		fprintf(f, "out %016" PRIx64 " %s\n", hash, name.c_str());
+	}
+	fclose(f);
+	remove(entry.c_str());
+	if (!valid || rename(temp.c_str(), entry.c_str()) != 0)
+		remove(temp.c_str());
+}
+
+// Append a file name to a depfile line, spaces are escaped for make and ninja
+static void AppendDepName(strown<8192> &line, strref name) {
+	while (name) {
+		char c = name.get_first();
+		if (c==' ' || c=='#') { line.append('\\'); }
+		else if (c=='$') { line.append('$'); }
+		line.append(c);
+		++name;
+	}
+}
+
+// Write a Makefile / Ninja compatible dependency file listing every file read by the build
+static bool WriteDepFile(const char *dep_file, const std::vector<strref> &outputs, const Asm &assembler) {
+	FILE *f = fopen(dep_file, "w");
+	if (!f) { return false; }
+	strown<8192> line;
+	for (std::vector<strref>::const_iterator o = outputs.begin(); o != outputs.end(); ++o) {
+		if (!*o) { continue; }	// listing to stdout
+		if (line) { line.append(' '); }
+		AppendDepName(line, *o);
+	}
+	line.append(':');
+	fputs(line.c_str(), f);
+	for (size_t i = 0; i < assembler.filesRead.size(); ++i) {
+		strref name = assembler.filesRead[i].name.get_strref();
+		bool listed = false;	// files are often read more than once
+		for (size_t j = 0; j < i && !listed; ++j)
+			listed = name.same_str_case(assembler.filesRead[j].name.get_strref());
+		if (!listed) {
+			line.copy(" \\\n  ");
+			AppendDepName(line, name);
+			fputs(line.c_str(), f);
+		}
+	}
+	fputs("\n", f);
+	fclose(f);
+	return true;
+}
+
+// Write the fnv1a 64 hash and size of each file written by the build, one line per file
+static bool WriteOutputHashes(const char *hashes_file, const std::vector<strref> &outputs) {
+	FILE *f = fopen(hashes_file, "w");
+	if (!f) { return false; }
+	bool valid = true;
+	for (std::vector<strref>::const_iterator o = outputs.begin(); valid && o != outputs.end(); ++o) {
+		if (!*o) { continue; }	// listing to stdout
+		strown<512> name(*o);
+		size_t size;
+		char *data = ReadFileData(name.c_str(), size);
+		if (!data) { valid = false; break; }
+		fprintf(f, "%016" PRIx64 " %8u %s\n", strref(data, (strl_t)size).fnv1a_64(), (unsigned int)size, name.c_str());
+		free(data);
+	}
+	fclose(f);
+	return valid;
+}
+
+// Compare the modification times of the targets and dependencies in an earlier depfile,
+// true if every target exists and is newer than every dependency
+static bool TargetsUpToDate(const char *dep_file, const BuildOptions &opt) {
+	size_t size, file_size;
+	int64_t oldest_target = INT64_MAX, newest_dep = 0, mtime;
+	char *data = ReadFileData(dep_file, size);
+	if (!data) { return false; }
+	bool up_to_date = true;
+	bool targets = true;
+	strref deps(data, (strl_t)size);
+	strown<512> name;
+	while (up_to_date && deps) {
+		deps.skip_whitespace();
+		name.clear();
+		while (deps && !strref::is_ws(deps.get_first())) {
+			char c = deps.get_first();
+			if (c=='\\' && deps.get_len()>1 && (deps[1]==' ' || deps[1]=='#' || deps[1]=='\n' || deps[1]=='\r')) {
+				++deps;
+				c = deps.get_first();
+				if (c=='\n' || c=='\r') { break; }	// line continuation
+			} else if (c=='$' && deps.get_len()>1 && deps[1]=='$') {
+				++deps;
+			} else if (c==':' && targets && (deps.get_len()==1 || strref::is_ws(deps[1]))) {
+				break;
+			}
+			name.append(c);
+			++deps;
+		}
+		if (name) {
+			if (!GetFileStat(name.c_str(), file_size, mtime)) { up_to_date = false; }
+			else if (targets && mtime < oldest_target) { oldest_target = mtime; }
+			else if (!targets && mtime > newest_dep) { newest_dep = mtime; }
+		}
+		if (deps.get_first()==':' && targets) {
+			targets = false;
+			++deps;
+		}
 	}
+	free(data);
+
+	// outputs requested on the command line must also exist
+	const char *aOutputs[] = { opt.binary_out_name, opt.obj_out_file, opt.sym_file, opt.vs_file };
+	for (size_t o = 0; o < sizeof(aOutputs)/sizeof(aOutputs[0]) && up_to_date; ++o) {
+		if (aOutputs[o] && !GetFileStat(aOutputs[o], file_size, mtime)) { up_to_date = false; }
+	}
+	return up_to_date && !targets && oldest_target > newest_dep;	// same time could be either order
+}
+
+// Assemble or link a target and write the requested output files
+static int BuildTarget(Asm &assembler, BuildOptions &opt) {
+	int return_value = 0;
+
+	// Load source or link object files
+	if (opt.source_filename || opt.link_objects.size()) {
+		if (opt.up_to_date_check && opt.dep_file && TargetsUpToDate(opt.dep_file, opt)) { return 0; }
+		uint64_t cache_key = opt.cache_dir ? BuildCacheKey(assembler, opt) : 0;
+		if (cache_key && FetchCachedBuild(opt.cache_dir, cache_key)) { return 0; }
+		assembler.hash_files_read = cache_key != 0 || opt.files_read;
+		std::vector<strref> outputs;		// files written by this build
+		strown<512> aExportFiles[MAX_EXPORT_FILES];
+		bool zp_linked = false;				// zero page sections were placed without errors
 
-	// Load source
-	if (source_filename) {
 		size_t size = 0;
-		strref srcname(source_filename);
+		strref srcname(opt.source_filename);
 		assembler.export_base_name =
-			strref(binary_out_name).after_last_or_full('/', '\\').before_or_full('.');
+			strref(opt.binary_out_name).after_last_or_full('/', '\\').before_or_full('.');
 
-		if (char *buffer = assembler.LoadText(srcname, size)) {
-			// if source_filename contains a path add that as a search path for include files
-			assembler.AddIncludeFolder(srcname.before_last('/', '\\'));
-			assembler.Assemble(strref(buffer, strl_t(size)), srcname, obj_out_file != nullptr);
+		char *buffer = nullptr;
+		if (opt.link_objects.size()) {
+			assembler.LinkObjectFiles(&opt.link_objects[0], (int)opt.link_objects.size(), opt.num_threads);
+		} else {
+			// zero page optimization and branch relaxation assemble the source again until the sizes settle
+			for (int pass = 1; (buffer = assembler.LoadText(srcname, size)) != nullptr; ++pass) {
+				// if source_filename contains a path add that as a search path for include files
+				assembler.AddIncludeFolder(srcname.before_last('/', '\\'));
+				assembler.final_pass = opt.obj_out_file || pass == MAX_OPTIMIZE_PASSES;	// object files are assembled once
+				assembler.hold_output = !assembler.final_pass && (assembler.zp_optimize || assembler.relax_branches);
+				if (opt.prefix_file) { assembler.AssemblePrefix(opt.prefix_file, opt.pch_file, opt.state_hash); }
+				if (!assembler.error_encountered) assembler.Assemble(strref(buffer, strl_t(size)), srcname, opt.obj_out_file != nullptr);
+				if (!(assembler.zp_optimize || assembler.relax_branches) || opt.obj_out_file || assembler.error_encountered ||
+					!assembler.UpdatePassSites()) {
+					assembler.ReleaseOutput();	// only the output of the final pass is shown
+					break;
+				}
+				if (pass == MAX_OPTIMIZE_PASSES) {
+					printf("ERROR: OPTIMIZATION DID NOT SETTLE IN %d PASSES\n", pass);
+					assembler.error_encountered = true;
+					break;
+				}
+				std::vector<ZPSite> sites;
+				std::vector<BranchSite> branches;
+				sites.swap(assembler.zpSites);
+				branches.swap(assembler.branchSites);
+				if (!assembler.file_cache) { assembler.loadedData.push_back(buffer); }
+				assembler.Reset();
+				BuildOptions pass_opt;
+				pass_opt.quiet = true;
+				for (std::vector<OptionArgs>::iterator a = opt.option_args.begin(); a != opt.option_args.end(); ++a)
+					ParseOptions(a->argc, a->argv, assembler, pass_opt);
+				assembler.zpSites.swap(sites);
+				assembler.branchSites.swap(branches);
+				assembler.hash_files_read = cache_key != 0 || opt.files_read;
+				assembler.export_base_name =
+					strref(opt.binary_out_name).after_last_or_full('/', '\\').before_or_full('.');
+			}
+			if (assembler.relax_branches && !assembler.error_encountered) { assembler.ListRelaxedBranches(); }
+		}
+		if (buffer || opt.link_objects.size()) {
 			if (assembler.error_encountered) {
 				return_value = 1;
 			} else {
 				// export object file (this can be done at the same time as building a binary)
-				if (obj_out_file) { assembler.WriteObjectFile(obj_out_file); }
+				if (opt.obj_out_file) {
+					assembler.WriteObjectFile(opt.obj_out_file);
+					outputs.push_back(strref(opt.obj_out_file));
+				}
 
 				// if exporting binary or relocatable executable, complete the build
-				if (binary_out_name && !srcname.same_str(binary_out_name)) {
-					if (gs_os_reloc)
-						assembler.WriteA2GS_OMF(binary_out_name, force_merge_sections);
-					else {
-						strref binout(binary_out_name);
+				if (opt.binary_out_name && !srcname.same_str(opt.binary_out_name)) {
+					if (opt.gs_os_reloc) {
+						zp_linked = assembler.WriteA2GS_OMF(opt.binary_out_name, opt.force_merge_sections) == STATUS_OK;
+						outputs.push_back(strref(opt.binary_out_name));
+					} else {
+						strref binout(opt.binary_out_name);
 						strref ext = binout.after_last('.');
 						if (ext) { binout.clip(ext.get_len()+1); }
 						strref aAppendNames[MAX_EXPORT_FILES];
 						StatusCode err = assembler.LinkZP();	// link zero page sections
+						zp_linked = err == STATUS_OK;
 						if (err > FIRST_ERROR) {
 							assembler.PrintError(strref(), err);
 							return_value = 1;
 						}
 						int numExportFiles = assembler.GetExportNames(aAppendNames, MAX_EXPORT_FILES);
+
+						// resolve addresses of all exports in order, then build and write the binaries concurrently
+						ExportLayout aLayouts[MAX_EXPORT_FILES];
+						int numLayouts = 0;
+						assembler.PrepareExports();
 						for (int e = 0; e < numExportFiles; e++) {
-							strown<512> file(binout);
-							file.append(aAppendNames[e]);
-							file.append('.');
-							file.append(ext);
-							int size_export;
-							int addr;
-							if (uint8_t *buf = assembler.BuildExport(aAppendNames[e], size_export, addr)) {
-								if (FILE *f = fopen(file.c_str(), "wb")) {
-									if (load_header) {
-										uint8_t load_addr[2] = { (uint8_t)addr, (uint8_t)(addr >> 8) };
-										fwrite(load_addr, 2, 1, f);
-									}
-									if (size_header) {
-										uint8_t byte_size[2] = { (uint8_t)size_export, (uint8_t)(size_export >> 8) };
-										fwrite(byte_size, 2, 1, f);
-									}
-									fwrite(buf, size_export, 1, f);
-									fclose(f);
-								}
-								free(buf);
+							if (assembler.LayoutExport(aAppendNames[e], aLayouts[numLayouts])) {
+								strown<512> &file = aExportFiles[numLayouts++];
+								file.copy(binout);
+								file.append(aAppendNames[e]);
+								file.append('.');
+								file.append(ext);
+								outputs.push_back(file.get_strref());
 							}
 						}
+						// page crossings within PAGECHECK are known once the addresses are assigned
+						if (assembler.PageCheck(opt.page_errors) && opt.page_errors) {
+							return_value = 1;
+							numLayouts = 0;
+						}
+						ExportWriter writer = { &assembler, aLayouts, aExportFiles, opt.load_header, opt.size_header };
+						ParallelFor(writer, numLayouts, opt.num_threads);
 					}
 				}
 
 				// print encountered sections info
-				if (info) {
+				if (opt.info) {
 					printf("SECTIONS SUMMARY\n================\n");
 					for (size_t i = 0; i < assembler.allSections.size(); ++i) {
 						Section &s = assembler.allSections[i];
@@ -7071,48 +10610,467 @@ int main(int argc, char **argv) {
 							}
 						}
 					}
+					for (size_t i = 0; zp_linked && i < assembler.allSections.size(); ++i) {
+						if (assembler.allSections[i].type == ST_ZEROPAGE) {
+							uint64_t used[4];
+							int blocks, largest;
+							assembler.ZeroPageUsed(used);
+							int free_bytes = ZeroPageFree(used, blocks, largest);
+							printf("Zero page: %d bytes free in %d blocks, largest %d\n", free_bytes, blocks, largest);
+							break;
+						}
+					}
 				}
 
 				// listing after export since addresses are now resolved
-				if (assembler.list_assembly)
-					assembler.List(list_file);
-
-				// export .sym file
-				if (sym_file && !srcname.same_str(sym_file) && !assembler.map.empty()) {
-					if (FILE *f = fopen(sym_file, "w")) {
-						bool wasLocal = false;
-						for (MapSymbolArray::iterator i = assembler.map.begin(); i!=assembler.map.end(); ++i) {
-							uint32_t value = (uint32_t)i->value;
-							if (size_t(i->section) < assembler.allSections.size()) { value += assembler.allSections[i->section].start_address; }
-							fprintf(f, "%s.label " STRREF_FMT " = $%04x", wasLocal==i->local ? "\n" :
-									(i->local ? " {\n" : "\n}\n"), STRREF_ARG(i->name), value);
-							wasLocal = i->local;
-						}
-						fputs(wasLocal ? "\n}\n" : "\n", f);
-						fclose(f);
+				if (assembler.list_assembly) {
+					assembler.List(opt.list_file, opt.num_threads);
+					outputs.push_back(opt.list_file);
+				}
+
+				// fewest and most cycles of cycle counted regions at the final addresses
+				if (opt.cycle_report) {
+					if (assembler.CycleReport(opt.cycles_file) && opt.cycles_file) { outputs.push_back(opt.cycles_file); }
+				}
+
+				// debug info with source lines, symbols and macros for external tools
+				if (opt.debug_file && !srcname.same_str(opt.debug_file)) {
+					if (assembler.WriteDebugInfo(opt.debug_file)) {
+						outputs.push_back(strref(opt.debug_file));
 					}
 				}
 
-				// export vice monitor commands
-				if (vs_file && !srcname.same_str(vs_file) && !assembler.map.empty()) {
-					if (FILE *f = fopen(vs_file, "w")) {
-						for (MapSymbolArray::iterator i = assembler.map.begin(); i!=assembler.map.end(); ++i) {
-							uint32_t value = (uint32_t)i->value;
-							if (size_t(i->section) < assembler.allSections.size()) { value += assembler.allSections[i->section].start_address; }
-							if(i->name.same_str("debugbreak")) {
-								fprintf(f, "break $%04x\n", value);
-							} else {
-								fprintf(f, "al $%04x %s" STRREF_FMT "\n", value, i->name[0]=='.' ? "" : ".",
-										STRREF_ARG(i->name));
-							}
-						}
-						fclose(f);
+				// export symbols, duplicates are removed and the symbols are sorted once for all formats
+				if ((opt.sym_file && !srcname.same_str(opt.sym_file)) || (opt.vs_file && !srcname.same_str(opt.vs_file)) ||
+					(opt.symtab_file && !srcname.same_str(opt.symtab_file))) {
+					std::vector<ExportSymbol> symbols;
+					GatherExportSymbols(assembler, symbols, opt.sym_sort);
+					if (opt.sym_file && !srcname.same_str(opt.sym_file) && symbols.size() &&
+						WriteSymFile(opt.sym_file, symbols)) { outputs.push_back(strref(opt.sym_file)); }
+					if (opt.vs_file && !srcname.same_str(opt.vs_file) && symbols.size() &&
+						WriteViceFile(opt.vs_file, symbols)) { outputs.push_back(strref(opt.vs_file)); }
+					if (opt.symtab_file && !srcname.same_str(opt.symtab_file) &&
+						WriteSymbolTable(opt.symtab_file, symbols)) { outputs.push_back(strref(opt.symtab_file)); }
+				}
+
+				// run the built code to measure cycles by source line
+				if (opt.sim_entry && !return_value && !assembler.error_encountered) {
+					bool profile = opt.profile_file && !srcname.same_str(opt.profile_file);
+					if (!assembler.Simulate(opt.sim_entry, opt.sim_stop, opt.sim_max_cycles, profile ? strref(opt.profile_file) : strref())) {
+						return_value = 1;
+					} else if (profile) { outputs.push_back(strref(opt.profile_file)); }
+				}
+
+				// list the files read by the build for make or ninja
+				if (opt.dep_file && !return_value && !assembler.error_encountered) {
+					if (WriteDepFile(opt.dep_file, outputs, assembler)) {
+						outputs.push_back(strref(opt.dep_file));
+					} else {
+						printf("ERROR: COULD NOT WRITE DEPENDENCY FILE \"%s\"\n", opt.dep_file);
+						return_value = 1;
+					}
+				}
+
+				// hashes of the outputs to check that builds are reproducible
+				if (opt.hashes_file && !return_value && !assembler.error_encountered) {
+					if (WriteOutputHashes(opt.hashes_file, outputs)) {
+						outputs.push_back(strref(opt.hashes_file));
+					} else {
+						printf("ERROR: COULD NOT WRITE OUTPUT HASHES \"%s\"\n", opt.hashes_file);
+						return_value = 1;
 					}
 				}
+
+				// save the result for later builds with the same inputs
+				if (cache_key && !return_value && !assembler.error_encountered)
+					StoreCachedBuild(opt.cache_dir, cache_key, assembler, outputs);
 			}
+			if (opt.files_read) { *opt.files_read = assembler.filesRead; }
 			// free some memory
 			assembler.Cleanup();
+		} else {
+			printf("ERROR: COULD NOT OPEN SOURCE FILE \"" STRREF_FMT "\"\n", STRREF_ARG(srcname));
+			return_value = 1;
+		}
+	}
+	return return_value;
+}
+
+// One line of a batch manifest
+struct BatchJob {
+	std::vector<char*> args;
+	int line;
+};
+
+// Builds batch manifest jobs, each job on its own assembler
+struct BatchBuilder {
+	std::vector<BatchJob> *jobs;
+	std::vector<int> *results;
+	FileCache *file_cache;
+	int argc;			// options that apply to all jobs
+	char **argv;
+
+	void Run(int index) {
+		BatchJob &job = (*jobs)[index];
+		Asm assembler;
+		BuildOptions opt;
+		assembler.file_cache = file_cache;
+		int result = ParseOptions(argc, argv, assembler, opt);
+		opt.num_threads = 1;	// the batch is already running in parallel
+		if (result < 0) { result = ParseOptions((int)job.args.size(), &job.args[0], assembler, opt); }
+		if (result < 0) { result = BuildTarget(assembler, opt); }
+		(*results)[index] = result;
+	}
+};
+
+// Split a line into null terminated arguments, ';' or '#' starts a comment.
+// Returns the start of the next line.
+static char* SplitArguments(char *c, std::vector<char*> &args) {
+	while (*c && *c != '\n' && *c != ';' && *c != '#') {
+		if (*c == ' ' || *c == '\t' || *c == '\r') { *c++ = 0; }
+		else if (*c == '"') {
+			args.push_back(++c);
+			while (*c && *c != '"' && *c != '\n') { ++c; }
+			if (*c == '"') { *c++ = 0; }
+		} else {
+			args.push_back(c);
+			while (*c && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') { ++c; }
+		}
+	}
+	while (*c && *c != '\n') { *c++ = 0; }
+	if (*c == '\n') { *c++ = 0; }
+	return c;
+}
+
+// Batch mode, each line of the manifest holds the arguments for one
+// target as on the command line. Jobs are built in parallel and should
+// not depend on output from other jobs in the same manifest.
+static int BuildBatch(int argc, char **argv, const char *batch_file, int num_threads) {
+	FILE *f = fopen(batch_file, "rb");
+	if (!f) {
+		printf("ERROR: COULD NOT OPEN BATCH FILE \"%s\"\n", batch_file);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *manifest = (char*)malloc(size + 1);
+	fread(manifest, size, 1, f);
+	manifest[size] = 0;
+	fclose(f);
+
+	// one job per line with arguments
+	std::vector<BatchJob> jobs;
+	int line = 1;
+	for (char *c = manifest; *c; ++line) {
+		BatchJob job;
+		job.line = line;
+		c = SplitArguments(c, job.args);
+		if (job.args.size()) { jobs.push_back(job); }
+	}
+
+	FileCache cache;
+	std::vector<int> results(jobs.size(), 0);
+	BatchBuilder builder = { &jobs, &results, &cache, argc, argv };
+	ParallelFor(builder, (int)jobs.size(), num_threads);
+
+	int return_value = 0;
+	for (size_t j = 0; j < jobs.size(); ++j) {
+		if (results[j]) {
+			printf("Error: batch job on line %d failed\n", jobs[j].line);
+			return_value = 1;
 		}
 	}
+	free(manifest);
 	return return_value;
 }
+
+#ifndef _WIN32
+// Server mode, build requests from clients connecting to a unix domain socket.
+// A request is the client's working directory on the first line followed by
+// arguments as on the command line on the second line. The build output is sent
+// back followed by a zero byte and the exit code. Files are kept in a file cache
+// between requests. A request with the argument -stop shuts down the server.
+static int RunServer(int argc, char **argv, const char *socket_path) {
+	int server = (int)socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+	unlink(socket_path);
+	if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 16) != 0) {
+		printf("ERROR: COULD NOT OPEN SERVER SOCKET \"%s\"\n", socket_path);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	FileCache cache;
+	bool running = true;
+	while (running) {
+		int client = (int)accept(server, nullptr, nullptr);
+		if (client < 0) { continue; }
+
+		// read the request until the client closes its end
+		std::vector<char> request;
+		char buf[1024];
+		ssize_t bytes;
+		while ((bytes = read(client, buf, sizeof(buf))) > 0)
+			request.insert(request.end(), buf, buf + bytes);
+		request.push_back(0);
+		char *cwd = &request[0];
+		std::vector<char*> args;
+		SplitArguments(strchr(cwd, '\n') ? strchr(cwd, '\n') + 1 : cwd + strlen(cwd), args);
+		if (char *eol = strchr(cwd, '\n')) { *eol = 0; }
+
+		int result = 1;
+		if (args.size() == 1 && strcmp(args[0], "-stop") == 0) {
+			running = false;
+			result = 0;
+		} else if (chdir(cwd) == 0) {
+			cache.SetDirectory(cwd);
+			fflush(stdout);
+			fflush(stderr);
+			int saved_stdout = dup(1), saved_stderr = dup(2);
+			dup2(client, 1);
+			dup2(client, 2);
+			Asm assembler;
+			BuildOptions opt;
+			assembler.file_cache = &cache;
+			result = ParseOptions(argc, argv, assembler, opt);
+			opt.server_socket = nullptr;
+			if (result < 0 && args.size()) { result = ParseOptions((int)args.size(), &args[0], assembler, opt); }
+			if (result < 0) { result = BuildTarget(assembler, opt); }
+			fflush(stdout);
+			fflush(stderr);
+			dup2(saved_stdout, 1);
+			dup2(saved_stderr, 2);
+			close(saved_stdout);
+			close(saved_stderr);
+		}
+		char status[16];
+		int status_len = sprintf(status, "%c%d", 0, result);
+		if (write(client, status, status_len) < 0) {}
+		close(client);
+	}
+	close(server);
+	unlink(socket_path);
+	return 0;
+}
+
+// Client mode, send arguments to a running server and print the result
+static int RunClient(int argc, char **argv, const char *socket_path) {
+	int client = (int)socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+	if (client < 0 || connect(client, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		printf("ERROR: COULD NOT CONNECT TO SERVER \"%s\"\n", socket_path);
+		return 1;
+	}
+	std::vector<char> request;
+	char cwd[1024];
+	if (!getcwd(cwd, sizeof(cwd))) { cwd[0] = 0; }
+	request.insert(request.end(), cwd, cwd + strlen(cwd));
+	request.push_back('\n');
+	for (int a = 0; a < argc; a++) {
+		request.push_back('"');
+		request.insert(request.end(), argv[a], argv[a] + strlen(argv[a]));
+		request.push_back('"');
+		request.push_back(' ');
+	}
+	request.push_back('\n');
+	for (size_t sent = 0; sent < request.size();) {
+		ssize_t bytes = write(client, &request[sent], request.size() - sent);
+		if (bytes <= 0) { break; }
+		sent += bytes;
+	}
+	shutdown(client, SHUT_WR);
+
+	std::vector<char> response;
+	char buf[1024];
+	ssize_t bytes;
+	while ((bytes = read(client, buf, sizeof(buf))) > 0)
+		response.insert(response.end(), buf, buf + bytes);
+	close(client);
+
+	// output is followed by a zero byte and the exit code
+	size_t end = response.size();
+	while (end && response[end-1]) { end--; }
+	if (!end) { return 1; }
+	fwrite(&response[0], end - 1, 1, stdout);
+	response.push_back(0);
+	return atoi(&response[end]);
+}
+#endif
+
+#ifdef __linux__
+// Watch mode, build the target and build it again each time the contents of a file
+// read by the build (source, includes, incbins, object files) change. Files stay in
+// a file cache between builds so only changed files are read again. Directories are
+// watched rather than files so that editors that save by renaming are seen.
+#define WATCH_SETTLE_MS 100		// wait for more changes before building
+
+static int RunWatch(int argc, char **argv) {
+	FileCache cache;
+	std::vector<FileRead> inputs;	// files read by the last build with the hash of the contents
+	for (;;) {
+		int result;
+		{
+			Asm assembler;
+			BuildOptions opt;
+			assembler.file_cache = &cache;
+			result = ParseOptions(argc, argv, assembler, opt);
+			opt.cache_dir = nullptr;		// builds that are skipped do not tell which files they read
+			opt.up_to_date_check = false;
+			std::vector<FileRead> files_read;
+			opt.files_read = &files_read;
+			if (result < 0) { result = BuildTarget(assembler, opt); }
+			inputs.clear();
+			// compare later changes against the contents the build read, not what is on disk now
+			for (size_t i = 0; i < files_read.size(); ++i) {
+				strref name = files_read[i].name.get_strref();
+				bool listed = false;
+				for (size_t j = 0; j < inputs.size() && !listed; ++j) { listed = name.same_str_case(inputs[j].name.get_strref()); }
+				if (!listed) { inputs.push_back(files_read[i]); }
+			}
+			if (opt.source_filename && !inputs.size()) {	// wait for a missing source to be saved
+				FileRead file;
+				file.name.copy(opt.source_filename);
+				file.hash = 0;
+				inputs.push_back(file);
+			}
+		}
+		if (!inputs.size()) { return result; }
+
+		int fd = inotify_init1(IN_CLOEXEC);
+		if (fd < 0) {
+			puts("ERROR: COULD NOT WATCH FILES");
+			return 1;
+		}
+		std::vector<int> watches(inputs.size(), -1);	// watch of each input's directory
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			strown<512> dir(inputs[i].name.get_strref().before_last('/'));
+			if (!dir) { dir.copy("."); }
+			watches[i] = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+		}
+		printf("Watching %d files for changes\n", (int)inputs.size());
+		fflush(stdout);
+
+		bool changed = false;
+		while (!changed) {
+			// wait for a change to a file that was read, then until the changes settle
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			bool touched = false;
+			for (int timeout = -1;;) {
+				struct pollfd pfd = { fd, POLLIN, 0 };
+				int ready = poll(&pfd, 1, timeout);
+				if (ready < 0 && errno != EINTR) { close(fd); return 1; }
+				if (ready <= 0) { if (touched) { break; } continue; }
+				ssize_t bytes = read(fd, events, sizeof(events));
+				for (ssize_t e = 0; e < bytes;) {
+					const struct inotify_event *event = (const struct inotify_event*)(events + e);
+					for (size_t i = 0; event->len && i < inputs.size() && !touched; ++i) {
+						touched = watches[i] == event->wd &&
+							inputs[i].name.get_strref().after_last_or_full('/').same_str(event->name);
+					}
+					e += sizeof(struct inotify_event) + event->len;
+				}
+				if (touched) { timeout = WATCH_SETTLE_MS; }
+			}
+			// a file saved with the same contents does not need a build
+			for (std::vector<FileRead>::iterator i = inputs.begin(); i != inputs.end() && !changed; ++i) {
+				size_t size;
+				char *data = ReadFileData(i->name.c_str(), size);
+				changed = (data ? strref(data, (strl_t)size).fnv1a_64() : 0) != i->hash;
+				if (data) { free(data); }
+			}
+		}
+		close(fd);
+	}
+}
+#endif
+
+int main(int argc, char **argv) {
+	Asm assembler;
+	BuildOptions opt;
+	int parse_result = ParseOptions(argc-1, argv+1, assembler, opt);
+	if (parse_result >= 0) { return parse_result; }
+	for (int a = 1; a < argc; a++) {
+		strref arg(argv[a]);
+		printf(STRREF_FMT "\n", STRREF_ARG(arg));
+	}
+	if (opt.gen_allinstr) {
+		assembler.AllOpcodes(opt.allinstr_file);
+	} else if (opt.server_socket || opt.client_socket) {
+#ifndef _WIN32
+		if (opt.client_socket)
+			return RunClient(argc - 1 - opt.client_arg, argv + 1 + opt.client_arg, opt.client_socket);
+		return RunServer(argc-1, argv+1, opt.server_socket);
+#else
+		puts("ERROR: SERVER MODE IS NOT SUPPORTED ON THIS PLATFORM");
+		return 1;
+#endif
+	} else if (opt.batch_file) {
+		return BuildBatch(argc-1, argv+1, opt.batch_file, opt.num_threads);
+	} else if (opt.watch) {
+#ifdef __linux__
+		return RunWatch(argc-1, argv+1);
+#else
+		puts("ERROR: WATCH MODE IS NOT SUPPORTED ON THIS PLATFORM");
+		return 1;
+#endif
+	} else if (!opt.source_filename && opt.link_objects.empty()) {
+		puts("Usage:\n"
+			 " x65 filename.s code.prg [options]\n"
+			 " x65 -link a.x65 b.x65 ... -o code.prg [options]\n"
+			 "  * -i(path) : Add include path\n"
+			 "  * -D(label)[=value] : Define a label with an optional value (otherwise defined as 1)\n"
+			 "  * -cpu=6502/65c02/65c02wdc/65816: assemble with opcodes for a different cpu\n"
+			 "  * -acc=8/16: set the accumulator mode for 65816 at start, default is 8 bits\n"
+			 "  * -xy=8/16: set the index register mode for 65816 at start, default is 8 bits\n"
+			 "  * -org = $2000 or - org = 4096: force fixed address code at address\n"
+			 "  * -obj (file.x65) : generate object file for later linking\n"
+			 "  * -link (file.x65) ... : link object files without a source file\n"
+			 "  * -batch (file) : build each line of the file as a separate target in parallel\n"
+			 "  * -server (socket) : build requests from clients with files cached between builds\n"
+			 "  * -client (socket) (arguments) : send arguments to a server and print the result\n"
+			 "  * -watch : build again each time a file read by the build changes\n"
+			 "  * -o (file) : binary output file, required with -link\n"
+			 "  * -bin : Raw binary\n"
+			 "  * -c64 : Include load address(default)\n"
+			 "  * -a2b : Apple II Dos 3.3 Binary\n"
+			 "  * -a2p : Apple II ProDos Binary\n"
+			 "  * -a2o : Apple II GS OS executable (relocatable)\n"
+			 "  * -mrg : Force merge all sections (use with -a2o)\n"
+			 "  * -cache=(dir) : reuse results of earlier builds with the same inputs\n"
+			 "  * -dep (file.d) : write a make / ninja dependency file with every file read\n"
+			 "  * -uptodate : skip the build if the targets in the -dep file are newer than its dependencies\n"
+			 "  * -hashes (file) : write the hash and size of each file written by the build\n"
+			 "  * -prefix=(file) : assemble an include file before the source\n"
+			 "  * -pch=(file) : save the state after the prefix and reuse it while the prefix is unchanged\n"
+			 "  * -threads=(n) : number of threads for batch jobs, loading objects, writing binaries and listing, default is one per core\n"
+			 "  * -sym (file.sym) : symbol file\n"
+			 "  * -symtab (file) : binary symbol table with a hash index\n"
+			 "  * -symsort=addr/name : sort exported symbols by address or name instead of definition order\n"
+			 "  * -dbg (file.json) : debug info with addresses of source lines, symbols and macros\n"
+			 "  * -sim=(label/address) : run the built code in a cycle counting simulator\n"
+			 "  * -simstop=(label/address) : end the simulation at an address instead of returning from the entry\n"
+			 "  * -simcycles=(n) : end the simulation after n cycles, default is 100000000\n"
+			 "  * -profile (file) : executions and cycles of each simulated instruction with its source line\n"
+			 "  * -lst / -lst = (file.lst) : generate disassembly text from result(file or stdout)\n"
+			 "  * -cycles / -cycles = (file) : fewest and most cycles through each cycle counted scope (file or stdout)\n"
+			 "  * -zpopt : assemble forward references to zero page addresses as zero page instructions\n"
+			 "  * -relax : assemble branches that are out of range as a branch over a jump\n"
+			 "  * -pageerr : page crossings found within PAGECHECK are errors\n"
+			 "  * -opcodes / -opcodes = (file.s) : dump all available opcodes(file or stdout)\n"
+			 "  * -sect: display sections loaded and built\n"
+			 "  * -vice (file.vs) : export a vice symbol file\n"
+			 "  * -merlin: use Merlin syntax\n"
+			 "  * -endm : macros end with endm or endmacro instead of scoped('{' - '}')\n");
+		return 0;
+	}
+
+	return BuildTarget(assembler, opt);
+}
+
+#endif // X65_LIBRARY
@@ -0,0 +1,123 @@
+//
+//  x65.h
+//
+//
+//	Interface for using the x65 assembler from another application.
+//
+//	Compile x65.cpp with X65_LIBRARY defined to leave out the command
+//	line tool and link it with the application. The assembler works
+//	on memory buffers, files are only read for includes that are not
+//	added with AddFile and nothing is written to disk.
+//
+//	Typical use:
+//		X65Assembler x65;
+//		x65.SetCPU("65816");
+//		x65.AddIncludePath("macros");
+//		x65.Define("DEBUG", "1");
+//		if (x65.Assemble(source, source_size, "main.s") && x65.Link()) {
+//			for (int e = 0; e < x65.GetExportCount(); e++) {
+//				size_t size; int address;
+//				if (uint8_t *binary = x65.Export(e, size, address)) {
+//					...
+//					free(binary);
+//				}
+//			}
+//		}
+//		x65.Reset();	// ready for the next source, keeps allocated memory
+//
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Carl-Henrik Skårstedt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without restriction,
+// including without limitation the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to permit persons to whom the Software
+// is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+// FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// Details, source and documentation at https://github.com/Sakrac/x65.
+//
+
+#ifndef __X65_H__
+#define __X65_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Symbol from the assembled source (names are not zero terminated)
+struct X65Symbol {
+	const char *name;
+	int name_length;
+	int value;				// address if the symbol is in a section
+	int section;			// section index or -1
+	bool local;
+};
+
+// Section from the assembled source (names are not zero terminated)
+struct X65Section {
+	const char *name;
+	int name_length;
+	const uint8_t *data;	// generated bytes, valid until Reset
+	int size;				// number of generated bytes
+	int start_address;		// first address if fixed
+	int end_address;		// end address if fixed
+	bool relative;			// address not yet assigned
+	bool dummy;				// section does not generate data
+};
+
+struct X65State;
+
+class X65Assembler {
+public:
+	X65Assembler();
+	~X65Assembler();
+
+	// Clear everything for another build but keep allocated memory,
+	// options have to be set again after a reset
+	void Reset();
+
+	// Options
+	bool SetCPU(const char *name);				// 6502, 6502ill, 65C02, 65C02WDC, 65816
+	void SetMerlinSyntax(bool merlin);
+	void SetEndMacroDirective(bool endm);
+	void SetDefaultOrg(int address);
+	void AddIncludePath(const char *path);
+	void Define(const char *label, const char *value = "1");
+
+	// Make a file available to includes without reading it from disk
+	void AddFile(const char *filename, const void *data, size_t size);
+
+	// Assemble from memory, the source is copied
+	bool Assemble(const char *source, size_t size, const char *filename, bool object_target = false);
+
+	// Link zero page sections and assign addresses for all exports
+	bool Link();
+
+	// Exported binaries after Link, a binary returned by Export is released with free()
+	int GetExportCount() const;
+	const char* GetExportName(int index, int &name_length) const;
+	uint8_t* Export(int index, size_t &size, int &address);
+
+	// Query the result
+	int GetSymbolCount() const;
+	bool GetSymbol(int index, X65Symbol &symbol) const;
+	int GetSectionCount() const;
+	bool GetSection(int index, X65Section &section) const;
+	bool HasError() const;
+
+private:
+	X65State *state;
+	X65Assembler(const X65Assembler&);
+	X65Assembler& operator=(const X65Assembler&);
+};
+
+#endif // __X65_H__